@@ -0,0 +1,171 @@
+/*
+ * Throughput of each SHA-1 implementation supported by the CPU.
+ *
+ * Usage: sha1_bench [MiB]
+ *
+ * Every implementation hashes the same buffer, its digest is checked against
+ * the generic one and the best of a few runs is reported in cycles per byte
+ * (TSC cycles, so they follow the nominal frequency) and GB/s.
+ *
+ * The same buffer is then split in pieces of PIECE_SIZE bytes and hashed with
+ * sha1_many for every supported number of lanes.
+ */
+#include "sha1.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <x86intrin.h>
+
+#define RUNS       5
+#define PIECE_SIZE (256 * 1024)
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_lanes(const uint8_t* data, size_t size) {
+    static const size_t lanes[] = {1, 4, 8, 16};
+
+    size_t          num_pieces = size / PIECE_SIZE;
+    const uint8_t** pieces     = malloc(num_pieces * sizeof(*pieces));
+    size_t*         sizes      = malloc(num_pieces * sizeof(*sizes));
+    uint8_t(*reference)[SHA1_DIGEST_SIZE]
+        = malloc(num_pieces * sizeof(*reference));
+    uint8_t(*digests)[SHA1_DIGEST_SIZE] = malloc(num_pieces * sizeof(*digests));
+
+    if (pieces == NULL || sizes == NULL || reference == NULL
+        || digests == NULL) {
+        fprintf(stderr, "Failed to allocate %zu pieces\n", num_pieces);
+        free(pieces);
+        free(sizes);
+        free(reference);
+        free(digests);
+        return 1;
+    }
+
+    for (size_t i = 0; i < num_pieces; ++i) {
+        pieces[i] = data + i * PIECE_SIZE;
+        sizes[i]  = PIECE_SIZE;
+        sha1(pieces[i], sizes[i], reference[i]);
+    }
+
+    printf("\n%zu pieces of %d KiB, %s single-buffer implementation\n",
+           num_pieces, PIECE_SIZE / 1024, sha1_impl_name(sha1_get_impl()));
+    printf("%-8s %10s %10s\n", "lanes", "cycles/B", "GB/s");
+
+    int status = 0;
+    for (size_t l = 0; l < sizeof(lanes) / sizeof(lanes[0]); ++l) {
+        if (sha1_set_lanes(lanes[l]) != 0) {
+            printf("%-8zu %10s\n", lanes[l], "unsupported");
+            continue;
+        }
+
+        double best_cpb = 0;
+        double best_gbs = 0;
+        for (int run = 0; run < RUNS; ++run) {
+            double   start  = now_sec();
+            uint64_t cycles = __rdtsc();
+            sha1_many(pieces, sizes, num_pieces, digests);
+            cycles      = __rdtsc() - cycles;
+            double secs = now_sec() - start;
+
+            if (memcmp(digests, reference, num_pieces * SHA1_DIGEST_SIZE)
+                != 0) {
+                printf("%-8zu digest mismatch\n", lanes[l]);
+                status = 1;
+                break;
+            }
+
+            double cpb = (double)cycles / (num_pieces * PIECE_SIZE);
+            if (best_cpb == 0 || cpb < best_cpb) {
+                best_cpb = cpb;
+                best_gbs = num_pieces * PIECE_SIZE / secs / 1e9;
+            }
+        }
+
+        printf("%-8zu %10.2f %10.2f\n", lanes[l], best_cpb, best_gbs);
+    }
+
+    free(pieces);
+    free(sizes);
+    free(reference);
+    free(digests);
+    return status;
+}
+
+int main(int argc, char* argv[]) {
+    size_t size = (argc > 1 ? strtoul(argv[1], NULL, 10) : 256) << 20;
+
+    uint8_t* data = malloc(size);
+    if (data == NULL) {
+        fprintf(stderr, "Failed to allocate %zu bytes\n", size);
+        return 1;
+    }
+
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = (uint8_t)(i * 2654435761u >> 24);
+    }
+
+    uint8_t reference[SHA1_DIGEST_SIZE];
+    sha1_set_impl(SHA1_IMPL_GENERIC);
+    sha1(data, size, reference);
+
+    double generic_cpb = 0;
+    int    status      = 0;
+
+    printf("%-8s %10s %10s %10s\n", "impl", "cycles/B", "GB/s", "speedup");
+    for (int impl = SHA1_IMPL_GENERIC; impl < SHA1_IMPL_COUNT; ++impl) {
+        if (sha1_set_impl(impl) != 0) {
+            printf("%-8s %10s\n", sha1_impl_name(impl), "unsupported");
+            continue;
+        }
+
+        double best_cpb = 0;
+        double best_gbs = 0;
+        for (int run = 0; run < RUNS; ++run) {
+            uint8_t digest[SHA1_DIGEST_SIZE];
+
+            double   start  = now_sec();
+            uint64_t cycles = __rdtsc();
+            sha1(data, size, digest);
+            cycles      = __rdtsc() - cycles;
+            double secs = now_sec() - start;
+
+            if (memcmp(digest, reference, SHA1_DIGEST_SIZE) != 0) {
+                printf("%-8s digest mismatch\n", sha1_impl_name(impl));
+                status = 1;
+                break;
+            }
+
+            double cpb = (double)cycles / size;
+            if (best_cpb == 0 || cpb < best_cpb) {
+                best_cpb = cpb;
+                best_gbs = size / secs / 1e9;
+            }
+        }
+
+        if (impl == SHA1_IMPL_GENERIC) {
+            generic_cpb = best_cpb;
+        }
+
+        printf("%-8s %10.2f %10.2f %9.1fx\n", sha1_impl_name(impl), best_cpb,
+               best_gbs, generic_cpb / best_cpb);
+    }
+
+    // Multi-buffer lanes against the fastest single-buffer implementation
+    for (int impl = SHA1_IMPL_COUNT - 1; impl > SHA1_IMPL_GENERIC; --impl) {
+        if (sha1_set_impl(impl) == 0) {
+            break;
+        }
+    }
+
+    if (bench_lanes(data, size) != 0) {
+        status = 1;
+    }
+
+    free(data);
+    return status;
+}
@@ -0,0 +1,117 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "disk.h"
+#include "piece.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Seconds a verified piece may wait in the cache before it is written
+#define CACHE_MAX_AGE 5
+
+typedef struct cache cache_t;
+
+/**
+ * @brief Create a write-back cache for verified pieces
+ * @details Pieces are kept sorted by index and written in offset order when
+ * the cache is flushed, pieces that follow each other on disk are merged in
+ * a single write (one pwritev per file). Writing a few large sequential
+ * ranges instead of one piece at a time is much faster on spinning disks
+ * and network filesystems.
+ *
+ * The writes are carried out by the disk threads, a piece is freed once the
+ * completion of its write is polled (see disk_poll).
+ *
+ * @param disk The threads that write the pieces
+ * @param piece_length The length of the pieces, except the last one
+ * @return cache_t* The cache, NULL otherwise
+ */
+cache_t* cache_create(disk_t* disk, uint64_t piece_length);
+
+/**
+ * @brief Free the cache
+ * @details Pieces that were not flushed are freed without being written.
+ * The disk threads must be freed first, so no write is in flight.
+ *
+ * @param cache The cache
+ */
+void cache_free(cache_t* cache);
+
+/**
+ * @brief Add a verified piece to the cache
+ * @details The cache owns the piece, which is freed once written
+ *
+ * @param cache The cache
+ * @param piece The piece, its data must not be mapped
+ * @return int 0 if successful, -1 otherwise
+ */
+int cache_add(cache_t* cache, piece_t* piece);
+
+/**
+ * @brief Get the number of bytes held by the cache, including the pieces
+ * being written
+ *
+ * @param cache The cache
+ * @return size_t The number of bytes
+ */
+size_t cache_bytes(const cache_t* cache);
+
+/**
+ * @brief Get the number of bytes waiting for the next flush
+ *
+ * @param cache The cache
+ * @return size_t The number of bytes
+ */
+size_t cache_dirty_bytes(const cache_t* cache);
+
+/**
+ * @brief Check if a write failed, the download can't complete then
+ *
+ * @param cache The cache
+ * @return true if a write failed
+ */
+bool cache_failed(const cache_t* cache);
+
+/**
+ * @brief Find a piece that is not on disk yet, waiting or being written
+ * @details The data stays valid until the next flush or disk_poll
+ *
+ * @param cache The cache
+ * @param index The piece index
+ * @return const uint8_t* The data of the piece, NULL if it is not in the
+ * cache
+ */
+const uint8_t* cache_find(const cache_t* cache, uint32_t index);
+
+/**
+ * @brief Check if a piece waited in the cache for more than CACHE_MAX_AGE
+ * seconds
+ *
+ * @param cache The cache
+ * @param now The current time
+ * @return true if the cache should be flushed
+ */
+bool cache_expired(const cache_t* cache, time_t now);
+
+/**
+ * @brief Hand every piece waiting in the cache to the disk threads
+ * @details Pieces that can't be queued stay in the cache
+ *
+ * @param cache The cache
+ * @return int 0 if successful, -1 otherwise (also if an earlier write
+ * failed)
+ */
+int cache_flush(cache_t* cache);
+
+/**
+ * @brief Flush the cache and wait until every piece is on disk
+ *
+ * @param cache The cache
+ * @return int 0 if successful, -1 otherwise
+ */
+int cache_sync(cache_t* cache);
+
+#endif // !CACHE_H
@@ -0,0 +1,27 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include "byte_str.h"
+#include "torrent.h"
+
+#include <stdlib.h>
+
+// Upper bound for the number of checking threads
+#define CHECK_MAX_THREADS 64
+
+/**
+ * @brief Verify the data already on disk against the piece hashes
+ * @details The files are memory-mapped and the pieces are split in
+ * contiguous ranges, one per thread, each hashed several pieces at a time
+ * (see sha1_many). Progress and throughput are logged every second.
+ *
+ * Missing or short files only make the pieces they hold incomplete.
+ * `torrent->pieces_left` is updated to the number of incomplete pieces.
+ *
+ * @param torrent The torrent
+ * @param num_threads The number of threads, 0 for one per CPU
+ * @return byte_str_t* The bitfield of the complete pieces, NULL otherwise
+ */
+byte_str_t* check_torrent(torrent_t* torrent, size_t num_threads);
+
+#endif // !CHECK_H
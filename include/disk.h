@@ -0,0 +1,123 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include "storage.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+// Default and maximum number of disk threads. Writes are bound by the disk,
+// a second thread only keeps one slow write from holding back the others.
+#define DISK_DEFAULT_THREADS 2
+#define DISK_MAX_THREADS     8
+
+typedef struct disk disk_t;
+
+/**
+ * Called on the network thread (from disk_poll) when a job is done
+ *
+ * @param ctx The context given with the job
+ * @param result 0 if the job was successful, -1 otherwise
+ */
+typedef void (*disk_done_fn_t)(void* ctx, int result);
+
+/**
+ * Called on a disk thread for a job queued with disk_call
+ *
+ * @param ctx The context given with the job
+ * @return int 0 if successful, -1 otherwise
+ */
+typedef int (*disk_work_fn_t)(void* ctx);
+
+/**
+ * @brief Create a pool of threads that write to the storage
+ * @details Pending jobs are kept sorted by their offset in the torrent data,
+ * which is also the order of the files and of the offsets in each file. The
+ * threads serve them like an elevator going one way (C-SCAN): the next job
+ * is the first one after the last position written, wrapping around to the
+ * lowest offset at the end, which keeps seeks short.
+ *
+ * Completions are posted to a lock-free queue and signaled through an eventfd
+ * (see disk_fd), so the network loop never waits on the disk.
+ *
+ * @param storage Where the data is written
+ * @param num_threads The number of threads, 0 for DISK_DEFAULT_THREADS
+ * @return disk_t* The pool, NULL otherwise
+ */
+disk_t* disk_create(storage_t* storage, size_t num_threads);
+
+/**
+ * @brief Stop the threads and free the pool
+ * @details Jobs already submitted are carried out first and their callbacks
+ * are called, so their buffers can be freed
+ *
+ * @param disk The pool
+ */
+void disk_free(disk_t* disk);
+
+/**
+ * @brief Get the file descriptor that becomes readable when jobs are done
+ *
+ * @param disk The pool
+ * @return int The file descriptor
+ */
+int disk_fd(const disk_t* disk);
+
+/**
+ * @brief Queue a write of buffers to a range of the torrent data
+ * @details The buffers are written back to back from `offset` with
+ * storage_writev. They must stay valid until `done` is called, the array
+ * describing them is copied.
+ *
+ * @param disk The pool
+ * @param offset The offset in the torrent data
+ * @param iov The buffers
+ * @param iovcnt The number of buffers
+ * @param done Called when the buffers are written
+ * @param ctx Passed to `done`
+ * @return int 0 if successful, -1 otherwise
+ */
+int disk_write(disk_t* disk, uint64_t offset, const struct iovec* iov,
+               int iovcnt, disk_done_fn_t done, void* ctx);
+
+/**
+ * @brief Queue a function to run on a disk thread
+ * @details For work that blocks on the disk other than a single write, such
+ * as syncing files. The job is taken at the end of a sweep of the elevator,
+ * it is not ordered with the writes carried out by the other threads.
+ *
+ * @param disk The pool
+ * @param work Called on a disk thread, its result is passed to `done`
+ * @param done Called when `work` returned
+ * @param ctx Passed to `work` and `done`
+ * @return int 0 if successful, -1 otherwise
+ */
+int disk_call(disk_t* disk, disk_work_fn_t work, disk_done_fn_t done,
+              void* ctx);
+
+/**
+ * @brief Wait until every job submitted is done
+ * @details The callbacks are not called, see disk_poll
+ *
+ * @param disk The pool
+ */
+void disk_wait(disk_t* disk);
+
+/**
+ * @brief Call the callbacks of the jobs that are done, in the order they
+ * completed
+ *
+ * @param disk The pool
+ * @return size_t The number of jobs
+ */
+size_t disk_poll(disk_t* disk);
+
+/**
+ * @brief Log the write throughput of each thread
+ *
+ * @param disk The pool
+ */
+void disk_log_stats(const disk_t* disk);
+
+#endif // !DISK_H
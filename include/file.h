@@ -4,17 +4,43 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Upper bound for the number of files kept open at the same time, it is also
+// kept under a quarter of RLIMIT_NOFILE
+#define FILE_MAX_OPEN 256
 
 typedef struct file file_t;
 
+// How the space of a file is reserved when it is created
+typedef enum {
+    FILE_ALLOC_SPARSE, // extended with ftruncate, blocks come as data does
+    FILE_ALLOC_FULL,   // every block reserved up front with fallocate
+    FILE_ALLOC_NONE,   // left as is, grows as data is written
+} file_alloc_t;
+
 /**
  * @brief Create a new file
+ * @details An existing file keeps its data, it is only truncated to `size`
+ * if it is bigger. A smaller one is extended according to `alloc`; zeros are
+ * only written when the filesystem supports neither ftruncate nor fallocate
  *
  * @param path The path to the file
  * @param size The size of the file
+ * @param alloc How to reserve the space of the file
  * @return file_t* The file
  */
-file_t* file_create(const char* path, size_t size);
+file_t* file_create(const char* path, size_t size, file_alloc_t alloc);
+
+/**
+ * @brief Parse the name of an allocation mode
+ *
+ * @param name `sparse`, `full` or `none`
+ * @param alloc Where to store the mode
+ * @return int 0 if the name is valid, -1 otherwise
+ */
+int file_alloc_parse(const char* name, file_alloc_t* alloc);
 
 /**
  * @brief Get the size of the file
@@ -32,8 +58,17 @@ size_t get_file_size(const file_t* file);
  */
 const char* get_file_path(const file_t* file);
 
+/**
+ * @brief Free the file, closing its descriptor if it is open
+ *
+ * @param file The file
+ */
+void file_free(file_t* file);
+
 /**
  * @brief Write data to a file
+ * @details Descriptors are kept open between calls, up to FILE_MAX_OPEN
+ * files at once, the least recently used one is closed to open another
  *
  * @param file The file
  * @param offset The offset to write the data
@@ -43,6 +78,59 @@ const char* get_file_path(const file_t* file);
  */
 int write_data_to_file(file_t* file, size_t offset, uint8_t* data, size_t len);
 
+/**
+ * @brief Write buffers back to back to a file with pwritev
+ * @details The buffers are updated as they are written, they must not be
+ * reused afterwards
+ *
+ * @param file The file
+ * @param offset The offset to write the first buffer at
+ * @param iov The buffers
+ * @param iovcnt The number of buffers, at most IOV_MAX
+ * @return int 0 if successful, -1 otherwise
+ */
+int writev_data_to_file(file_t* file, size_t offset, struct iovec* iov,
+                        int iovcnt);
+
+/**
+ * @brief Map part of a file in memory, shared and writable
+ * @details A file shorter than `offset + len` is extended first so the whole
+ * mapping is backed by the file. Unmap it with munmap.
+ *
+ * @param file The file
+ * @param offset The offset of the mapping, a multiple of the page size
+ * @param len The length of the mapping
+ * @return uint8_t* The mapping, NULL otherwise
+ */
+uint8_t* map_file(file_t* file, size_t offset, size_t len);
+
+/**
+ * @brief Read data from a file
+ *
+ * @param file The file
+ * @param offset The offset to read the data from
+ * @param data Where to store the data
+ * @param len The length of the data
+ * @return int 0 if successful, -1 otherwise
+ */
+int read_data_from_file(file_t* file, size_t offset, uint8_t* data,
+                        size_t len);
+
+/**
+ * @brief Send data from a file to a socket with sendfile
+ * @details The data goes from the page cache to the socket without being
+ * copied through user space. The socket may be non-blocking, in which case
+ * only part of the data may be sent.
+ *
+ * @param file The file
+ * @param sockfd The socket
+ * @param offset The offset in the file
+ * @param len The length of the data
+ * @return ssize_t The number of bytes sent, -1 with errno set otherwise
+ */
+ssize_t send_data_from_file(file_t* file, int sockfd, size_t offset,
+                            size_t len);
+
 /**
  * @brief Creates a new directory
  *
@@ -0,0 +1,89 @@
+#ifndef HASHER_H
+#define HASHER_H
+
+#include "piece.h"
+#include "sha1.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Upper bound for the number of hashing threads
+#define HASHER_MAX_THREADS 16
+
+typedef struct hasher hasher_t;
+
+typedef struct {
+    piece_t* piece;
+    bool     valid;
+    uint8_t  digest[SHA1_DIGEST_SIZE];
+} hasher_result_t;
+
+typedef void (*hasher_done_fn_t)(void* ctx, const hasher_result_t* result);
+
+/**
+ * @brief Create a pool of threads that verify complete pieces
+ * @details Results are posted to a lock-free queue and signaled through an
+ * eventfd (see hasher_fd), so the network loop never waits on hashing
+ *
+ * @param num_threads The number of threads, 0 for one per CPU
+ * @return hasher_t* The pool, NULL otherwise
+ */
+hasher_t* hasher_create(size_t num_threads);
+
+/**
+ * @brief Stop the threads and free the pool
+ * @details Pieces that were submitted and not handed back are freed
+ *
+ * @param hasher The pool
+ */
+void hasher_free(hasher_t* hasher);
+
+/**
+ * @brief Get the file descriptor that becomes readable when results are ready
+ *
+ * @param hasher The pool
+ * @return int The file descriptor
+ */
+int hasher_fd(const hasher_t* hasher);
+
+/**
+ * @brief Queue a complete piece for verification
+ * @details The pool owns the piece until it is handed back by hasher_poll.
+ * Blocks the piece already hashed (see piece_receive_block) are not hashed
+ * again, the pool hashes the rest.
+ *
+ * @param hasher The pool
+ * @param piece The piece
+ * @param expected The expected digest
+ * @return int 0 if successful, -1 otherwise
+ */
+int hasher_submit(hasher_t* hasher, piece_t* piece,
+                  const uint8_t expected[SHA1_DIGEST_SIZE]);
+
+/**
+ * @brief Hand back every verified piece
+ *
+ * @param hasher The pool
+ * @param done The function called for each result, it owns the piece
+ * @param ctx Passed to `done`
+ * @return size_t The number of results
+ */
+size_t hasher_poll(hasher_t* hasher, hasher_done_fn_t done, void* ctx);
+
+/**
+ * @brief Get the number of bytes hashed by every thread so far
+ *
+ * @param hasher The pool
+ * @return uint64_t The number of bytes
+ */
+uint64_t hasher_bytes(const hasher_t* hasher);
+
+/**
+ * @brief Log the hashing throughput of each thread
+ *
+ * @param hasher The pool
+ */
+void hasher_log_stats(const hasher_t* hasher);
+
+#endif // !HASHER_H
@@ -0,0 +1,50 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+// Connections waiting to be accepted before new ones are refused by the
+// kernel
+#define LISTENER_BACKLOG 64
+
+typedef struct listener listener_t;
+
+/**
+ * @brief Listen for incoming peer connections on every interface
+ * @details The socket is non-blocking, it becomes readable when connections
+ * are waiting (see listener_fd and listener_accept)
+ *
+ * @param port The port, in host byte order
+ * @return listener_t* The listener, NULL otherwise
+ */
+listener_t* listener_create(uint16_t port);
+
+/**
+ * @brief Close the socket and free the listener
+ *
+ * @param listener The listener
+ */
+void listener_free(listener_t* listener);
+
+/**
+ * @brief Get the file descriptor that becomes readable when connections are
+ * waiting
+ *
+ * @param listener The listener
+ * @return int The file descriptor
+ */
+int listener_fd(const listener_t* listener);
+
+/**
+ * @brief Accept the next waiting connection without blocking
+ * @details The socket is non-blocking. It is up to the caller to close it
+ * right away if it can't take more peers, nothing else is allocated for it.
+ *
+ * @param listener The listener
+ * @param addr Where to store the address of the peer
+ * @return int The socket, -1 if no connection is waiting or on error
+ */
+int listener_accept(listener_t* listener, struct sockaddr_in* addr);
+
+#endif // !LISTENER_H
@@ -3,24 +3,131 @@
 
 #include "byte_str.h"
 #include "peer_id.h"
+#include "peer_msg.h"
+#include "ring_buf.h"
 #include "torrent.h"
 
 #include <netinet/in.h>
 #include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
 
 #define BLOCK_SIZE (16 * 1024)
 
+// Bounds for the number of outstanding requests to a single peer
+#define PEER_MIN_QUEUE_DEPTH     2
+#define PEER_DEFAULT_QUEUE_DEPTH 5
+#define PEER_MAX_QUEUE_DEPTH     256
+
+// Requests from a peer waiting to be served, more are ignored
+#define PEER_MAX_UPLOADS 256
+
+// Pieces a peer may request from us while choked (Fast Extension)
+#define PEER_ALLOWED_FAST_SET 10
+
+// Allowed fast and suggested pieces kept from a peer, more are ignored
+#define PEER_MAX_ALLOWED_FAST 32
+#define PEER_MAX_SUGGESTED    16
+
+typedef enum {
+    PEER_STATE_DISCONNECTED,
+    PEER_STATE_CONNECTING, // non-blocking connect in progress
+    PEER_STATE_HANDSHAKE,  // handshake sent, waiting for the peer's one
+    PEER_STATE_ACTIVE,     // handshake done, exchanging messages
+} peer_state_t;
+
+typedef struct {
+    uint32_t index;
+    uint32_t begin;
+    uint32_t length;
+    uint8_t* dest;    // where the block is received
+    uint64_t sent_ms; // 0 if the request can't be used as an RTT sample
+} peer_request_t;
+
+/**
+ * Send up to `len` bytes of the torrent data at `offset` to a socket
+ *
+ * @return ssize_t The number of bytes sent, -1 with errno set otherwise
+ */
+typedef ssize_t (*peer_send_fn_t)(void* ctx, int sockfd, uint64_t offset,
+                                  size_t len);
+
 typedef struct {
     int                sockfd;
     uint8_t            id[PEER_ID_SIZE];
     struct sockaddr_in addr;
     byte_str_t*        bitfield;
 
+    peer_state_t state;
+    time_t       last_recv;
+    bool         inbound; // connected to us, see peer_accept
+    bool         fast;    // both sides support the Fast Extension (BEP 6)
+
     // NOTE: Maybe add a uint8_t state to keep track of more states
-    bool choked;
-    bool interested;
+    bool choked;          // the peer doesn't serve our requests
+    bool interested;      // we want pieces of the peer
+    bool choking;         // we don't serve the peer's requests
+    bool peer_interested; // the peer wants pieces we have
+
+    // Data received but not yet parsed by peer_read
+    ring_buf_t* rx;
+
+    // Encoded messages waiting to be sent, see peer_flush
+    uint8_t* tx;
+    size_t   tx_len;
+    size_t   tx_sent;
+    size_t   tx_cap;
+    bool     flush_queued; // already in the session's flush queue
+
+    // Block of a PIECE message sent with `tx_send` right after its header,
+    // which ends at `tx_block_at` in `tx`. None if `tx_block_left` is 0.
+    peer_send_fn_t tx_send;
+    void*          tx_send_ctx;
+    uint64_t       tx_block_offset;
+    size_t         tx_block_left;
+    size_t         tx_block_at;
+
+    // Requests received and not yet served, oldest first
+    peer_request_msg_t uploads[PEER_MAX_UPLOADS];
+    uint32_t           num_uploads;
+
+    // Block of a PIECE message being received in place, NULL if none
+    uint8_t* rx_dest;
+    size_t   rx_dest_len;
+    size_t   rx_dest_recv;
+    uint32_t rx_dest_index;
+    uint32_t rx_dest_begin;
+    uint8_t* rx_scratch; // receives blocks that are no longer wanted
+
+    // Requests sent and not yet answered, oldest first
+    peer_request_t requests[PEER_MAX_QUEUE_DEPTH];
+    uint32_t       num_requests;
+    uint32_t       queue_depth; // how many requests may be outstanding
+
+    // Transfer statistics, updated by the session
+    uint64_t bytes_down;      // bytes of block data received so far
+    uint64_t bytes_down_tick; // bytes received since the last rate update
+    uint64_t download_rate;   // bytes per second
+    uint32_t rtt_ms;          // smoothed round trip time, 0 if unknown
+    uint64_t bytes_up;        // bytes of block data sent so far
+    uint64_t bytes_up_tick;   // bytes sent since the last rate update
+    uint64_t upload_rate;     // bytes per second
+
+    // Blocks it sent in pieces being verified, which still point to it
+    // (see piece_t owners). Kept across connections.
+    uint32_t blocks_verifying;
 
-    // NOTE: Future reference: check Deluge's lazy bitfield implementation
+    // Pieces the peer lets us request while it chokes us (ALLOWED FAST)
+    uint32_t allowed_fast[PEER_MAX_ALLOWED_FAST];
+    uint32_t num_allowed_fast;
+
+    // Pieces the peer suggested (SUGGEST), oldest first
+    uint32_t suggested[PEER_MAX_SUGGESTED];
+    uint32_t num_suggested;
+
+    // Pieces we serve to the peer while choking it, see peer_allowed_fast_set
+    uint32_t allowed_up[PEER_ALLOWED_FAST_SET];
+    uint32_t num_allowed_up;
 } peer_t;
 
 /**
@@ -35,13 +142,122 @@ peer_t* peer_create(uint32_t ip, uint16_t port,
                     const uint8_t peer_id[PEER_ID_SIZE]);
 
 /**
- * @brief Connect to a peer
+ * @brief Start a non-blocking connection to a peer
+ * @details The peer is left in the CONNECTING state, the socket becomes
+ * writable once the connection is established (see peer_finish_connect)
+ *
+ * @param peer The peer
+ * @return int 0 if the connection is in progress, -1 otherwise
+ */
+int peer_connect(peer_t* peer);
+
+/**
+ * @brief Finish a non-blocking connection and send the handshake
+ *
+ * @param peer The peer
+ * @param info_hash The info hash of the torrent
+ * @return int 0 if the handshake was sent, -1 otherwise
+ */
+int peer_finish_connect(peer_t* peer, const uint8_t info_hash[SHA1_DIGEST_SIZE]);
+
+/**
+ * @brief Take a connection accepted from the listener
+ * @details The peer is left in the HANDSHAKE state, waiting for the peer's
+ * handshake. Ours is only sent back once the info hash in it matches the
+ * torrent (see peer_read).
+ *
+ * @param peer The peer, disconnected
+ * @param sockfd The non-blocking socket
+ * @param addr The address of the peer
+ * @return int 0 if successful, -1 otherwise
+ */
+int peer_accept(peer_t* peer, int sockfd, const struct sockaddr_in* addr);
+
+/**
+ * @brief Read the next message from a peer without blocking
+ * @details Handles the handshake while in the HANDSHAKE state, answering it
+ * for inbound peers, and skips keep-alive messages. Should be called until
+ * it returns 0 since sockets are registered as edge-triggered.
+ *
+ * The socket is read in large chunks into a per-peer ring buffer and
+ * messages are parsed out of it, so one read usually yields several messages
+ * and partial messages are kept until the rest arrives.
+ *
+ * The block of a PIECE message that matches one of `peer->requests` is
+ * received straight into the request's `dest` buffer, in which case the
+ * message's `block` is NULL.
  *
  * @param peer The peer
  * @param info_hash The info hash of the torrent
- * @return true if the peer is connected, false otherwise
+ * @param msg Where to store the message, must be freed with peer_msg_free
+ * @return int 1 if a message was read, 0 if the read would block,
+ *             -1 if the connection failed or was closed
  */
-int peer_connect(peer_t* peer, const uint8_t info_hash[SHA1_DIGEST_SIZE]);
+int peer_read(peer_t* peer, const uint8_t info_hash[SHA1_DIGEST_SIZE],
+              peer_msg_t** msg);
+
+/**
+ * @brief Stop receiving the current block in place
+ * @details Must be called before the destination of an outstanding request
+ * is freed or given to another peer. The rest of the block being received,
+ * if any, goes to a scratch buffer and the PIECE message is still returned by
+ * peer_read once complete.
+ *
+ * @param peer The peer
+ * @return int 0 if successful, -1 otherwise
+ */
+int peer_discard_block(peer_t* peer);
+
+/**
+ * @brief Queue a message to be sent to a peer
+ * @details The message is framed into the peer's output buffer, nothing is
+ * sent until peer_flush is called. This way every message produced while
+ * handling a batch of events goes out with a single send.
+ *
+ * @param peer The peer
+ * @param msg The message
+ * @return int 0 if successful, -1 otherwise
+ */
+int peer_queue_msg(peer_t* peer, const peer_msg_t* msg);
+
+/**
+ * @brief Queue a PIECE message with a block that is in memory
+ *
+ * @param peer The peer
+ * @param request The block
+ * @param data The data of the block
+ * @return int 0 if successful, -1 otherwise
+ */
+int peer_queue_block(peer_t* peer, const peer_request_msg_t* request,
+                     const uint8_t* data);
+
+/**
+ * @brief Queue a PIECE message with a block that is sent from the files
+ * @details Only the header goes to the output buffer, peer_flush sends the
+ * block with `send` (e.g. sendfile from the file to the socket) once the
+ * header is out, so the data is never copied through user space. There can
+ * only be one such block queued at a time.
+ *
+ * @param peer The peer
+ * @param request The block
+ * @param offset The offset of the block in the torrent data
+ * @param send Sends the block
+ * @param ctx Passed to `send`
+ * @return int 0 if successful, -1 otherwise
+ */
+int peer_queue_block_send(peer_t* peer, const peer_request_msg_t* request,
+                          uint64_t offset, peer_send_fn_t send, void* ctx);
+
+/**
+ * @brief Send as much of the output buffer as the socket takes
+ * @details A block queued with peer_queue_block_send is sent after its
+ * header, before the messages queued after it
+ *
+ * @param peer The peer
+ * @return int 1 if the buffer was emptied, 0 if the socket would block
+ *             (retry once it is writable), -1 on error
+ */
+int peer_flush(peer_t* peer);
 
 /**
  * @brief Check if a peer has a piece
@@ -59,16 +275,37 @@ int peer_connect(peer_t* peer, const uint8_t info_hash[SHA1_DIGEST_SIZE]);
 bool peer_has_piece(peer_t* peer, uint32_t index);
 
 /**
- * @brief Download a piece from a peer
- * @details For now, only single file torrents are supported
- * (still need to find how to send the correct data to the file)
+ * @brief Mark a piece as available from a peer, e.g. after a HAVE message
  *
  * @param peer The peer
- * @param torrent The torrent
  * @param index The piece index
+ * @return int 0 if successful, -1 if the index is outside the bitfield
+ */
+int peer_set_piece(peer_t* peer, uint32_t index);
+
+/**
+ * @brief Compute the allowed fast set of a peer
+ * @details Uses the canonical algorithm of BEP 6, so the set only depends on
+ * the peer's /24 network and the torrent: reconnecting or opening several
+ * connections from the same network gives no extra pieces. The set is
+ * stored in `peer->allowed_up`.
+ *
+ * @param peer The peer
+ * @param info_hash The info hash of the torrent
+ * @param num_pieces The number of pieces of the torrent
  * @return int 0 if successful, -1 otherwise
  */
-int download_piece(peer_t* peer, torrent_t* torrent, uint32_t index);
+int peer_allowed_fast_set(peer_t*       peer,
+                          const uint8_t info_hash[SHA1_DIGEST_SIZE],
+                          uint32_t      num_pieces);
+
+/**
+ * @brief Close the connection and release the connection state
+ * @details The peer can be connected again with peer_connect
+ *
+ * @param peer The peer
+ */
+void peer_disconnect(peer_t* peer);
 
 /**
  * @brief Close the connection and free the peer
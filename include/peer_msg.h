@@ -3,8 +3,13 @@
 
 #include "byte_str.h"
 
+#include <stddef.h>
 #include <stdint.h>
 
+// Upper bound for the length prefix of a message, anything bigger is treated
+// as a protocol error (a bitfield for 8M pieces or a 1 MiB block)
+#define PEER_MSG_MAX_LEN (1 << 20)
+
 typedef enum __attribute__((packed)) {
     PEER_MSG_CHOKE,
     PEER_MSG_UNCHOKE,
@@ -15,6 +20,13 @@ typedef enum __attribute__((packed)) {
     PEER_MSG_REQUEST,
     PEER_MSG_PIECE,
     PEER_MSG_CANCEL,
+
+    // Fast Extension (BEP 6), only sent to peers that support it
+    PEER_MSG_SUGGEST = 0x0D,
+    PEER_MSG_HAVE_ALL,
+    PEER_MSG_HAVE_NONE,
+    PEER_MSG_REJECT,
+    PEER_MSG_ALLOWED_FAST,
 } peer_msg_type_t;
 
 typedef struct {
@@ -26,35 +38,47 @@ typedef struct {
 typedef struct {
     uint32_t    index;
     uint32_t    begin;
-    byte_str_t* block;
+    uint32_t    length;
+    byte_str_t* block; // NULL if the block was received in place
 } peer_piece_msg_t;
 
 typedef struct {
     peer_msg_type_t type;
     union {
-        uint32_t           index;    // HAVE
+        uint32_t           index;    // HAVE, SUGGEST, ALLOWED FAST
         byte_str_t*        bitfield; // BITFIELD
-        peer_request_msg_t request;  // REQUEST, CANCEL
+        peer_request_msg_t request;  // REQUEST, CANCEL, REJECT
         peer_piece_msg_t   piece;    // PIECE
     } payload;
 } peer_msg_t;
 
 /**
- * @brief Send a message to a peer
+ * @brief Get the length of a message on the wire, length prefix included
+ *
+ * @param msg The message
+ * @return size_t The number of bytes peer_msg_encode writes
+ */
+size_t peer_msg_encoded_len(const peer_msg_t* msg);
+
+/**
+ * @brief Serialize a message, length prefix included
  *
- * @param sockfd The socket file descriptor
- * @param msg The message to send
- * @return int 0 if successful, -1 otherwise
+ * @param msg The message
+ * @param buf The buffer, must hold at least peer_msg_encoded_len(msg) bytes
+ * @return size_t The number of bytes written
  */
-int peer_send_msg(int sockfd, peer_msg_t* msg);
+size_t peer_msg_encode(const peer_msg_t* msg, uint8_t* buf);
 
 /**
- * @brief Receive a message from a peer
+ * @brief Decode a message from its wire representation
+ * @details The length prefix is not part of `data`, so `data[0]` is the
+ * message type. Keep-alive messages (length 0) must be handled by the caller.
  *
- * @param sockfd The socket file descriptor
- * @return peer_msg_t* The message received, NULL otherwise
+ * @param data The message type followed by its payload
+ * @param len The length of the data
+ * @return peer_msg_t* The decoded message, NULL otherwise
  */
-peer_msg_t* peer_recv_msg(int sockfd);
+peer_msg_t* peer_msg_decode(const uint8_t* data, uint32_t len);
 
 /**
  * @brief Free a message
@@ -0,0 +1,117 @@
+#ifndef PICKER_H
+#define PICKER_H
+
+#include "byte_str.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct picker picker_t;
+
+/**
+ * @brief Create a new rarest-first piece picker
+ * @details The picker counts how many connected peers have each piece and
+ * keeps the pieces that are still wanted sorted by that count, so updates
+ * take constant time and picking starts from the rarest piece instead of
+ * scanning every piece
+ *
+ * Every piece starts as wanted, with no peer having it.
+ *
+ * @param num_pieces The number of pieces of the torrent
+ * @return picker_t* The picker, NULL otherwise
+ */
+picker_t* picker_create(size_t num_pieces);
+
+/**
+ * @brief Free the picker
+ *
+ * @param picker The picker
+ */
+void picker_free(picker_t* picker);
+
+/**
+ * @brief Count the pieces of a peer's bitfield
+ * @details Bits past the number of pieces are ignored
+ *
+ * @param picker The picker
+ * @param bitfield The bitfield
+ */
+void picker_add_bitfield(picker_t* picker, const byte_str_t* bitfield);
+
+/**
+ * @brief Stop counting the pieces of a peer's bitfield, e.g. when the peer
+ * disconnects
+ *
+ * @param picker The picker
+ * @param bitfield The bitfield, as counted by picker_add_bitfield and
+ *                 picker_add_have
+ */
+void picker_remove_bitfield(picker_t* picker, const byte_str_t* bitfield);
+
+/**
+ * @brief Count a piece announced with a HAVE message
+ *
+ * @param picker The picker
+ * @param index The piece index
+ */
+void picker_add_have(picker_t* picker, uint32_t index);
+
+/**
+ * @brief Pick the rarest wanted piece from a peer's bitfield
+ * @details The piece is no longer wanted until it is given back with
+ * picker_release. Ties between equally rare pieces are broken arbitrarily.
+ *
+ * @param picker The picker
+ * @param bitfield The bitfield of the peer
+ * @param index Where to store the piece index
+ * @return int 0 if a piece was picked, -1 if the peer has no wanted piece
+ */
+int picker_pick(picker_t* picker, const byte_str_t* bitfield,
+                uint32_t* index);
+
+/**
+ * @brief Pick a given piece, e.g. one suggested by a peer
+ * @details Like picker_pick, the piece is no longer wanted until it is given
+ * back with picker_release
+ *
+ * @param picker The picker
+ * @param index The piece index
+ * @return int 0 if the piece was picked, -1 if it isn't wanted
+ */
+int picker_take(picker_t* picker, uint32_t index);
+
+/**
+ * @brief Make a picked piece wanted again, e.g. when its download failed
+ *
+ * @param picker The picker
+ * @param index The piece index
+ */
+void picker_release(picker_t* picker, uint32_t index);
+
+/**
+ * @brief Mark a piece that is already downloaded, e.g. found on disk
+ * @details The piece is no longer wanted
+ *
+ * @param picker The picker
+ * @param index The piece index
+ */
+void picker_set_have(picker_t* picker, uint32_t index);
+
+/**
+ * @brief Get the number of pieces that are still wanted
+ *
+ * @param picker The picker
+ * @return size_t The number of pieces neither picked nor downloaded
+ */
+size_t picker_num_wanted(const picker_t* picker);
+
+/**
+ * @brief Get the number of connected peers that have a piece
+ *
+ * @param picker The picker
+ * @param index The piece index
+ * @return uint32_t The number of peers
+ */
+uint32_t picker_availability(const picker_t* picker, uint32_t index);
+
+#endif // !PICKER_H
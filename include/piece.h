@@ -0,0 +1,172 @@
+#ifndef PIECE_H
+#define PIECE_H
+
+#include "peer.h"
+#include "sha1.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * A piece being downloaded, split in blocks of BLOCK_SIZE bytes (the last
+ * one may be shorter). Blocks are tracked separately so a piece can be
+ * fetched from several peers at once.
+ *
+ * The state of each block is kept in bitmaps, one bit per block:
+ * - requested: asked from a peer, stays set once the block is received
+ * - received: stored in `data`
+ * - written: stored on disk
+ *
+ * In endgame a block may be requested from several peers at once, `pending`
+ * counts the requests still in flight for each block.
+ *
+ * Blocks that arrive in order are hashed right away, while they are still in
+ * cache. Once a block arrives out of order the rest of the piece is left to
+ * the hasher threads (see hasher_submit), so filling a gap never makes the
+ * network thread hash the blocks received after it.
+ */
+typedef struct {
+    uint32_t index;
+    uint32_t length;
+    uint32_t num_blocks;
+    uint8_t* data;
+    bool     mapped; // `data` belongs to the storage, not to the piece
+
+    uint8_t* requested;
+    uint8_t* received;
+    uint8_t* written;
+    uint32_t num_requested;
+    uint32_t num_received;
+
+    uint8_t* pending;
+
+    // Peer each block was received from, NULL if none
+    peer_t** owners;
+
+    sha1_ctx_t* hash;
+    uint32_t    num_hashed; // blocks fed to `hash`, always the first ones
+} piece_t;
+
+/**
+ * @brief Create a new piece with no block requested
+ * @details Blocks are received in `data` when it is provided, e.g. straight
+ * into a mapping of the file (see storage_pin), it is not freed with the
+ * piece
+ *
+ * @param index The piece index
+ * @param length The piece length
+ * @param data Where to receive the blocks, NULL to allocate a buffer
+ * @return piece_t* The piece, NULL otherwise
+ */
+piece_t* piece_create(uint32_t index, uint32_t length, uint8_t* data);
+
+/**
+ * @brief Free the piece
+ *
+ * @param piece The piece
+ */
+void piece_free(piece_t* piece);
+
+/**
+ * @brief Get the length of a block
+ *
+ * @param piece The piece
+ * @param block The block index
+ * @return uint32_t The block length
+ */
+uint32_t piece_block_length(const piece_t* piece, uint32_t block);
+
+/**
+ * @brief Find the first block that was not requested yet
+ *
+ * @param piece The piece
+ * @param block Where to store the block index
+ * @return int 0 if a block was found, -1 otherwise
+ */
+int piece_next_block(const piece_t* piece, uint32_t* block);
+
+/**
+ * @brief Check if a block was received
+ *
+ * @param piece The piece
+ * @param block The block index
+ * @return true if the block was received, false otherwise
+ */
+bool piece_has_block(const piece_t* piece, uint32_t block);
+
+/**
+ * @brief Mark a block as requested from a peer
+ * @details A block that is already requested gets one more pending request
+ * (endgame)
+ *
+ * @param piece The piece
+ * @param block The block index
+ */
+void piece_request_block(piece_t* piece, uint32_t block);
+
+/**
+ * @brief Drop a pending request of a block, e.g. when its peer chokes us
+ * @details Once no request is pending the block can be requested again.
+ * Does nothing if the block was already received.
+ *
+ * @param piece The piece
+ * @param block The block index
+ */
+void piece_unrequest_block(piece_t* piece, uint32_t block);
+
+/**
+ * @brief Mark a block as received
+ * @details The block is hashed if it is the one right after the blocks
+ * hashed so far. Requests still pending for the block should be cancelled.
+ *
+ * @param piece The piece
+ * @param block The block index
+ * @param owner The peer the block was received from
+ * @return true if the block was not received before, false otherwise
+ */
+bool piece_receive_block(piece_t* piece, uint32_t block, peer_t* owner);
+
+/**
+ * @brief Mark every block as written to disk
+ *
+ * @param piece The piece
+ */
+void piece_mark_written(piece_t* piece);
+
+/**
+ * @brief Mark a single block as written to disk, e.g. when saving the
+ * progress of a piece that is not complete
+ *
+ * @param piece The piece
+ * @param block The block index
+ */
+void piece_mark_block_written(piece_t* piece, uint32_t block);
+
+/**
+ * @brief Check if a block was written to disk
+ *
+ * @param piece The piece
+ * @param block The block index
+ * @return true if the block was written, false otherwise
+ */
+bool piece_block_written(const piece_t* piece, uint32_t block);
+
+/**
+ * @brief Get the SHA-1 digest of a complete piece
+ * @details Every block must have been hashed, see hasher_submit
+ *
+ * @param piece The piece
+ * @param digest Where to store the digest
+ * @return int 0 if successful, -1 if the piece is not complete
+ */
+int piece_digest(piece_t* piece, uint8_t digest[SHA1_DIGEST_SIZE]);
+
+/**
+ * @brief Check if every block of a piece was received
+ *
+ * @param piece The piece
+ * @return true if the piece is complete, false otherwise
+ */
+bool piece_is_complete(const piece_t* piece);
+
+#endif // !PIECE_H
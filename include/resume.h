@@ -0,0 +1,64 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+#include "byte_str.h"
+#include "torrent.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// A piece that was partially written to disk
+typedef struct {
+    uint32_t    index;
+    byte_str_t* blocks; // one bit per block, set if the block is on disk
+} resume_piece_t;
+
+/**
+ * The progress of a download, as saved in a fast-resume file: the pieces
+ * that are complete and the blocks on disk of the ones that are not.
+ *
+ * The file also records the size and modification time of every file of the
+ * torrent, it is only trusted while they are unchanged.
+ */
+typedef struct {
+    byte_str_t*     have;
+    resume_piece_t* pieces;
+    size_t          num_pieces;
+} resume_t;
+
+/**
+ * @brief Load a fast-resume file
+ * @details The file is ignored if it belongs to another torrent or if any
+ * file of the torrent changed since it was saved. Otherwise
+ * `torrent->pieces_left` is updated to the number of incomplete pieces.
+ *
+ * @param path The path of the fast-resume file
+ * @param torrent The torrent
+ * @return resume_t* The progress, NULL if the file is missing or stale
+ */
+resume_t* resume_load(const char* path, torrent_t* torrent);
+
+/**
+ * @brief Save a fast-resume file
+ * @details The files of the torrent are flushed to disk first, and the
+ * fast-resume file is replaced atomically
+ *
+ * @param path The path of the fast-resume file
+ * @param torrent The torrent
+ * @param have The bitfield of the complete pieces
+ * @param pieces The partially written pieces
+ * @param num_pieces The number of partially written pieces
+ * @return int 0 if successful, -1 otherwise
+ */
+int resume_save(const char* path, const torrent_t* torrent,
+                const byte_str_t* have, const resume_piece_t* pieces,
+                size_t num_pieces);
+
+/**
+ * @brief Free the progress
+ *
+ * @param resume The progress
+ */
+void resume_free(resume_t* resume);
+
+#endif // !RESUME_H
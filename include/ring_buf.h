@@ -0,0 +1,99 @@
+#ifndef RING_BUF_H
+#define RING_BUF_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+typedef struct ring_buf ring_buf_t;
+
+/**
+ * @brief Create a new ring buffer
+ * @details The capacity is rounded up to a power of two
+ *
+ * @param capacity The minimum capacity in bytes
+ * @return ring_buf_t* The ring buffer
+ */
+ring_buf_t* ring_buf_create(size_t capacity);
+
+/**
+ * @brief Free the ring buffer
+ *
+ * @param ring The ring buffer
+ */
+void ring_buf_free(ring_buf_t* ring);
+
+/**
+ * @brief Grow the ring buffer, keeping its data
+ *
+ * @param ring The ring buffer
+ * @param capacity The minimum capacity in bytes
+ * @return int 0 if successful, -1 otherwise
+ */
+int ring_buf_reserve(ring_buf_t* ring, size_t capacity);
+
+/**
+ * @brief Get the number of bytes stored in the ring buffer
+ *
+ * @param ring The ring buffer
+ * @return size_t The number of bytes
+ */
+size_t ring_buf_len(const ring_buf_t* ring);
+
+/**
+ * @brief Get the capacity of the ring buffer
+ *
+ * @param ring The ring buffer
+ * @return size_t The capacity in bytes
+ */
+size_t ring_buf_capacity(const ring_buf_t* ring);
+
+/**
+ * @brief Describe the free space of the ring buffer
+ * @details The free space wraps around the end of the buffer, so it may take
+ * two regions. After writing to them, call ring_buf_produce.
+ *
+ * @param ring The ring buffer
+ * @param iov Where to store the regions
+ * @return int The number of regions (0 if the buffer is full)
+ */
+int ring_buf_free_iov(ring_buf_t* ring, struct iovec iov[2]);
+
+/**
+ * @brief Mark bytes written to the free space as stored
+ *
+ * @param ring The ring buffer
+ * @param len The number of bytes written
+ */
+void ring_buf_produce(ring_buf_t* ring, size_t len);
+
+/**
+ * @brief Get the stored data that can be read without wrapping around
+ *
+ * @param ring The ring buffer
+ * @param len Where to store the number of contiguous bytes
+ * @return const uint8_t* The oldest stored byte
+ */
+const uint8_t* ring_buf_data(const ring_buf_t* ring, size_t* len);
+
+/**
+ * @brief Copy stored data without removing it
+ *
+ * @param ring The ring buffer
+ * @param offset The offset from the oldest stored byte
+ * @param dst The destination
+ * @param len The number of bytes to copy
+ * @return size_t The number of bytes copied
+ */
+size_t ring_buf_peek(const ring_buf_t* ring, size_t offset, void* dst,
+                     size_t len);
+
+/**
+ * @brief Remove the oldest bytes from the ring buffer
+ *
+ * @param ring The ring buffer
+ * @param len The number of bytes to remove
+ */
+void ring_buf_consume(ring_buf_t* ring, size_t len);
+
+#endif // !RING_BUF_H
@@ -0,0 +1,173 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "byte_str.h"
+#include "list.h"
+#include "resume.h"
+#include "storage.h"
+#include "torrent.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct session session_t;
+
+/**
+ * @brief Create a new download session
+ * @details The session takes ownership of the peers list, which must hold
+ * `peer_t` values (as returned by the tracker)
+ *
+ * With the mmap backend, pieces that lie in a single window of a file are
+ * received straight into the mapping and never copied.
+ *
+ * @param torrent The torrent to download
+ * @param peers The list of peers
+ * @param backend How the files are accessed
+ * @return session_t* The session, NULL otherwise
+ */
+session_t* session_create(torrent_t* torrent, list_t* peers,
+                          storage_backend_t backend);
+
+/**
+ * @brief Set the number of outstanding requests per peer
+ * @details By default (depth 0) the depth is tuned for each peer from its
+ * download rate and round trip time, so that enough requests are in flight to
+ * cover the bandwidth-delay product of the connection
+ *
+ * @param session The session
+ * @param depth The number of outstanding requests, 0 to auto-tune
+ */
+void session_set_queue_depth(session_t* session, uint32_t depth);
+
+/**
+ * @brief Set the number of threads that verify complete pieces
+ * @details Must be called before session_run
+ *
+ * @param session The session
+ * @param num_threads The number of threads, 0 for one per CPU
+ */
+void session_set_hash_threads(session_t* session, size_t num_threads);
+
+/**
+ * @brief Set the memory budget for the pieces in memory
+ * @details Pieces are kept in memory while they are downloaded and verified,
+ * then in a write cache that is flushed in large sequential writes. No new
+ * piece is started while they take more than `max_memory` bytes and the
+ * cache can't be flushed to make room, which slows requests down to the
+ * speed of the disk. The cache is flushed once it holds half the budget.
+ *
+ * @param session The session
+ * @param max_memory The budget in bytes, 0 for the default (64 MiB)
+ */
+void session_set_max_memory(session_t* session, size_t max_memory);
+
+/**
+ * @brief Accept connections from peers on a port
+ * @details Connections are refused as soon as they are accepted when
+ * `torrent->max_peers` peers are already connected. Accepted peers are only
+ * answered once their handshake names the torrent.
+ *
+ * @param session The session
+ * @param port The port, in host byte order
+ * @return int 0 if successful, -1 otherwise
+ */
+int session_listen(session_t* session, uint16_t port);
+
+/**
+ * @brief Keep uploading once the download is complete
+ * @details session_run then returns once stopped with session_stop
+ *
+ * @param session The session
+ * @param seed true to seed
+ */
+void session_set_seed(session_t* session, bool seed);
+
+/**
+ * @brief Skip the pieces that are already downloaded, e.g. found by
+ * check_torrent
+ * @details Must be called before session_run. `torrent->pieces_left` is not
+ * updated.
+ *
+ * @param session The session
+ * @param have The bitfield of the pieces already downloaded
+ */
+void session_set_have(session_t* session, const byte_str_t* have);
+
+/**
+ * @brief Restore the progress loaded from a fast-resume file
+ * @details Must be called before session_run. The blocks of the partial
+ * pieces are read back from disk, only their missing blocks are downloaded.
+ *
+ * @param session The session
+ * @param resume The progress, see resume_load
+ * @return int 0 if successful, -1 otherwise
+ */
+int session_resume(session_t* session, const resume_t* resume);
+
+/**
+ * @brief Save the progress to a fast-resume file every 30 seconds
+ * @details The event loop only takes a snapshot of the progress, copying the
+ * blocks of the partial pieces that are not on disk yet. They are written and
+ * the file is saved by the disk threads. Pieces still in the write cache are
+ * saved as complete by the next save.
+ *
+ * @param session The session
+ * @param path The path of the fast-resume file
+ * @return int 0 if successful, -1 otherwise
+ */
+int session_set_resume_file(session_t* session, const char* path);
+
+/**
+ * @brief Save the progress to the fast-resume file now
+ * @details Blocks received for pieces that are not complete yet are written
+ * to disk first, so they don't have to be downloaded again. Waits for the
+ * disk, meant for the last save once session_run returned.
+ *
+ * @param session The session
+ * @return int 0 if successful, -1 otherwise
+ */
+int session_save_resume(session_t* session);
+
+/**
+ * @brief Make session_run return at the next iteration
+ * @details Async-signal-safe, meant to be called from a signal handler
+ *
+ * @param session The session
+ */
+void session_stop(session_t* session);
+
+/**
+ * @brief Run the event loop until every piece is downloaded
+ * @details Connections to up to `torrent->max_peers` peers are driven at the
+ * same time with non-blocking sockets registered in an edge-triggered epoll
+ * instance
+ *
+ * Every 10 seconds the interested peers are ranked by the rate they send
+ * at (the rate they take at once seeding) and the 3 best ones are unchoked,
+ * plus one picked in turn every 30 seconds.
+ *
+ * Blocks requested by the peers we unchoke are sent from the files with
+ * sendfile, so their data never goes through user space. The exception is
+ * pieces that are not written yet: they are copied from the write cache
+ * rather than waiting up to CACHE_MAX_AGE seconds for the write.
+ *
+ * Peers that support the Fast Extension (BEP 6) get HAVE ALL or HAVE NONE
+ * instead of a bitfield when possible, a REJECT for every request that won't
+ * be served, and a set of pieces they may request while choked. Their own
+ * suggestions and allowed pieces are requested first.
+ *
+ * @param session The session
+ * @return int 0 if the torrent was downloaded (or seeded until stopped), -1
+ * otherwise (including when it was stopped before completion)
+ */
+int session_run(session_t* session);
+
+/**
+ * @brief Free the session, closing every connection
+ *
+ * @param session The session
+ */
+void session_free(session_t* session);
+
+#endif // !SESSION_H
@@ -1,6 +1,7 @@
 #ifndef SHA1_H
 #define SHA1_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -8,6 +9,65 @@
 
 typedef struct sha1_ctx sha1_ctx_t;
 
+// Block function implementations, the fastest supported one is picked at
+// startup
+typedef enum {
+    SHA1_IMPL_GENERIC,
+    SHA1_IMPL_SSSE3, // SSSE3 message schedule, scalar rounds
+    SHA1_IMPL_AVX2,  // AVX2 message schedule of two blocks, scalar rounds
+    SHA1_IMPL_SHANI, // SHA extensions
+    SHA1_IMPL_COUNT,
+} sha1_impl_t;
+
+/**
+ * @brief Get the name of an implementation
+ *
+ * @param impl The implementation
+ * @return const char* The name
+ */
+const char* sha1_impl_name(sha1_impl_t impl);
+
+/**
+ * @brief Check if the CPU supports an implementation
+ *
+ * @param impl The implementation
+ * @return true if it is supported, false otherwise
+ */
+bool sha1_impl_supported(sha1_impl_t impl);
+
+/**
+ * @brief Select the implementation used by every SHA1 context
+ * @details Must not be called while a digest is being computed
+ *
+ * @param impl The implementation
+ * @return int 0 if successful, -1 if the CPU does not support it
+ */
+int sha1_set_impl(sha1_impl_t impl);
+
+/**
+ * @brief Get the implementation in use
+ *
+ * @return sha1_impl_t The implementation
+ */
+sha1_impl_t sha1_get_impl(void);
+
+/**
+ * @brief Set the number of messages hashed at once by sha1_update_many
+ * @details 1 hashes them one after the other. By default the widest
+ * multi-buffer implementation is used, unless SHA-NI is faster.
+ *
+ * @param lanes 1, 4, 8 or 16
+ * @return int 0 if successful, -1 if the CPU does not support it
+ */
+int sha1_set_lanes(size_t lanes);
+
+/**
+ * @brief Get the number of messages hashed at once by sha1_update_many
+ *
+ * @return size_t The number of lanes
+ */
+size_t sha1_get_lanes(void);
+
 /**
  * @brief Create a new SHA1 context
  *
@@ -33,6 +93,19 @@ void sha1_free(sha1_ctx_t* ctx);
  */
 void sha1_update(sha1_ctx_t* ctx, const uint8_t* data, size_t size);
 
+/**
+ * @brief Update several SHA1 contexts, each with its own data
+ * @details The contexts are hashed in parallel SIMD lanes (see
+ * sha1_set_lanes). The result is the same as calling sha1_update on each.
+ *
+ * @param ctx The SHA1 contexts, all different
+ * @param data The data of each context
+ * @param size The size of each data
+ * @param count The number of contexts
+ */
+void sha1_update_many(sha1_ctx_t* const ctx[], const uint8_t* const data[],
+                      const size_t size[], size_t count);
+
 /**
  * @brief Finalize the SHA1 context and get the digest
  *
@@ -57,4 +130,16 @@ void sha1_final(sha1_ctx_t* ctx, uint8_t digest[SHA1_DIGEST_SIZE]);
  */
 void sha1(const uint8_t* data, size_t size, uint8_t digest[SHA1_DIGEST_SIZE]);
 
+/**
+ * @brief Compute the SHA1 digests of several independent buffers at once
+ *
+ * @param data The buffers
+ * @param size The size of each buffer
+ * @param count The number of buffers
+ * @param digests Where to store the digest of each buffer
+ * @return int 0 if successful, -1 otherwise (the digests are not valid)
+ */
+int sha1_many(const uint8_t* const data[], const size_t size[], size_t count,
+              uint8_t (*digests)[SHA1_DIGEST_SIZE]);
+
 #endif // !SHA1_H
@@ -0,0 +1,36 @@
+#ifndef SHA1_MB_H
+#define SHA1_MB_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Most independent buffers hashed at once, one per 32-bit SIMD lane
+#define SHA1_MB_MAX_LANES 16
+
+/**
+ * Multi-buffer SHA-1 block functions. Each lane hashes its own message, so
+ * the state is transposed: state[i][lane] is word i of the lane's state.
+ * Lane `lane` processes `num_blocks` consecutive 64 byte blocks starting at
+ * data[lane], every lane must have that many blocks.
+ */
+typedef void (*sha1_mb_blocks_fn_t)(uint32_t state[5][SHA1_MB_MAX_LANES],
+                                    const uint8_t* const data[],
+                                    size_t               num_blocks);
+
+/**
+ * @brief Get the largest number of lanes the CPU supports
+ *
+ * @return size_t 4, 8 or 16, 1 if multi-buffer hashing is not supported
+ */
+size_t sha1_mb_max_lanes(void);
+
+/**
+ * @brief Get the block function for a number of lanes
+ *
+ * @param lanes The number of lanes
+ * @return sha1_mb_blocks_fn_t The block function, NULL if the CPU does not
+ * support it
+ */
+sha1_mb_blocks_fn_t sha1_mb_blocks(size_t lanes);
+
+#endif // !SHA1_MB_H
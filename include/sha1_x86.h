@@ -0,0 +1,53 @@
+#ifndef SHA1_X86_H
+#define SHA1_X86_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// CPU features used by the x86 SHA-1 implementations
+#define SHA1_X86_SSSE3  (1 << 0)
+#define SHA1_X86_AVX2   (1 << 1)
+#define SHA1_X86_SHANI  (1 << 2)
+#define SHA1_X86_AVX512 (1 << 3) // AVX-512F and AVX-512BW
+
+/**
+ * @brief Detect the CPU features the x86 SHA-1 implementations need
+ * @details Always 0 when not built for x86
+ *
+ * @return unsigned A mask of SHA1_X86_* flags
+ */
+unsigned sha1_x86_features(void);
+
+/**
+ * @brief Process 64 byte blocks, computing the message schedule with SSSE3
+ * (four words at a time) and the rounds with scalar code
+ *
+ * @param state The SHA-1 state
+ * @param data The blocks
+ * @param num_blocks The number of blocks
+ */
+void sha1_blocks_ssse3(uint32_t state[5], const uint8_t* data,
+                       size_t num_blocks);
+
+/**
+ * @brief Process 64 byte blocks, computing the message schedules of two
+ * blocks at once with AVX2 and the rounds with scalar code
+ *
+ * @param state The SHA-1 state
+ * @param data The blocks
+ * @param num_blocks The number of blocks
+ */
+void sha1_blocks_avx2(uint32_t state[5], const uint8_t* data,
+                      size_t num_blocks);
+
+/**
+ * @brief Process 64 byte blocks with the SHA extensions (SHA-NI)
+ *
+ * @param state The SHA-1 state
+ * @param data The blocks
+ * @param num_blocks The number of blocks
+ */
+void sha1_blocks_shani(uint32_t state[5], const uint8_t* data,
+                       size_t num_blocks);
+
+#endif // !SHA1_X86_H
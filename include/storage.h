@@ -0,0 +1,159 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "torrent.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Files are mapped in windows of this size by the mmap backend, and no more
+// than STORAGE_MAX_MAPPED bytes are mapped at once, which keeps the backend
+// usable with files larger than RAM or than a 32-bit address space
+#ifndef STORAGE_WINDOW_SIZE
+#if UINTPTR_MAX > 0xffffffffu
+#define STORAGE_WINDOW_SIZE (64 << 20)
+#define STORAGE_MAX_MAPPED  ((size_t)4 << 30)
+#else
+#define STORAGE_WINDOW_SIZE (16 << 20)
+#define STORAGE_MAX_MAPPED  ((size_t)256 << 20)
+#endif
+#endif
+
+typedef struct storage storage_t;
+
+typedef enum {
+    STORAGE_BACKEND_PWRITE, // pwrite/pread through cached descriptors
+    STORAGE_BACKEND_MMAP,   // memcpy to and from shared mappings
+} storage_backend_t;
+
+// A contiguous range of the torrent data that lies in a single file
+typedef struct {
+    size_t   file;   // index of the file in the torrent
+    uint64_t offset; // offset in the file
+    uint64_t length;
+} storage_span_t;
+
+/**
+ * @brief Create the layout of the torrent data on disk
+ * @details The torrent data is the concatenation of its files. The offset of
+ * each file in it is computed once and kept in an array, a range of the data
+ * is mapped to the files it covers with a binary search.
+ *
+ * @param torrent The torrent
+ * @param backend How the files are accessed
+ * @return storage_t* The storage, NULL otherwise
+ */
+storage_t* storage_create(torrent_t* torrent, storage_backend_t backend);
+
+/**
+ * @brief Parse the name of a backend
+ *
+ * @param name `pwrite` or `mmap`
+ * @param backend Where to store the backend
+ * @return int 0 if the name is valid, -1 otherwise
+ */
+int storage_backend_parse(const char* name, storage_backend_t* backend);
+
+/**
+ * @brief Free the storage, the files belong to the torrent
+ *
+ * @param storage The storage
+ */
+void storage_free(storage_t* storage);
+
+/**
+ * @brief Split a range of the torrent data in the files it covers
+ * @details Empty files are skipped
+ *
+ * @param storage The storage
+ * @param offset The offset of the range in the torrent data
+ * @param length The length of the range
+ * @param spans Where to store the spans
+ * @param max_spans The number of spans that fit in `spans`
+ * @return size_t The number of spans, 0 if the range is out of bounds or
+ * covers more than `max_spans` files
+ */
+size_t storage_map(const storage_t* storage, uint64_t offset, uint64_t length,
+                   storage_span_t* spans, size_t max_spans);
+
+/**
+ * @brief Get a pointer to a range of the torrent data in the file mapping
+ * @details Only with the mmap backend, and only for a range that is in a
+ * single window of a single file. Data written there goes straight to the
+ * page cache, the mapping stays valid until storage_unpin.
+ *
+ * Running out of disk space while writing to a sparse file raises SIGBUS,
+ * files should be fully allocated when they are accessed this way.
+ *
+ * @param storage The storage
+ * @param offset The offset of the range in the torrent data
+ * @param length The length of the range
+ * @return uint8_t* The range, NULL if it can't be pinned
+ */
+uint8_t* storage_pin(storage_t* storage, uint64_t offset, size_t length);
+
+/**
+ * @brief Release a range pinned with storage_pin
+ *
+ * @param storage The storage
+ * @param offset The offset the range was pinned at
+ */
+void storage_unpin(storage_t* storage, uint64_t offset);
+
+/**
+ * @brief Write buffers to a range of the torrent data
+ * @details The buffers are written back to back from `offset`, with one
+ * pwritev per file they cover (copied to the mappings with the mmap backend)
+ *
+ * @param storage The storage
+ * @param offset The offset in the torrent data
+ * @param iov The buffers
+ * @param iovcnt The number of buffers
+ * @return int 0 if successful, -1 otherwise
+ */
+int storage_writev(storage_t* storage, uint64_t offset,
+                   const struct iovec* iov, int iovcnt);
+
+/**
+ * @brief Write data to a range of the torrent data
+ *
+ * @param storage The storage
+ * @param offset The offset in the torrent data
+ * @param data The data
+ * @param len The length of the data
+ * @return int 0 if successful, -1 otherwise
+ */
+int storage_write(storage_t* storage, uint64_t offset, const uint8_t* data,
+                  size_t len);
+
+/**
+ * @brief Read a range of the torrent data
+ *
+ * @param storage The storage
+ * @param offset The offset in the torrent data
+ * @param data Where to store the data
+ * @param len The length of the data
+ * @return int 0 if successful, -1 otherwise
+ */
+int storage_read(storage_t* storage, uint64_t offset, uint8_t* data,
+                 size_t len);
+
+/**
+ * @brief Send a range of the torrent data to a socket with sendfile
+ * @details Only the part of the range in the first file it covers is sent,
+ * and only as much as the socket takes, the caller sends the rest with more
+ * calls. Works with both backends, mappings and descriptors share the page
+ * cache.
+ *
+ * @param storage The storage
+ * @param sockfd The socket
+ * @param offset The offset in the torrent data
+ * @param len The length of the range
+ * @return ssize_t The number of bytes sent, -1 with errno set otherwise
+ */
+ssize_t storage_sendfile(storage_t* storage, int sockfd, uint64_t offset,
+                         size_t len);
+
+#endif // !STORAGE_H
@@ -2,9 +2,11 @@
 #define TORRENT_H
 
 #include "bencode.h"
+#include "file.h"
 #include "list.h"
 #include "sha1.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define TORRENT_DEFAULT_MAX_PEERS 50
@@ -43,19 +45,49 @@ typedef struct {
  *
  * @param node The bencode node
  * @param output_path The output path
+ * @param alloc How to reserve the space of the files
  * @return torrent_t* The torrent
  */
-torrent_t* torrent_create(bencode_node_t* node, const char* output_path);
+torrent_t* torrent_create(bencode_node_t* node, const char* output_path,
+                          file_alloc_t alloc);
 
 /**
  * @brief Create a new torrent object from a .torrent file
  *
  * @param filename The .torrent file name
  * @param output_path The output path
+ * @param alloc How to reserve the space of the files
  * @return torrent_t* The torrent
  */
-torrent_t* torrent_create_from_file(const char* filename,
-                                    const char* output_path);
+torrent_t* torrent_create_from_file(const char*  filename,
+                                    const char*  output_path,
+                                    file_alloc_t alloc);
+
+/**
+ * @brief Get the length of a piece
+ * @details Every piece has `piece_length` bytes except the last one, which
+ * holds whatever is left of the torrent data
+ *
+ * @param torrent The torrent
+ * @param index The piece index
+ * @return uint64_t The length of the piece, 0 if the index is invalid
+ */
+uint64_t torrent_piece_length(const torrent_t* torrent, size_t index);
+
+/**
+ * @brief Check if a range of bytes lies within a piece, e.g. a requested
+ * block
+ * @details The last piece is usually shorter than the others, so a range
+ * that fits in any other piece may not fit in it
+ *
+ * @param torrent The torrent
+ * @param index The piece index
+ * @param begin The offset of the range in the piece
+ * @param length The length of the range
+ * @return true if the piece exists and holds the whole range
+ */
+bool torrent_block_in_piece(const torrent_t* torrent, size_t index,
+                            uint64_t begin, uint64_t length);
 
 /**
  * @brief Free the torrent object
@@ -1,13 +1,30 @@
+#include "check.h"
 #include "log.h"
 #include "peer.h"
+#include "resume.h"
+#include "session.h"
 #include "torrent.h"
 #include "tracker.h"
 
 #include <arpa/inet.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+// Port announced to the tracker and listened on for incoming peers
+#define DEFAULT_PORT 6881
+
+// Session stopped on SIGINT and SIGTERM so the progress can be saved
+static session_t* running_session = NULL;
+
+static void handle_stop(int sig) {
+    (void)sig;
+    session_stop(running_session);
+}
+
 const char* shift_args(int* argc, char*** argv) {
     const char* arg = NULL;
     if (*argc > 0) {
@@ -19,13 +36,41 @@ const char* shift_args(int* argc, char*** argv) {
 }
 
 void helper(const char* program_name) {
-    printf("Usage: %s -t <torrent file> [-o <output path>]\n", program_name);
+    printf("Usage: %s -t <torrent file> [-o <output path>] [-p <port>] "
+           "[-q <depth>]\n"
+           "          [-j <threads>] [--check]"
+           " [--alloc <mode>] [--storage <name>]\n"
+           "          [--cache <MiB>] [--seed]\n",
+           program_name);
     printf("Options:\n");
     printf("  -t <torrent file>  Torrent file to download\n");
 
     // NOTE: Should the path be shown instead of $XDG_DOWNLOAD_DIR?
     printf("  -o <output path>   Output path [default: $XDG_DOWNLOAD_DIR]\n");
+    printf("  -p <port>          Port to listen on for peers "
+           "[default: %d]\n",
+           DEFAULT_PORT);
+    printf("  -q <depth>         Outstanding requests per peer "
+           "[default: auto]\n");
+    printf("  -j <threads>       Hashing threads [default: one per CPU]\n");
+    printf("  --check            Verify the data already in the output path "
+           "and only\n"
+           "                     download the missing pieces\n");
+    printf("  --alloc <mode>     How to reserve disk space: sparse, full or "
+           "none\n"
+           "                     [default: sparse]\n");
+    printf("  --storage <name>   How to access the files: pwrite or mmap\n"
+           "                     [default: pwrite]\n");
+    printf("  --cache <MiB>      Memory for the pieces being downloaded and "
+           "the ones\n"
+           "                     waiting to be written [default: 64]\n");
+    printf("  --seed             Keep uploading once the download is "
+           "complete,\n"
+           "                     until interrupted\n");
     printf("  -h                 Show this help\n");
+    printf("\nProgress is saved to <output path>/<info hash>.resume and "
+           "picked up on the\nnext run, the data is only checked again if "
+           "it changed in between.\n");
 }
 
 int main(int argc, char** argv) {
@@ -37,8 +82,16 @@ int main(int argc, char** argv) {
 
     const char* program_name = shift_args(&argc, &argv); // skip program name
 
-    const char* torrent_file = NULL;
-    const char* output_path  = NULL;
+    const char*       torrent_file = NULL;
+    const char*       output_path  = NULL;
+    uint16_t          port         = DEFAULT_PORT;
+    uint32_t          queue_depth  = 0;
+    size_t            hash_threads = 0;
+    bool              check        = false;
+    file_alloc_t      alloc        = FILE_ALLOC_SPARSE;
+    storage_backend_t backend      = STORAGE_BACKEND_PWRITE;
+    size_t            cache_mib    = 0;
+    bool              seed         = false;
 
     while (argc > 0) {
         const char* arg = shift_args(&argc, &argv);
@@ -50,6 +103,68 @@ int main(int argc, char** argv) {
             torrent_file = shift_args(&argc, &argv);
         } else if (strcmp(arg, "-o") == 0) {
             output_path = shift_args(&argc, &argv);
+        } else if (strcmp(arg, "-p") == 0) {
+            const char* number = shift_args(&argc, &argv);
+            if (number == NULL) {
+                printf("Missing port\n\n");
+                helper(program_name);
+                return 1;
+            }
+            port = strtoul(number, NULL, 10);
+        } else if (strcmp(arg, "-q") == 0) {
+            const char* depth = shift_args(&argc, &argv);
+            if (depth == NULL) {
+                printf("Missing queue depth\n\n");
+                helper(program_name);
+                return 1;
+            }
+            queue_depth = strtoul(depth, NULL, 10);
+        } else if (strcmp(arg, "-j") == 0) {
+            const char* threads = shift_args(&argc, &argv);
+            if (threads == NULL) {
+                printf("Missing number of threads\n\n");
+                helper(program_name);
+                return 1;
+            }
+            hash_threads = strtoul(threads, NULL, 10);
+        } else if (strcmp(arg, "--check") == 0) {
+            check = true;
+        } else if (strcmp(arg, "--alloc") == 0) {
+            const char* mode = shift_args(&argc, &argv);
+            if (mode == NULL) {
+                printf("Missing allocation mode\n\n");
+                helper(program_name);
+                return 1;
+            }
+
+            if (file_alloc_parse(mode, &alloc) != 0) {
+                printf("Invalid allocation mode: %s\n\n", mode);
+                helper(program_name);
+                return 1;
+            }
+        } else if (strcmp(arg, "--storage") == 0) {
+            const char* name = shift_args(&argc, &argv);
+            if (name == NULL) {
+                printf("Missing storage backend\n\n");
+                helper(program_name);
+                return 1;
+            }
+
+            if (storage_backend_parse(name, &backend) != 0) {
+                printf("Invalid storage backend: %s\n\n", name);
+                helper(program_name);
+                return 1;
+            }
+        } else if (strcmp(arg, "--cache") == 0) {
+            const char* size = shift_args(&argc, &argv);
+            if (size == NULL) {
+                printf("Missing cache size\n\n");
+                helper(program_name);
+                return 1;
+            }
+            cache_mib = strtoul(size, NULL, 10);
+        } else if (strcmp(arg, "--seed") == 0) {
+            seed = true;
         } else {
             printf("Unknown argument: %s\n", arg);
             helper(program_name);
@@ -76,15 +191,63 @@ int main(int argc, char** argv) {
 
     LOG_INFO("Parsing torrent file: %s", torrent_file);
 
-    torrent_t* torrent = torrent_create_from_file(torrent_file, output_path);
+    torrent_t* torrent = torrent_create_from_file(torrent_file, output_path,
+                                                  alloc);
     if (torrent == NULL) {
         LOG_ERROR("Failed to create torrent");
         return 1;
     }
 
-    tracker_req_t* req = tracker_request_create(torrent, 6881);
+    // The progress is saved next to the data, named after the info hash
+    char resume_path[PATH_MAX];
+    int  walk = snprintf(resume_path, sizeof(resume_path), "%s/", output_path);
+    for (int i = 0; i < SHA1_DIGEST_SIZE; ++i) {
+        walk += snprintf(resume_path + walk, sizeof(resume_path) - walk,
+                         "%02x", torrent->info_hash[i]);
+    }
+    snprintf(resume_path + walk, sizeof(resume_path) - walk, ".resume");
+
+    resume_t* resume = NULL;
+    if (!check) {
+        resume = resume_load(resume_path, torrent);
+
+        // Data may have been written after the progress was last saved
+        if (resume == NULL && access(resume_path, F_OK) == 0) {
+            LOG_INFO("Resume data is stale, checking the data on disk");
+            check = true;
+        }
+    }
+
+    byte_str_t* have = NULL;
+    if (check) {
+        have = check_torrent(torrent, hash_threads);
+        if (have == NULL) {
+            LOG_ERROR("Failed to check torrent");
+            torrent_free(torrent);
+            return 1;
+        }
+    }
+
+    if (torrent->pieces_left == 0 && !seed) {
+        LOG_INFO("Torrent is already complete");
+        if (have != NULL) {
+            resume_save(resume_path, torrent, have, NULL, 0);
+            free(have);
+        }
+        if (resume != NULL) {
+            resume_free(resume);
+        }
+        torrent_free(torrent);
+        return 0;
+    }
+
+    tracker_req_t* req = tracker_request_create(torrent, port);
     if (req == NULL) {
         LOG_ERROR("Failed to create tracker request");
+        free(have);
+        if (resume != NULL) {
+            resume_free(resume);
+        }
         torrent_free(torrent);
         return 1;
     }
@@ -93,6 +256,10 @@ int main(int argc, char** argv) {
     tracker_request_free(req);
     if (res == NULL) {
         LOG_ERROR("Failed to announce to tracker");
+        free(have);
+        if (resume != NULL) {
+            resume_free(resume);
+        }
         torrent_free(torrent);
         return 1;
     }
@@ -123,74 +290,68 @@ int main(int argc, char** argv) {
         LOG_INFO("    %s:%d", ip, ntohs(peer->addr.sin_port));
     }
 
-    // NOTE: have a pool of peers instead of a single one
-
-    peer_t* peer = NULL;
-
-    for (const list_iterator_t* it = list_iterator_first(peers); it != NULL;
-         it                        = list_iterator_next(it)) {
-        peer = list_iterator_get(it);
-        LOG_INFO("Connecting to peer %s:%d", inet_ntoa(peer->addr.sin_addr),
-                 ntohs(peer->addr.sin_port));
-
-        if (peer_connect(peer, torrent->info_hash) == 0) {
-            LOG_INFO("Connected to peer %s:%d", inet_ntoa(peer->addr.sin_addr),
-                     ntohs(peer->addr.sin_port));
-
-            // TODO: check if it has all the pieces
-            //       for now the download assumes the peer has all the pieces
-
-            bool has_all_pieces = true;
-
-            for (size_t i = 0; i < torrent->num_pieces; ++i) {
-                if (!peer_has_piece(peer, i)) {
-                    LOG_WARN("Peer %s:%d does not have piece %d",
-                             inet_ntoa(peer->addr.sin_addr),
-                             ntohs(peer->addr.sin_port), i);
-
-                    has_all_pieces = false;
-                    break;
-                }
-            }
-
-            if (has_all_pieces) {
-                break;
-            }
-        }
-    }
-
-    if (peer == NULL) {
-        LOG_ERROR("Failed to connect to any peer");
+    session_t* session = session_create(torrent, peers, backend);
+    if (session == NULL) {
+        LOG_ERROR("Failed to create session");
         list_free(peers);
+        free(have);
+        if (resume != NULL) {
+            resume_free(resume);
+        }
         torrent_free(torrent);
         return 1;
     }
 
-    // NOTE: Instead of downloading pieces in ascending order, we should
-    //       download the rarest pieces first
-    //       (priority queue, piece object with a count of how many peers
-    //       have it)?
-
-    // NOTE: have a piece_t with:
-    //          - index
-    //          - peer_t* (peer working on the piece, NULL if no peer)
-    //          (add more info)
+    if (have != NULL) {
+        session_set_have(session, have);
+        free(have);
+    }
 
-    for (size_t i = 0; i < torrent->num_pieces; i++) {
-        if (download_piece(peer, torrent, i) == -1) {
-            LOG_ERROR("Failed to download piece");
-            list_free(peers);
+    if (resume != NULL) {
+        int ret = session_resume(session, resume);
+        resume_free(resume);
+        if (ret != 0) {
+            LOG_ERROR("Failed to resume torrent");
+            session_free(session);
             torrent_free(torrent);
             return 1;
         }
+    }
+
+    session_set_queue_depth(session, queue_depth);
+    session_set_hash_threads(session, hash_threads);
+    session_set_max_memory(session, cache_mib << 20);
+    session_set_resume_file(session, resume_path);
+    session_set_seed(session, seed);
+
+    // Outgoing connections are enough to download
+    if (session_listen(session, port) != 0) {
+        LOG_WARN("Not accepting incoming peers");
+    }
+
+    running_session = session;
+
+    struct sigaction sa = {.sa_handler = handle_stop};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int status = 0;
+    if (session_run(session) != 0) {
+        LOG_ERROR("Failed to download torrent");
+        status = 1;
+    }
 
-        LOG_INFO("Piece %d/%d downloaded successfully", i + 1,
-                 torrent->num_pieces);
+    // Whatever happened, the progress so far is kept for the next run
+    if (session_save_resume(session) != 0) {
+        LOG_ERROR("Failed to save resume data");
     }
 
-    // NOTE: maybe we should download by block instead of by piece
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    running_session = NULL;
 
-    list_free(peers);
+    session_free(session);
     torrent_free(torrent);
-    return 0;
+    return status;
 }
@@ -0,0 +1,319 @@
+#include "cache.h"
+
+#include "log.h"
+
+#include <string.h>
+#include <sys/uio.h>
+
+struct cache {
+    disk_t*  disk;
+    uint64_t piece_length;
+
+    // Pieces waiting to be written, sorted by index, with room for as many
+    // buffers in `iov` to write them in one call
+    piece_t**     pieces;
+    struct iovec* iov;
+    size_t        num_pieces;
+    size_t        cap;
+    size_t        dirty; // bytes of `pieces`
+
+    // Bytes of the pieces waiting or being written
+    size_t bytes;
+
+    // Pieces being written
+    struct cache_write* writing;
+
+    // When the first piece of the cache was added
+    time_t oldest;
+
+    // Set when a write failed, the pieces are lost
+    bool failed;
+};
+
+// Consecutive pieces handed to the disk threads in a single write
+typedef struct cache_write {
+    cache_t*            cache;
+    struct cache_write* prev;
+    struct cache_write* next;
+    size_t              num_pieces;
+    piece_t*            pieces[];
+} cache_write_t;
+
+cache_t* cache_create(disk_t* disk, uint64_t piece_length) {
+    if (disk == NULL || piece_length == 0) {
+        LOG_WARN("Must provide a disk and a piece length");
+        return NULL;
+    }
+
+    cache_t* cache = malloc(sizeof(cache_t));
+    if (cache == NULL) {
+        LOG_ERROR("Failed to allocate memory for cache");
+        return NULL;
+    }
+
+    cache->disk         = disk;
+    cache->piece_length = piece_length;
+    cache->pieces       = NULL;
+    cache->iov          = NULL;
+    cache->num_pieces   = 0;
+    cache->cap          = 0;
+    cache->dirty        = 0;
+    cache->bytes        = 0;
+    cache->writing      = NULL;
+    cache->oldest       = 0;
+    cache->failed       = false;
+
+    return cache;
+}
+
+void cache_free(cache_t* cache) {
+    if (cache == NULL) {
+        LOG_WARN("Trying to free NULL cache");
+        return;
+    }
+
+    for (size_t i = 0; i < cache->num_pieces; ++i) {
+        piece_free(cache->pieces[i]);
+    }
+
+    free(cache->pieces);
+    free(cache->iov);
+    free(cache);
+}
+
+static int cache_grow(cache_t* cache) {
+    size_t cap = cache->cap > 0 ? cache->cap * 2 : 16;
+
+    piece_t** pieces = realloc(cache->pieces, cap * sizeof(piece_t*));
+    if (pieces == NULL) {
+        LOG_ERROR("Failed to allocate memory for cached pieces");
+        return -1;
+    }
+    cache->pieces = pieces;
+
+    struct iovec* iov = realloc(cache->iov, cap * sizeof(struct iovec));
+    if (iov == NULL) {
+        LOG_ERROR("Failed to allocate memory for cached pieces");
+        return -1;
+    }
+    cache->iov = iov;
+
+    cache->cap = cap;
+    return 0;
+}
+
+int cache_add(cache_t* cache, piece_t* piece) {
+    if (cache == NULL || piece == NULL) {
+        LOG_WARN("Must provide a cache and a piece");
+        return -1;
+    }
+
+    if (cache->num_pieces == cache->cap && cache_grow(cache) != 0) {
+        return -1;
+    }
+
+    // Pieces are mostly verified in order, so the search usually ends at the
+    // back and nothing is moved
+    size_t lo = 0;
+    size_t hi = cache->num_pieces;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cache->pieces[mid]->index < piece->index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    memmove(&cache->pieces[lo + 1], &cache->pieces[lo],
+            (cache->num_pieces - lo) * sizeof(piece_t*));
+    cache->pieces[lo] = piece;
+
+    if (cache->num_pieces == 0) {
+        cache->oldest = time(NULL);
+    }
+
+    cache->num_pieces++;
+    cache->dirty += piece->length;
+    cache->bytes += piece->length;
+    return 0;
+}
+
+size_t cache_bytes(const cache_t* cache) {
+    return cache->bytes;
+}
+
+size_t cache_dirty_bytes(const cache_t* cache) {
+    return cache->dirty;
+}
+
+bool cache_failed(const cache_t* cache) {
+    return cache->failed;
+}
+
+const uint8_t* cache_find(const cache_t* cache, uint32_t index) {
+    if (cache == NULL) {
+        LOG_WARN("Must provide a cache");
+        return NULL;
+    }
+
+    size_t lo = 0;
+    size_t hi = cache->num_pieces;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cache->pieces[mid]->index < index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < cache->num_pieces && cache->pieces[lo]->index == index) {
+        return cache->pieces[lo]->data;
+    }
+
+    // Each write covers consecutive pieces
+    for (const cache_write_t* run = cache->writing; run != NULL;
+         run                      = run->next) {
+        uint32_t first = run->pieces[0]->index;
+        if (index >= first && index - first < run->num_pieces) {
+            return run->pieces[index - first]->data;
+        }
+    }
+
+    return NULL;
+}
+
+bool cache_expired(const cache_t* cache, time_t now) {
+    return cache->num_pieces > 0 && now - cache->oldest >= CACHE_MAX_AGE;
+}
+
+static void cache_written(void* ctx, int result) {
+    cache_write_t* run   = ctx;
+    cache_t*       cache = run->cache;
+
+    if (result != 0) {
+        LOG_ERROR("Failed to write pieces %u to %u", run->pieces[0]->index,
+                  run->pieces[run->num_pieces - 1]->index);
+        cache->failed = true;
+    }
+
+    for (size_t i = 0; i < run->num_pieces; ++i) {
+        cache->bytes -= run->pieces[i]->length;
+        piece_mark_written(run->pieces[i]);
+        piece_free(run->pieces[i]);
+    }
+
+    if (run->prev != NULL) {
+        run->prev->next = run->next;
+    } else {
+        cache->writing = run->next;
+    }
+    if (run->next != NULL) {
+        run->next->prev = run->prev;
+    }
+
+    free(run);
+}
+
+// Hand pieces `start` to `end` (excluded) to the disk threads
+static int cache_write(cache_t* cache, size_t start, size_t end) {
+    size_t num = end - start;
+
+    cache_write_t* run = malloc(sizeof(cache_write_t) + num * sizeof(piece_t*));
+    if (run == NULL) {
+        LOG_ERROR("Failed to allocate memory for cache write");
+        return -1;
+    }
+
+    run->cache      = cache;
+    run->prev       = NULL;
+    run->next       = cache->writing;
+    run->num_pieces = num;
+    memcpy(run->pieces, &cache->pieces[start], num * sizeof(piece_t*));
+
+    for (size_t i = 0; i < num; ++i) {
+        cache->iov[i] = (struct iovec){
+            .iov_base = run->pieces[i]->data,
+            .iov_len  = run->pieces[i]->length,
+        };
+    }
+
+    if (disk_write(cache->disk,
+                   cache->pieces[start]->index * cache->piece_length,
+                   cache->iov, num, cache_written, run)
+        != 0) {
+        free(run);
+        return -1;
+    }
+
+    if (cache->writing != NULL) {
+        cache->writing->prev = run;
+    }
+    cache->writing = run;
+
+    for (size_t i = start; i < end; ++i) {
+        cache->dirty -= cache->pieces[i]->length;
+    }
+
+    return 0;
+}
+
+int cache_flush(cache_t* cache) {
+    if (cache == NULL) {
+        LOG_WARN("Must provide a cache");
+        return -1;
+    }
+
+    if (cache->failed) {
+        return -1;
+    }
+
+    if (cache->num_pieces == 0) {
+        return 0;
+    }
+
+    size_t num_writes = 0;
+    size_t start      = 0;
+
+    while (start < cache->num_pieces) {
+        // Consecutive pieces are consecutive ranges of the torrent data
+        size_t end = start + 1;
+        while (end < cache->num_pieces
+               && cache->pieces[end]->index
+                      == cache->pieces[end - 1]->index + 1) {
+            end++;
+        }
+
+        if (cache_write(cache, start, end) != 0) {
+            // Keep what is left for the next attempt
+            memmove(cache->pieces, &cache->pieces[start],
+                    (cache->num_pieces - start) * sizeof(piece_t*));
+            cache->num_pieces -= start;
+            return -1;
+        }
+
+        start = end;
+        num_writes++;
+    }
+
+    LOG_DEBUG("Flushed %zu pieces in %zu writes", cache->num_pieces,
+              num_writes);
+
+    cache->num_pieces = 0;
+    return 0;
+}
+
+int cache_sync(cache_t* cache) {
+    if (cache == NULL) {
+        LOG_WARN("Must provide a cache");
+        return -1;
+    }
+
+    int ret = cache_flush(cache);
+
+    disk_wait(cache->disk);
+    disk_poll(cache->disk);
+
+    return ret == 0 && !cache->failed ? 0 : -1;
+}
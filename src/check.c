@@ -0,0 +1,397 @@
+#include "check.h"
+
+#include "file.h"
+#include "log.h"
+#include "sha1.h"
+#include "sha1_mb.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Seconds between two progress reports
+#define CHECK_PROGRESS_INTERVAL 1
+
+typedef struct {
+    uint64_t offset; // offset of the file in the torrent data
+    uint64_t size;   // size the file should have
+    uint64_t mapped; // bytes of the file that exist, 0 if it is missing
+    uint8_t* map;
+} check_file_t;
+
+typedef struct {
+    torrent_t*    torrent;
+    check_file_t* files;
+    size_t        num_files;
+    byte_str_t*   bitfield;
+
+    _Atomic uint64_t bytes;
+    _Atomic size_t   pieces;
+    _Atomic size_t   complete;
+    _Atomic bool     failed; // a batch couldn't be hashed
+
+    // Threads still checking, the last one signals `done`
+    pthread_mutex_t lock;
+    pthread_cond_t  done;
+    size_t          running;
+} check_t;
+
+typedef struct {
+    pthread_t thread;
+    check_t*  check;
+
+    // Pieces [first, last), `first` is a multiple of CHAR_BIT so threads
+    // never write to the same byte of the bitfield
+    size_t first;
+    size_t last;
+
+    // Pieces spanning several files are copied here, one buffer per lane
+    uint8_t* scratch[SHA1_MB_MAX_LANES];
+} check_worker_t;
+
+static uint64_t check_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int check_map_files(check_t* check) {
+    torrent_t* torrent = check->torrent;
+
+    check->num_files = list_size(torrent->files);
+    check->files     = calloc(check->num_files, sizeof(check_file_t));
+    if (check->files == NULL) {
+        LOG_ERROR("Failed to allocate memory for %zu files", check->num_files);
+        return -1;
+    }
+
+    uint64_t offset = 0;
+    size_t   i      = 0;
+    for (const list_iterator_t* it = list_iterator_first(torrent->files);
+         it != NULL; it            = list_iterator_next(it), ++i) {
+        const file_t* file = *(file_t**)list_iterator_get(it);
+        check_file_t* cf   = &check->files[i];
+
+        cf->offset = offset;
+        cf->size   = get_file_size(file);
+        offset += cf->size;
+
+        int fd = open(get_file_path(file), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            LOG_WARN("Failed to open file `%s`: %s", get_file_path(file),
+                     strerror(errno));
+            continue;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            LOG_WARN("Failed to stat file `%s`: %s", get_file_path(file),
+                     strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        // Mapping past the end of the file would fault when read
+        cf->mapped = (uint64_t)st.st_size;
+        if (cf->mapped > cf->size) {
+            cf->mapped = cf->size;
+        }
+        if (cf->mapped == 0) {
+            close(fd);
+            continue;
+        }
+
+        cf->map = mmap(NULL, cf->mapped, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (cf->map == MAP_FAILED) {
+            LOG_ERROR("Failed to map file `%s`: %s", get_file_path(file),
+                      strerror(errno));
+            cf->map = NULL;
+            return -1;
+        }
+
+        madvise(cf->map, cf->mapped, MADV_SEQUENTIAL);
+    }
+
+    return 0;
+}
+
+static void check_unmap_files(check_t* check) {
+    for (size_t i = 0; i < check->num_files; ++i) {
+        if (check->files[i].map != NULL) {
+            munmap(check->files[i].map, check->files[i].mapped);
+        }
+    }
+
+    free(check->files);
+}
+
+// Index of the file holding the byte at `offset` of the torrent data
+static size_t check_find_file(const check_t* check, uint64_t offset) {
+    size_t low  = 0;
+    size_t high = check->num_files;
+
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+        if (check->files[mid].offset <= offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/*
+ * Get a pointer to the data of a piece, straight from the mapping when the
+ * piece fits in one file, otherwise copied to `*scratch`. NULL if part of the
+ * piece is not on disk.
+ */
+static const uint8_t* check_piece_data(check_worker_t* worker, size_t index,
+                                       uint64_t length, uint8_t** scratch) {
+    const check_t* check  = worker->check;
+    uint64_t       offset = index * check->torrent->piece_length;
+    size_t         i      = check_find_file(check, offset);
+
+    const check_file_t* cf = &check->files[i];
+    if (offset - cf->offset + length <= cf->size) {
+        if (offset - cf->offset + length > cf->mapped) {
+            return NULL;
+        }
+
+        return cf->map + (offset - cf->offset);
+    }
+
+    if (*scratch == NULL) {
+        *scratch = malloc(check->torrent->piece_length);
+        if (*scratch == NULL) {
+            LOG_ERROR("Failed to allocate memory for piece %zu", index);
+            return NULL;
+        }
+    }
+
+    uint64_t copied = 0;
+    for (; copied < length && i < check->num_files; ++i) {
+        cf = &check->files[i];
+
+        uint64_t start = offset + copied - cf->offset;
+        uint64_t n     = cf->size - start;
+        if (n > length - copied) {
+            n = length - copied;
+        }
+
+        if (start + n > cf->mapped) {
+            return NULL;
+        }
+
+        memcpy(*scratch + copied, cf->map + start, n);
+        copied += n;
+    }
+
+    return copied == length ? *scratch : NULL;
+}
+
+static void* check_worker(void* arg) {
+    check_worker_t* worker  = arg;
+    check_t*        check   = worker->check;
+    torrent_t*      torrent = check->torrent;
+
+    size_t         lanes = sha1_get_lanes();
+    const uint8_t* data[SHA1_MB_MAX_LANES];
+    size_t         size[SHA1_MB_MAX_LANES];
+    size_t         index[SHA1_MB_MAX_LANES];
+    uint8_t        digest[SHA1_MB_MAX_LANES][SHA1_DIGEST_SIZE];
+
+    size_t next = worker->first;
+    while (next < worker->last) {
+        // Gather a batch of pieces that are on disk
+        size_t   num   = 0;
+        uint64_t bytes = 0;
+        for (; next < worker->last && num < lanes; ++next) {
+            uint64_t length = torrent_piece_length(torrent, next);
+            data[num] = check_piece_data(worker, next, length,
+                                         &worker->scratch[num]);
+            if (data[num] == NULL) {
+                atomic_fetch_add(&check->pieces, 1);
+                continue;
+            }
+
+            size[num]  = length;
+            index[num] = next;
+            bytes += length;
+            num++;
+        }
+
+        // Not a mismatch, the pieces were not hashed at all
+        if (sha1_many(data, size, num, digest) != 0) {
+            atomic_store(&check->failed, true);
+            break;
+        }
+
+        size_t complete = 0;
+        for (size_t i = 0; i < num; ++i) {
+            if (memcmp(digest[i], torrent->pieces[index[i]], SHA1_DIGEST_SIZE)
+                == 0) {
+                check->bitfield->data[index[i] / CHAR_BIT]
+                    |= 1 << (CHAR_BIT - index[i] % CHAR_BIT - 1);
+                complete++;
+            }
+        }
+
+        atomic_fetch_add(&check->bytes, bytes);
+        atomic_fetch_add(&check->pieces, num);
+        atomic_fetch_add(&check->complete, complete);
+    }
+
+    pthread_mutex_lock(&check->lock);
+    if (--check->running == 0) {
+        pthread_cond_signal(&check->done);
+    }
+    pthread_mutex_unlock(&check->lock);
+
+    return NULL;
+}
+
+static void check_log_progress(const check_t* check, uint64_t bytes,
+                               uint64_t elapsed_ns) {
+    size_t num_pieces = check->torrent->num_pieces;
+    size_t pieces     = atomic_load(&check->pieces);
+    double secs       = elapsed_ns > 0 ? elapsed_ns / 1e9 : 1;
+
+    LOG_INFO("Checked %zu/%zu pieces (%.1f%%) at %.2f GB/s", pieces,
+             num_pieces, num_pieces > 0 ? 100.0 * pieces / num_pieces : 100.0,
+             bytes / secs / 1e9);
+}
+
+byte_str_t* check_torrent(torrent_t* torrent, size_t num_threads) {
+    if (torrent == NULL) {
+        LOG_WARN("Must provide a torrent");
+        return NULL;
+    }
+
+    if (num_threads == 0) {
+        long cpus   = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus > 0 ? cpus : 1;
+    }
+
+    if (num_threads > CHECK_MAX_THREADS) {
+        num_threads = CHECK_MAX_THREADS;
+    }
+
+    // Each thread gets whole bytes of the bitfield
+    size_t num_bytes = (torrent->num_pieces + CHAR_BIT - 1) / CHAR_BIT;
+    if (num_threads > num_bytes) {
+        num_threads = num_bytes > 0 ? num_bytes : 1;
+    }
+
+    check_t check = {
+        .torrent = torrent,
+        .lock    = PTHREAD_MUTEX_INITIALIZER,
+        .done    = PTHREAD_COND_INITIALIZER,
+    };
+    atomic_init(&check.bytes, 0);
+    atomic_init(&check.pieces, 0);
+    atomic_init(&check.complete, 0);
+    atomic_init(&check.failed, false);
+    check.running = num_threads;
+
+    check.bitfield = calloc(1, sizeof(byte_str_t) + num_bytes + 1);
+    if (check.bitfield == NULL) {
+        LOG_ERROR("Failed to allocate memory for bitfield");
+        return NULL;
+    }
+    check.bitfield->len = num_bytes;
+
+    check_worker_t* workers = calloc(num_threads, sizeof(check_worker_t));
+    if (workers == NULL) {
+        LOG_ERROR("Failed to allocate memory for check threads");
+        free(check.bitfield);
+        return NULL;
+    }
+
+    if (check_map_files(&check) != 0) {
+        check_unmap_files(&check);
+        free(workers);
+        free(check.bitfield);
+        return NULL;
+    }
+
+    LOG_INFO("Checking %zu pieces with %zu threads", torrent->num_pieces,
+             num_threads);
+
+    uint64_t start   = check_now_ns();
+    size_t   started = 0;
+    for (; started < num_threads; ++started) {
+        check_worker_t* worker = &workers[started];
+
+        worker->check = &check;
+        worker->first = num_bytes * started / num_threads * CHAR_BIT;
+        worker->last  = num_bytes * (started + 1) / num_threads * CHAR_BIT;
+        if (worker->last > torrent->num_pieces) {
+            worker->last = torrent->num_pieces;
+        }
+
+        if (pthread_create(&worker->thread, NULL, check_worker, worker) != 0) {
+            LOG_ERROR("Failed to create check thread");
+            pthread_mutex_lock(&check.lock);
+            check.running -= num_threads - started;
+            pthread_mutex_unlock(&check.lock);
+            break;
+        }
+    }
+
+    // Report progress until every thread is done
+    uint64_t        last_bytes = 0;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CHECK_PROGRESS_INTERVAL;
+
+    pthread_mutex_lock(&check.lock);
+    while (check.running > 0) {
+        if (pthread_cond_timedwait(&check.done, &check.lock, &deadline)
+            == ETIMEDOUT) {
+            uint64_t bytes = atomic_load(&check.bytes);
+            check_log_progress(&check, bytes - last_bytes,
+                               CHECK_PROGRESS_INTERVAL * 1000000000ULL);
+            last_bytes = bytes;
+            deadline.tv_sec += CHECK_PROGRESS_INTERVAL;
+        }
+    }
+    pthread_mutex_unlock(&check.lock);
+
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        for (size_t l = 0; l < SHA1_MB_MAX_LANES; ++l) {
+            free(workers[i].scratch[l]);
+        }
+    }
+
+    check_unmap_files(&check);
+    free(workers);
+
+    if (started < num_threads || atomic_load(&check.failed)) {
+        LOG_ERROR("Failed to check the torrent data");
+        free(check.bitfield);
+        return NULL;
+    }
+
+    uint64_t elapsed  = check_now_ns() - start;
+    size_t   complete = atomic_load(&check.complete);
+    double   secs     = elapsed / 1e9;
+    LOG_INFO("Checked %zu pieces in %.2f s (%.2f GB/s), %zu complete",
+             torrent->num_pieces, secs,
+             secs > 0 ? atomic_load(&check.bytes) / secs / 1e9 : 0.0,
+             complete);
+
+    torrent->pieces_left = torrent->num_pieces - complete;
+    return check.bitfield;
+}
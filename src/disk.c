@@ -0,0 +1,376 @@
+#include "disk.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct disk_job {
+    uint64_t         offset;
+    uint64_t         length;
+    disk_work_fn_t   work; // NULL for a write
+    disk_done_fn_t   done;
+    void*            ctx;
+    int              result;
+    struct disk_job* next;
+    int              iovcnt;
+    struct iovec     iov[];
+} disk_job_t;
+
+typedef struct {
+    pthread_t        thread;
+    disk_t*          disk;
+    size_t           id;
+    _Atomic uint64_t bytes;   // bytes written so far
+    _Atomic uint64_t busy_ns; // time spent writing
+} disk_worker_t;
+
+struct disk {
+    storage_t* storage;
+
+    // Jobs waiting for a thread, sorted by offset. `head_pos` is where the
+    // last job taken ends, the next one is the first at or after it.
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    pthread_cond_t  idle; // signaled when nothing is queued or running
+    disk_job_t*     head;
+    uint64_t        head_pos;
+    size_t          num_running;
+    bool            stop;
+
+    // Jobs done, pushed by the threads and taken all at once by disk_poll,
+    // so it is a lock-free stack with a single consumer
+    _Atomic(disk_job_t*) done;
+    int                  eventfd;
+
+    disk_worker_t* workers;
+    size_t         num_workers;
+};
+
+static uint64_t disk_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void disk_post(disk_t* disk, disk_job_t* job) {
+    job->next = atomic_load(&disk->done);
+    while (!atomic_compare_exchange_weak(&disk->done, &job->next, job)) {
+    }
+
+    uint64_t one = 1;
+    if (write(disk->eventfd, &one, sizeof(one)) != sizeof(one)) {
+        LOG_ERROR("Failed to signal disk completion: %s", strerror(errno));
+    }
+}
+
+// Take the first job at or after the head, or the first one if the head
+// passed them all. Must be called with the lock held and a job queued.
+static disk_job_t* disk_take(disk_t* disk) {
+    disk_job_t** link = &disk->head;
+    while (*link != NULL && (*link)->offset < disk->head_pos) {
+        link = &(*link)->next;
+    }
+
+    if (*link == NULL) {
+        link = &disk->head;
+    }
+
+    disk_job_t* job = *link;
+    *link           = job->next;
+    disk->head_pos  = job->offset + job->length;
+    return job;
+}
+
+static void* disk_worker(void* arg) {
+    disk_worker_t* worker = arg;
+    disk_t*        disk   = worker->disk;
+
+    for (;;) {
+        pthread_mutex_lock(&disk->lock);
+        while (disk->head == NULL && !disk->stop) {
+            pthread_cond_wait(&disk->cond, &disk->lock);
+        }
+
+        // Jobs left are carried out before stopping
+        if (disk->head == NULL) {
+            pthread_mutex_unlock(&disk->lock);
+            return NULL;
+        }
+
+        disk_job_t* job = disk_take(disk);
+        disk->num_running++;
+        pthread_mutex_unlock(&disk->lock);
+
+        // Only writes count in the throughput
+        if (job->work != NULL) {
+            job->result = job->work(job->ctx);
+        } else {
+            uint64_t start = disk_now_ns();
+            job->result    = storage_writev(disk->storage, job->offset,
+                                            job->iov, job->iovcnt);
+            atomic_fetch_add(&worker->bytes, job->length);
+            atomic_fetch_add(&worker->busy_ns, disk_now_ns() - start);
+        }
+
+        disk_post(disk, job);
+
+        pthread_mutex_lock(&disk->lock);
+        disk->num_running--;
+        if (disk->head == NULL && disk->num_running == 0) {
+            pthread_cond_broadcast(&disk->idle);
+        }
+        pthread_mutex_unlock(&disk->lock);
+    }
+}
+
+disk_t* disk_create(storage_t* storage, size_t num_threads) {
+    if (storage == NULL) {
+        LOG_WARN("Must provide a storage");
+        return NULL;
+    }
+
+    if (num_threads == 0) {
+        num_threads = DISK_DEFAULT_THREADS;
+    } else if (num_threads > DISK_MAX_THREADS) {
+        num_threads = DISK_MAX_THREADS;
+    }
+
+    disk_t* disk = malloc(sizeof(disk_t));
+    if (disk == NULL) {
+        LOG_ERROR("Failed to allocate memory for disk");
+        return NULL;
+    }
+
+    disk->storage     = storage;
+    disk->head        = NULL;
+    disk->head_pos    = 0;
+    disk->num_running = 0;
+    disk->stop        = false;
+    disk->num_workers = 0;
+    atomic_init(&disk->done, NULL);
+
+    disk->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (disk->eventfd < 0) {
+        LOG_ERROR("Failed to create eventfd: %s", strerror(errno));
+        free(disk);
+        return NULL;
+    }
+
+    disk->workers = calloc(num_threads, sizeof(disk_worker_t));
+    if (disk->workers == NULL) {
+        LOG_ERROR("Failed to allocate memory for disk threads");
+        close(disk->eventfd);
+        free(disk);
+        return NULL;
+    }
+
+    pthread_mutex_init(&disk->lock, NULL);
+    pthread_cond_init(&disk->cond, NULL);
+    pthread_cond_init(&disk->idle, NULL);
+
+    for (size_t i = 0; i < num_threads; ++i) {
+        disk_worker_t* worker = &disk->workers[i];
+        worker->disk          = disk;
+        worker->id            = i;
+        atomic_init(&worker->bytes, 0);
+        atomic_init(&worker->busy_ns, 0);
+
+        if (pthread_create(&worker->thread, NULL, disk_worker, worker) != 0) {
+            LOG_ERROR("Failed to create disk thread");
+            disk_free(disk);
+            return NULL;
+        }
+
+        disk->num_workers++;
+    }
+
+    LOG_DEBUG("Started %zu disk threads", disk->num_workers);
+    return disk;
+}
+
+void disk_free(disk_t* disk) {
+    if (disk == NULL) {
+        LOG_WARN("Trying to free NULL disk");
+        return;
+    }
+
+    pthread_mutex_lock(&disk->lock);
+    disk->stop = true;
+    pthread_cond_broadcast(&disk->cond);
+    pthread_mutex_unlock(&disk->lock);
+
+    for (size_t i = 0; i < disk->num_workers; ++i) {
+        pthread_join(disk->workers[i].thread, NULL);
+    }
+
+    // Only left if the threads could not be started
+    while (disk->head != NULL) {
+        disk_job_t* job = disk->head;
+        disk->head      = job->next;
+        job->result     = -1;
+        disk_post(disk, job);
+    }
+
+    disk_poll(disk);
+
+    pthread_mutex_destroy(&disk->lock);
+    pthread_cond_destroy(&disk->cond);
+    pthread_cond_destroy(&disk->idle);
+    close(disk->eventfd);
+    free(disk->workers);
+    free(disk);
+}
+
+int disk_fd(const disk_t* disk) {
+    return disk->eventfd;
+}
+
+// Insert a job in offset order and wake a thread for it
+static void disk_queue(disk_t* disk, disk_job_t* job) {
+    pthread_mutex_lock(&disk->lock);
+
+    disk_job_t** link = &disk->head;
+    while (*link != NULL && (*link)->offset <= job->offset) {
+        link = &(*link)->next;
+    }
+    job->next = *link;
+    *link     = job;
+
+    pthread_cond_signal(&disk->cond);
+    pthread_mutex_unlock(&disk->lock);
+}
+
+int disk_write(disk_t* disk, uint64_t offset, const struct iovec* iov,
+               int iovcnt, disk_done_fn_t done, void* ctx) {
+    if (disk == NULL || iov == NULL || iovcnt <= 0 || done == NULL) {
+        LOG_WARN("Must provide a disk, buffers and a callback");
+        return -1;
+    }
+
+    disk_job_t* job
+        = malloc(sizeof(disk_job_t) + iovcnt * sizeof(struct iovec));
+    if (job == NULL) {
+        LOG_ERROR("Failed to allocate memory for disk job");
+        return -1;
+    }
+
+    job->offset = offset;
+    job->length = 0;
+    job->work   = NULL;
+    job->done   = done;
+    job->ctx    = ctx;
+    job->result = -1;
+    job->iovcnt = iovcnt;
+    memcpy(job->iov, iov, iovcnt * sizeof(struct iovec));
+
+    for (int i = 0; i < iovcnt; ++i) {
+        job->length += iov[i].iov_len;
+    }
+
+    disk_queue(disk, job);
+    return 0;
+}
+
+int disk_call(disk_t* disk, disk_work_fn_t work, disk_done_fn_t done,
+              void* ctx) {
+    if (disk == NULL || work == NULL || done == NULL) {
+        LOG_WARN("Must provide a disk, a function and a callback");
+        return -1;
+    }
+
+    disk_job_t* job = malloc(sizeof(disk_job_t));
+    if (job == NULL) {
+        LOG_ERROR("Failed to allocate memory for disk job");
+        return -1;
+    }
+
+    // Past every write, the head wraps around after it
+    job->offset = UINT64_MAX;
+    job->length = 0;
+    job->work   = work;
+    job->done   = done;
+    job->ctx    = ctx;
+    job->result = -1;
+    job->iovcnt = 0;
+
+    disk_queue(disk, job);
+    return 0;
+}
+
+void disk_wait(disk_t* disk) {
+    if (disk == NULL) {
+        LOG_WARN("Must provide a disk");
+        return;
+    }
+
+    pthread_mutex_lock(&disk->lock);
+    while (disk->head != NULL || disk->num_running > 0) {
+        pthread_cond_wait(&disk->idle, &disk->lock);
+    }
+    pthread_mutex_unlock(&disk->lock);
+}
+
+size_t disk_poll(disk_t* disk) {
+    if (disk == NULL) {
+        LOG_WARN("Must provide a disk");
+        return 0;
+    }
+
+    // Reset the eventfd before taking the jobs, anything posted after this
+    // signals it again
+    uint64_t count;
+    if (read(disk->eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        LOG_ERROR("Failed to read disk completions: %s", strerror(errno));
+    }
+
+    disk_job_t* job = atomic_exchange(&disk->done, NULL);
+
+    // The stack is newest first
+    disk_job_t* ordered = NULL;
+    while (job != NULL) {
+        disk_job_t* next = job->next;
+        job->next        = ordered;
+        ordered          = job;
+        job              = next;
+    }
+
+    size_t num_jobs = 0;
+    while (ordered != NULL) {
+        disk_job_t* next = ordered->next;
+        ordered->done(ordered->ctx, ordered->result);
+        free(ordered);
+        ordered = next;
+        num_jobs++;
+    }
+
+    return num_jobs;
+}
+
+void disk_log_stats(const disk_t* disk) {
+    if (disk == NULL) {
+        LOG_WARN("Must provide a disk");
+        return;
+    }
+
+    for (size_t i = 0; i < disk->num_workers; ++i) {
+        const disk_worker_t* worker = &disk->workers[i];
+
+        uint64_t bytes   = atomic_load(&worker->bytes);
+        uint64_t busy_ns = atomic_load(&worker->busy_ns);
+        if (bytes == 0) {
+            continue;
+        }
+
+        double mib  = (double)bytes / (1024 * 1024);
+        double secs = busy_ns > 0 ? busy_ns / 1e9 : 1;
+        LOG_INFO("Disk thread %zu: %.1f MiB written at %.1f MiB/s", worker->id,
+                 mib, mib / secs);
+    }
+}
@@ -3,18 +3,212 @@
 #include "log.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 struct file {
     size_t size;
-    char   path[];
+
+    // Descriptor kept open between reads and writes, -1 if not cached
+    int      fd;
+    uint32_t pins; // reads and writes in progress, the fd can't be closed
+    file_t*  lru_prev;
+    file_t*  lru_next;
+
+    char path[];
 };
 
-file_t* file_create(const char* path, size_t size) {
+/*
+ * Open descriptors of every file, most recently used first. Torrents may
+ * have far more files than the process may open, so the least recently used
+ * one is closed when the cache is full.
+ */
+static struct {
+    pthread_mutex_t lock;
+    file_t*         head;
+    file_t*         tail;
+    size_t          num_open;
+    size_t          max_open; // 0 until the first file is opened
+} file_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Leave most of RLIMIT_NOFILE to the sockets
+static size_t file_cache_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY) {
+        return FILE_MAX_OPEN;
+    }
+
+    size_t limit = rl.rlim_cur / 4;
+    if (limit > FILE_MAX_OPEN) {
+        limit = FILE_MAX_OPEN;
+    }
+
+    return limit > 0 ? limit : 1;
+}
+
+static void file_lru_unlink(file_t* file) {
+    if (file->lru_prev != NULL) {
+        file->lru_prev->lru_next = file->lru_next;
+    } else {
+        file_cache.head = file->lru_next;
+    }
+
+    if (file->lru_next != NULL) {
+        file->lru_next->lru_prev = file->lru_prev;
+    } else {
+        file_cache.tail = file->lru_prev;
+    }
+
+    file->lru_prev = NULL;
+    file->lru_next = NULL;
+}
+
+static void file_lru_push(file_t* file) {
+    file->lru_prev = NULL;
+    file->lru_next = file_cache.head;
+    if (file_cache.head != NULL) {
+        file_cache.head->lru_prev = file;
+    } else {
+        file_cache.tail = file;
+    }
+
+    file_cache.head = file;
+}
+
+// Close the least recently used descriptor that is not in use
+static bool file_cache_evict(void) {
+    for (file_t* file = file_cache.tail; file != NULL; file = file->lru_prev) {
+        if (file->pins == 0) {
+            LOG_DEBUG("Closing file `%s`", file->path);
+            file_lru_unlink(file);
+            close(file->fd);
+            file->fd = -1;
+            file_cache.num_open--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Get a descriptor for the file, opened if it is not cached. It stays open
+ * until file_release is called.
+ */
+static int file_acquire(file_t* file) {
+    pthread_mutex_lock(&file_cache.lock);
+
+    if (file->fd >= 0) {
+        file_lru_unlink(file);
+        file_lru_push(file);
+        file->pins++;
+        pthread_mutex_unlock(&file_cache.lock);
+        return file->fd;
+    }
+
+    if (file_cache.max_open == 0) {
+        file_cache.max_open = file_cache_limit();
+        LOG_DEBUG("Keeping up to %zu files open", file_cache.max_open);
+    }
+
+    while (file_cache.num_open >= file_cache.max_open && file_cache_evict()) {
+    }
+
+    int fd = open(file->path, O_RDWR | O_CLOEXEC);
+    while (fd < 0 && (errno == EMFILE || errno == ENFILE)
+           && file_cache_evict()) {
+        fd = open(file->path, O_RDWR | O_CLOEXEC);
+    }
+
+    if (fd < 0) {
+        LOG_ERROR("Failed to open file `%s`: %s", file->path, strerror(errno));
+        pthread_mutex_unlock(&file_cache.lock);
+        return -1;
+    }
+
+    file->fd   = fd;
+    file->pins = 1;
+    file_lru_push(file);
+    file_cache.num_open++;
+
+    pthread_mutex_unlock(&file_cache.lock);
+    return fd;
+}
+
+static void file_release(file_t* file) {
+    pthread_mutex_lock(&file_cache.lock);
+    file->pins--;
+    pthread_mutex_unlock(&file_cache.lock);
+}
+
+// Last resort when the filesystem can't extend the file any other way
+static int file_zero_fill(int fd, size_t from, size_t size) {
+    uint8_t data[4096] = {0};
+    for (size_t i = from; i < size; i += sizeof(data)) {
+        size_t chunk_size = sizeof(data);
+        if (i + chunk_size > size) {
+            chunk_size = size - i;
+        }
+
+        if (pwrite(fd, data, chunk_size, i) != (ssize_t)chunk_size) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int file_allocate(int fd, const char* path, size_t existing,
+                         size_t size, file_alloc_t alloc) {
+    switch (alloc) {
+    case FILE_ALLOC_NONE:
+        return 0;
+    case FILE_ALLOC_SPARSE:
+        if (ftruncate(fd, size) == 0) {
+            return 0;
+        }
+
+        LOG_WARN("Failed to extend file `%s`: %s", path, strerror(errno));
+        break;
+    case FILE_ALLOC_FULL:
+        if (fallocate(fd, 0, existing, size - existing) == 0) {
+            return 0;
+        }
+
+        // Emulated by glibc on filesystems without fallocate, one byte per
+        // block is still much less than the whole file
+        if (errno == EOPNOTSUPP) {
+            int err = posix_fallocate(fd, existing, size - existing);
+            if (err == 0) {
+                return 0;
+            }
+            errno = err;
+        }
+
+        LOG_WARN("Failed to allocate file `%s`: %s", path, strerror(errno));
+        break;
+    }
+
+    LOG_WARN("Writing zeros to file `%s`", path);
+    if (file_zero_fill(fd, existing, size) != 0) {
+        LOG_ERROR("Failed to write to file `%s`: %s", path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+file_t* file_create(const char* path, size_t size, file_alloc_t alloc) {
     if (path == NULL) {
         LOG_WARN("Must provide a path to create a file");
         return NULL;
@@ -29,45 +223,70 @@ file_t* file_create(const char* path, size_t size) {
     LOG_DEBUG("Creating file `%s` with size %zu", path, size);
 
     strcpy(file->path, path);
-    file->size = size;
+    file->size     = size;
+    file->fd       = -1;
+    file->pins     = 0;
+    file->lru_prev = NULL;
+    file->lru_next = NULL;
 
-    // Prealloc file with zeros
+    // Data already in the file is kept so it can be checked
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERROR("Failed to open file `%s` in write mode: %s", path,
+                  strerror(errno));
+        free(file);
+        return NULL;
+    }
 
-    uint8_t data[4096] = {0};
-    FILE*   fp         = fopen(path, "wb");
-    if (fp == NULL) {
-        LOG_ERROR("Failed to open file `%s` in write mode", path);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        LOG_ERROR("Failed to stat file `%s`: %s", path, strerror(errno));
         free(file);
+        close(fd);
         return NULL;
     }
 
-    for (size_t i = 0; i < size; i += 4096) {
-        size_t chunk_size = 4096;
-        if (i + chunk_size > size) {
-            chunk_size = size - i;
+    size_t existing = st.st_size;
+    if (existing > size) {
+        if (ftruncate(fd, size) != 0) {
+            LOG_ERROR("Failed to truncate file `%s`", path);
+            free(file);
+            close(fd);
+            return NULL;
+        }
+    } else if (existing < size) {
+        if (existing > 0) {
+            LOG_DEBUG("Keeping %zu bytes of file `%s`", existing, path);
         }
 
-        if (fwrite(data, 1, chunk_size, fp) != chunk_size) {
-            LOG_ERROR("Failed to write to file `%s`", path);
+        if (file_allocate(fd, path, existing, size, alloc) != 0) {
             free(file);
-            fclose(fp);
+            close(fd);
             return NULL;
         }
     }
 
-    fseek(fp, 0, SEEK_END);
-    size_t written = ftell(fp);
-    if (written != size) {
-        LOG_ERROR("Failed to write to file `%s`, wrote %zu bytes, "
-                  "expected %zu bytes",
-                  path, written, size);
-        free(file);
-        fclose(fp);
-        return NULL;
+    close(fd);
+    return file;
+}
+
+int file_alloc_parse(const char* name, file_alloc_t* alloc) {
+    if (name == NULL || alloc == NULL) {
+        LOG_WARN("Must provide a name and an allocation mode");
+        return -1;
     }
 
-    fclose(fp);
-    return file;
+    if (strcmp(name, "sparse") == 0) {
+        *alloc = FILE_ALLOC_SPARSE;
+    } else if (strcmp(name, "full") == 0) {
+        *alloc = FILE_ALLOC_FULL;
+    } else if (strcmp(name, "none") == 0) {
+        *alloc = FILE_ALLOC_NONE;
+    } else {
+        return -1;
+    }
+
+    return 0;
 }
 
 size_t get_file_size(const file_t* file) {
@@ -88,6 +307,24 @@ const char* get_file_path(const file_t* file) {
     return file->path;
 }
 
+void file_free(file_t* file) {
+    if (file == NULL) {
+        LOG_WARN("Trying to free NULL file");
+        return;
+    }
+
+    pthread_mutex_lock(&file_cache.lock);
+    assert(file->pins == 0 && "Freeing a file in use");
+    if (file->fd >= 0) {
+        file_lru_unlink(file);
+        close(file->fd);
+        file_cache.num_open--;
+    }
+    pthread_mutex_unlock(&file_cache.lock);
+
+    free(file);
+}
+
 int write_data_to_file(file_t* file, size_t offset, uint8_t* data, size_t len) {
     if (file == NULL || data == NULL) {
         LOG_WARN("Must provide a file and data to write to the file");
@@ -99,34 +336,167 @@ int write_data_to_file(file_t* file, size_t offset, uint8_t* data, size_t len) {
         return -1;
     }
 
-    FILE* fp = fopen(file->path, "r+b");
-    if (fp == NULL) {
-        LOG_ERROR("Failed to open file `%s` in read/write mode", file->path);
-        return -1;
-    }
-
-    if (fseek(fp, offset, SEEK_SET) != 0) {
-        LOG_ERROR("Failed to seek to offset %zu in file `%s`", offset,
-                  file->path);
-        fclose(fp);
+    int fd = file_acquire(file);
+    if (fd < 0) {
         return -1;
     }
 
     size_t total_written = 0;
     while (total_written < len) {
-        size_t written = fwrite(data + total_written, sizeof(uint8_t),
-                                len - total_written, fp);
-        if (written == 0) {
-            LOG_ERROR("Failed to write data to file `%s`", file->path);
-            fclose(fp);
+        ssize_t written = pwrite(fd, data + total_written, len - total_written,
+                                 offset + total_written);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (written <= 0) {
+            LOG_ERROR("Failed to write data to file `%s`: %s", file->path,
+                      written < 0 ? strerror(errno) : "no space written");
+            file_release(file);
             return -1;
         }
         total_written += written;
     }
 
-    assert(total_written == len && "Wrote more data than expected");
+    file_release(file);
+    return 0;
+}
+
+int writev_data_to_file(file_t* file, size_t offset, struct iovec* iov,
+                        int iovcnt) {
+    if (file == NULL || iov == NULL || iovcnt <= 0) {
+        LOG_WARN("Must provide a file and buffers to write to the file");
+        return -1;
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        len += iov[i].iov_len;
+    }
+
+    if (offset + len > file->size) {
+        LOG_ERROR("Attempted to write data past the end of the file");
+        return -1;
+    }
+
+    if (len == 0) {
+        return 0;
+    }
+
+    int fd = file_acquire(file);
+    if (fd < 0) {
+        return -1;
+    }
+
+    while (iovcnt > 0) {
+        ssize_t written = pwritev(fd, iov, iovcnt, offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (written <= 0) {
+            LOG_ERROR("Failed to write data to file `%s`: %s", file->path,
+                      written < 0 ? strerror(errno) : "no space written");
+            file_release(file);
+            return -1;
+        }
+        offset += written;
+
+        // Skip what was written, a short write may stop inside a buffer
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    file_release(file);
+    return 0;
+}
+
+uint8_t* map_file(file_t* file, size_t offset, size_t len) {
+    if (file == NULL || len == 0) {
+        LOG_WARN("Must provide a file and a length to map");
+        return NULL;
+    }
+
+    if (offset + len > file->size) {
+        LOG_ERROR("Attempted to map data past the end of the file");
+        return NULL;
+    }
+
+    int fd = file_acquire(file);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    // Touching a page past the end of the file raises SIGBUS, a file that
+    // was not allocated yet is extended first
+    struct stat st;
+    if (fstat(fd, &st) != 0
+        || ((size_t)st.st_size < offset + len
+            && ftruncate(fd, offset + len) != 0)) {
+        LOG_ERROR("Failed to extend file `%s`: %s", file->path,
+                  strerror(errno));
+        file_release(file);
+        return NULL;
+    }
+
+    uint8_t* map
+        = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    file_release(file);
+
+    if (map == MAP_FAILED) {
+        LOG_ERROR("Failed to map file `%s`: %s", file->path, strerror(errno));
+        return NULL;
+    }
 
-    fclose(fp);
+    // Blocks are written and read in whatever order peers ask for them,
+    // reading ahead would mostly fetch pages that are about to be overwritten
+    madvise(map, len, MADV_RANDOM);
+    return map;
+}
+
+int read_data_from_file(file_t* file, size_t offset, uint8_t* data,
+                        size_t len) {
+    if (file == NULL || data == NULL) {
+        LOG_WARN("Must provide a file and a buffer to read the file into");
+        return -1;
+    }
+
+    if (offset + len > file->size) {
+        LOG_ERROR("Attempted to read data past the end of the file");
+        return -1;
+    }
+
+    int fd = file_acquire(file);
+    if (fd < 0) {
+        return -1;
+    }
+
+    size_t total_read = 0;
+    while (total_read < len) {
+        ssize_t n = pread(fd, data + total_read, len - total_read,
+                          offset + total_read);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            LOG_ERROR("Failed to read data from file `%s`: %s", file->path,
+                      n < 0 ? strerror(errno) : "unexpected end of file");
+            file_release(file);
+            return -1;
+        }
+        total_read += n;
+    }
+
+    file_release(file);
     return 0;
 }
 
@@ -135,6 +505,34 @@ bool dir_exists(const char* path) {
     return stat(path, &sb) == 0 && S_ISDIR(sb.st_mode);
 }
 
+ssize_t send_data_from_file(file_t* file, int sockfd, size_t offset,
+                            size_t len) {
+    if (file == NULL) {
+        LOG_WARN("Must provide a file");
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (offset + len > file->size) {
+        LOG_ERROR("Attempted to send data past the end of the file");
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = file_acquire(file);
+    if (fd < 0) {
+        return -1;
+    }
+
+    off_t   off  = offset;
+    ssize_t sent = sendfile(sockfd, fd, &off, len);
+    int     err  = errno;
+
+    file_release(file);
+    errno = err;
+    return sent;
+}
+
 int create_dir(const char* path) {
     if (path == NULL) {
         LOG_WARN("Must provide a path to create a directory");
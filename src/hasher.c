@@ -0,0 +1,350 @@
+#include "hasher.h"
+
+#include "log.h"
+#include "sha1_mb.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct hasher_job {
+    hasher_result_t    result;
+    uint8_t            expected[SHA1_DIGEST_SIZE];
+    struct hasher_job* next;
+} hasher_job_t;
+
+typedef struct {
+    pthread_t        thread;
+    hasher_t*        hasher;
+    size_t           id;
+    _Atomic uint64_t bytes;   // bytes hashed so far
+    _Atomic uint64_t busy_ns; // time spent hashing
+} hasher_worker_t;
+
+struct hasher {
+    // Jobs waiting for a thread, oldest first
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    hasher_job_t*   head;
+    hasher_job_t*   tail;
+    size_t          num_jobs;
+    bool            stop;
+
+    // Verified jobs, pushed by the threads and taken all at once by
+    // hasher_poll, so it is a lock-free stack with a single consumer
+    _Atomic(hasher_job_t*) done;
+    int                    eventfd;
+
+    hasher_worker_t* workers;
+    size_t           num_workers;
+};
+
+static uint64_t hasher_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Verify a batch of pieces, hashed together by sha1_update_many. The blocks
+ * the network thread hashed as they arrived in order are skipped.
+ */
+static void hasher_verify(hasher_worker_t* worker, hasher_job_t* jobs[],
+                          size_t num_jobs) {
+    sha1_ctx_t*    ctx[SHA1_MB_MAX_LANES];
+    const uint8_t* data[SHA1_MB_MAX_LANES];
+    size_t         size[SHA1_MB_MAX_LANES];
+    uint64_t       start = hasher_now_ns();
+    uint64_t       bytes = 0;
+
+    for (size_t i = 0; i < num_jobs; ++i) {
+        piece_t* piece = jobs[i]->result.piece;
+        size_t   done  = (size_t)piece->num_hashed * BLOCK_SIZE;
+        if (done > piece->length) {
+            done = piece->length; // the last block is shorter
+        }
+
+        ctx[i]             = piece->hash;
+        data[i]            = piece->data + done;
+        size[i]            = piece->length - done;
+        piece->num_hashed  = piece->num_blocks;
+        bytes             += size[i];
+    }
+
+    sha1_update_many(ctx, data, size, num_jobs);
+
+    for (size_t i = 0; i < num_jobs; ++i) {
+        hasher_result_t* result = &jobs[i]->result;
+
+        piece_digest(result->piece, result->digest);
+        result->valid
+            = memcmp(result->digest, jobs[i]->expected, SHA1_DIGEST_SIZE) == 0;
+    }
+
+    atomic_fetch_add(&worker->bytes, bytes);
+    atomic_fetch_add(&worker->busy_ns, hasher_now_ns() - start);
+}
+
+static void hasher_post(hasher_t* hasher, hasher_job_t* job) {
+    job->next = atomic_load(&hasher->done);
+    while (!atomic_compare_exchange_weak(&hasher->done, &job->next, job)) {
+    }
+
+    uint64_t one = 1;
+    if (write(hasher->eventfd, &one, sizeof(one)) != sizeof(one)) {
+        LOG_ERROR("Failed to signal hash result: %s", strerror(errno));
+    }
+}
+
+static void* hasher_worker(void* arg) {
+    hasher_worker_t* worker = arg;
+    hasher_t*        hasher = worker->hasher;
+    hasher_job_t*    jobs[SHA1_MB_MAX_LANES];
+
+    for (;;) {
+        pthread_mutex_lock(&hasher->lock);
+        while (hasher->head == NULL && !hasher->stop) {
+            pthread_cond_wait(&hasher->cond, &hasher->lock);
+        }
+
+        if (hasher->stop) {
+            pthread_mutex_unlock(&hasher->lock);
+            return NULL;
+        }
+
+        // Take a batch for the SIMD lanes only when there is work for every
+        // thread, a single piece is still faster on its own thread
+        size_t batch = hasher->num_jobs / hasher->num_workers;
+        if (batch > sha1_get_lanes()) {
+            batch = sha1_get_lanes();
+        }
+
+        size_t num_jobs = 0;
+        do {
+            jobs[num_jobs++] = hasher->head;
+            hasher->head     = hasher->head->next;
+            hasher->num_jobs--;
+        } while (hasher->head != NULL && num_jobs < batch);
+
+        if (hasher->head == NULL) {
+            hasher->tail = NULL;
+        }
+        pthread_mutex_unlock(&hasher->lock);
+
+        hasher_verify(worker, jobs, num_jobs);
+        for (size_t i = 0; i < num_jobs; ++i) {
+            hasher_post(hasher, jobs[i]);
+        }
+    }
+}
+
+static void hasher_free_jobs(hasher_job_t* job) {
+    while (job != NULL) {
+        hasher_job_t* next = job->next;
+        piece_free(job->result.piece);
+        free(job);
+        job = next;
+    }
+}
+
+hasher_t* hasher_create(size_t num_threads) {
+    if (num_threads == 0) {
+        long cpus   = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus > 0 ? cpus : 1;
+    }
+
+    if (num_threads > HASHER_MAX_THREADS) {
+        num_threads = HASHER_MAX_THREADS;
+    }
+
+    hasher_t* hasher = malloc(sizeof(hasher_t));
+    if (hasher == NULL) {
+        LOG_ERROR("Failed to allocate memory for hasher");
+        return NULL;
+    }
+
+    hasher->head        = NULL;
+    hasher->tail        = NULL;
+    hasher->num_jobs    = 0;
+    hasher->stop        = false;
+    hasher->num_workers = 0;
+    atomic_init(&hasher->done, NULL);
+
+    hasher->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (hasher->eventfd < 0) {
+        LOG_ERROR("Failed to create eventfd: %s", strerror(errno));
+        free(hasher);
+        return NULL;
+    }
+
+    hasher->workers = calloc(num_threads, sizeof(hasher_worker_t));
+    if (hasher->workers == NULL) {
+        LOG_ERROR("Failed to allocate memory for hasher threads");
+        close(hasher->eventfd);
+        free(hasher);
+        return NULL;
+    }
+
+    pthread_mutex_init(&hasher->lock, NULL);
+    pthread_cond_init(&hasher->cond, NULL);
+
+    for (size_t i = 0; i < num_threads; ++i) {
+        hasher_worker_t* worker = &hasher->workers[i];
+        worker->hasher          = hasher;
+        worker->id              = i;
+        atomic_init(&worker->bytes, 0);
+        atomic_init(&worker->busy_ns, 0);
+
+        if (pthread_create(&worker->thread, NULL, hasher_worker, worker)
+            != 0) {
+            LOG_ERROR("Failed to create hasher thread");
+            hasher_free(hasher);
+            return NULL;
+        }
+
+        hasher->num_workers++;
+    }
+
+    LOG_DEBUG("Started %zu hashing threads using the %s SHA-1 implementation "
+              "and %zu lanes",
+              hasher->num_workers, sha1_impl_name(sha1_get_impl()),
+              sha1_get_lanes());
+    return hasher;
+}
+
+void hasher_free(hasher_t* hasher) {
+    if (hasher == NULL) {
+        LOG_WARN("Trying to free NULL hasher");
+        return;
+    }
+
+    pthread_mutex_lock(&hasher->lock);
+    hasher->stop = true;
+    pthread_cond_broadcast(&hasher->cond);
+    pthread_mutex_unlock(&hasher->lock);
+
+    for (size_t i = 0; i < hasher->num_workers; ++i) {
+        pthread_join(hasher->workers[i].thread, NULL);
+    }
+
+    hasher_free_jobs(hasher->head);
+    hasher_free_jobs(atomic_load(&hasher->done));
+
+    pthread_mutex_destroy(&hasher->lock);
+    pthread_cond_destroy(&hasher->cond);
+    close(hasher->eventfd);
+    free(hasher->workers);
+    free(hasher);
+}
+
+int hasher_fd(const hasher_t* hasher) {
+    return hasher->eventfd;
+}
+
+int hasher_submit(hasher_t* hasher, piece_t* piece,
+                  const uint8_t expected[SHA1_DIGEST_SIZE]) {
+    if (hasher == NULL || piece == NULL || expected == NULL) {
+        LOG_WARN("Must provide a hasher, a piece and a digest");
+        return -1;
+    }
+
+    hasher_job_t* job = malloc(sizeof(hasher_job_t));
+    if (job == NULL) {
+        LOG_ERROR("Failed to allocate memory for hash job");
+        return -1;
+    }
+
+    job->result.piece = piece;
+    job->result.valid = false;
+    job->next         = NULL;
+    memcpy(job->expected, expected, SHA1_DIGEST_SIZE);
+
+    pthread_mutex_lock(&hasher->lock);
+    if (hasher->tail == NULL) {
+        hasher->head = job;
+    } else {
+        hasher->tail->next = job;
+    }
+    hasher->tail = job;
+    hasher->num_jobs++;
+    pthread_cond_signal(&hasher->cond);
+    pthread_mutex_unlock(&hasher->lock);
+
+    return 0;
+}
+
+size_t hasher_poll(hasher_t* hasher, hasher_done_fn_t done, void* ctx) {
+    if (hasher == NULL || done == NULL) {
+        LOG_WARN("Must provide a hasher and a callback");
+        return 0;
+    }
+
+    // Reset the eventfd before taking the results, anything posted after
+    // this signals it again
+    uint64_t count;
+    if (read(hasher->eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        LOG_ERROR("Failed to read hash results: %s", strerror(errno));
+    }
+
+    hasher_job_t* job = atomic_exchange(&hasher->done, NULL);
+
+    // The stack is newest first
+    hasher_job_t* ordered = NULL;
+    while (job != NULL) {
+        hasher_job_t* next = job->next;
+        job->next          = ordered;
+        ordered            = job;
+        job                = next;
+    }
+
+    size_t num_results = 0;
+    while (ordered != NULL) {
+        hasher_job_t* next = ordered->next;
+        done(ctx, &ordered->result);
+        free(ordered);
+        ordered = next;
+        num_results++;
+    }
+
+    return num_results;
+}
+
+uint64_t hasher_bytes(const hasher_t* hasher) {
+    if (hasher == NULL) {
+        LOG_WARN("Must provide a hasher");
+        return 0;
+    }
+
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < hasher->num_workers; ++i) {
+        bytes += atomic_load(&hasher->workers[i].bytes);
+    }
+
+    return bytes;
+}
+
+void hasher_log_stats(const hasher_t* hasher) {
+    if (hasher == NULL) {
+        LOG_WARN("Must provide a hasher");
+        return;
+    }
+
+    for (size_t i = 0; i < hasher->num_workers; ++i) {
+        const hasher_worker_t* worker = &hasher->workers[i];
+
+        uint64_t bytes   = atomic_load(&worker->bytes);
+        uint64_t busy_ns = atomic_load(&worker->busy_ns);
+        if (bytes == 0) {
+            continue;
+        }
+
+        double mib  = (double)bytes / (1024 * 1024);
+        double secs = busy_ns > 0 ? busy_ns / 1e9 : 1;
+        LOG_INFO("Hash thread %zu: %.1f MiB hashed at %.1f MiB/s", worker->id,
+                 mib, mib / secs);
+    }
+}
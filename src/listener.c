@@ -0,0 +1,105 @@
+#include "listener.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+struct listener {
+    int sockfd;
+};
+
+listener_t* listener_create(uint16_t port) {
+    listener_t* listener = malloc(sizeof(listener_t));
+    if (listener == NULL) {
+        LOG_ERROR("Failed to allocate memory for listener");
+        return NULL;
+    }
+
+    listener->sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK
+                                           | SOCK_CLOEXEC,
+                              0);
+    if (listener->sockfd < 0) {
+        LOG_ERROR("Failed to create listening socket: %s", strerror(errno));
+        free(listener);
+        return NULL;
+    }
+
+    // Restarting the client should not wait for old connections to expire
+    int reuse = 1;
+    if (setsockopt(listener->sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                   sizeof(reuse))
+        != 0) {
+        LOG_WARN("Failed to reuse the listening address");
+    }
+
+    struct sockaddr_in addr = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+
+    if (bind(listener->sockfd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || listen(listener->sockfd, LISTENER_BACKLOG) != 0) {
+        LOG_ERROR("Failed to listen on port %u: %s", port, strerror(errno));
+        close(listener->sockfd);
+        free(listener);
+        return NULL;
+    }
+
+    LOG_INFO("Listening for peers on port %u", port);
+    return listener;
+}
+
+void listener_free(listener_t* listener) {
+    if (listener == NULL) {
+        LOG_WARN("Trying to free NULL listener");
+        return;
+    }
+
+    close(listener->sockfd);
+    free(listener);
+}
+
+int listener_fd(const listener_t* listener) {
+    return listener->sockfd;
+}
+
+int listener_accept(listener_t* listener, struct sockaddr_in* addr) {
+    if (listener == NULL || addr == NULL) {
+        LOG_WARN("Must provide a listener and an address");
+        return -1;
+    }
+
+    for (;;) {
+        socklen_t addr_len = sizeof(*addr);
+        int       sockfd   = accept4(listener->sockfd, (struct sockaddr*)addr,
+                                     &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sockfd >= 0) {
+            // Same as outgoing connections, see peer_connect
+            int nodelay = 1;
+            if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+                           sizeof(nodelay))
+                != 0) {
+                LOG_WARN("Failed to disable Nagle's algorithm");
+            }
+
+            return sockfd;
+        }
+
+        // The peer gave up before it was accepted
+        if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            LOG_ERROR("Failed to accept connection: %s", strerror(errno));
+        }
+
+        return -1;
+    }
+}
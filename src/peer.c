@@ -1,17 +1,18 @@
 #include "peer.h"
 
 #include "byte_str.h"
-#include "file.h"
-#include "list.h"
 #include "log.h"
 #include "peer_id.h"
 #include "peer_msg.h"
+#include "ring_buf.h"
 #include "sha1.h"
 
-#include <assert.h>
+#include <errno.h>
 #include <limits.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #define PROTOCOL     "BitTorrent protocol"
@@ -19,63 +20,77 @@
 
 #define HANDSHAKE_LEN (1 + PROTOCOL_LEN + 8 + SHA1_DIGEST_SIZE + PEER_ID_SIZE)
 
-static int peer_connect_socket(peer_t* peer) {
-    if (peer == NULL) {
-        LOG_WARN("Must provide a peer");
-        return -1;
+// Bit of the reserved bytes of the handshake telling the Fast Extension is
+// supported
+#define HANDSHAKE_FAST_BYTE 7
+#define HANDSHAKE_FAST_BIT  0x04
+
+// Length, type, index and begin of a PIECE message
+#define PIECE_HEADER_LEN (sizeof(uint32_t) + 1 + 2 * sizeof(uint32_t))
+
+// Initial size of the receive buffer, grown for messages that don't fit
+#define PEER_RX_BUF_SIZE (64 * 1024)
+
+static int peer_tx_reserve(peer_t* peer, size_t size) {
+    // Drop what was already sent before growing the buffer
+    if (peer->tx_sent > 0) {
+        memmove(peer->tx, peer->tx + peer->tx_sent,
+                peer->tx_len - peer->tx_sent);
+        peer->tx_len      -= peer->tx_sent;
+        peer->tx_block_at -= peer->tx_block_left > 0 ? peer->tx_sent : 0;
+        peer->tx_sent      = 0;
     }
 
-    int sockfd = socket(peer->addr.sin_family, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        LOG_ERROR("Failed to create socket");
-        return -1;
+    if (peer->tx_len + size <= peer->tx_cap) {
+        return 0;
     }
 
-    if (connect(sockfd, (struct sockaddr*)&peer->addr, sizeof(peer->addr))
-        != 0) {
-        LOG_ERROR("Failed to connect to peer");
+    size_t cap = peer->tx_cap > 0 ? peer->tx_cap : 1024;
+    while (cap < peer->tx_len + size) {
+        cap *= 2;
+    }
+
+    uint8_t* tx = realloc(peer->tx, cap);
+    if (tx == NULL) {
+        LOG_ERROR("Failed to allocate send buffer of %zu bytes", cap);
         return -1;
     }
 
-    return sockfd;
+    peer->tx     = tx;
+    peer->tx_cap = cap;
+    return 0;
 }
 
-static int peer_send_handshake(int           sockfd,
-                               const uint8_t info_hash[SHA1_DIGEST_SIZE]) {
-    if (sockfd < 0 || info_hash == NULL) {
-        LOG_WARN("Must provide a valid socket and info hash");
+static int peer_queue_handshake(peer_t*       peer,
+                                const uint8_t info_hash[SHA1_DIGEST_SIZE]) {
+    if (peer == NULL || info_hash == NULL) {
+        LOG_WARN("Must provide a valid peer and info hash");
         return -1;
     }
 
-    uint8_t handshake[HANDSHAKE_LEN];
+    if (peer_tx_reserve(peer, HANDSHAKE_LEN) != 0) {
+        return -1;
+    }
+
+    uint8_t* handshake = peer->tx + peer->tx_len;
 
     handshake[0] = PROTOCOL_LEN;
     memcpy(handshake + 1, PROTOCOL, PROTOCOL_LEN);
     memset(handshake + 1 + PROTOCOL_LEN, 0, 8);
+    handshake[1 + PROTOCOL_LEN + HANDSHAKE_FAST_BYTE] = HANDSHAKE_FAST_BIT;
     memcpy(handshake + 1 + PROTOCOL_LEN + 8, info_hash, SHA1_DIGEST_SIZE);
     memcpy(handshake + 1 + PROTOCOL_LEN + 8 + SHA1_DIGEST_SIZE, get_peer_id(),
            PEER_ID_SIZE);
 
-    if (send(sockfd, handshake, HANDSHAKE_LEN, 0) != HANDSHAKE_LEN) {
-        LOG_ERROR("Failed to send handshake");
-        return -1;
-    }
-
-    LOG_INFO("Sent handshake to peer");
+    peer->tx_len += HANDSHAKE_LEN;
     return 0;
 }
 
-static int peer_recv_handshake(peer_t*       peer,
-                               const uint8_t info_hash[SHA1_DIGEST_SIZE]) {
-    if (peer == NULL || info_hash == NULL) {
-        LOG_WARN("Must provide a valid peer and info hash");
-        return -1;
-    }
-
-    uint8_t handshake[HANDSHAKE_LEN];
-
-    if (recv(peer->sockfd, handshake, HANDSHAKE_LEN, 0) != HANDSHAKE_LEN) {
-        LOG_ERROR("Failed to receive handshake");
+static int peer_parse_handshake(peer_t*       peer,
+                                const uint8_t handshake[HANDSHAKE_LEN],
+                                const uint8_t info_hash[SHA1_DIGEST_SIZE]) {
+    if (peer == NULL || handshake == NULL || info_hash == NULL) {
+        LOG_WARN("Must provide a valid peer, handshake and info hash");
         return -1;
     }
 
@@ -95,15 +110,245 @@ static int peer_recv_handshake(peer_t*       peer,
         return -1;
     }
 
+    // The tracker may give our own address back
+    if (memcmp(handshake + 1 + PROTOCOL_LEN + 8 + SHA1_DIGEST_SIZE,
+               get_peer_id(), PEER_ID_SIZE)
+        == 0) {
+        LOG_DEBUG("Connected to ourselves");
+        return -1;
+    }
+
     // TODO: Find a way to check if the peer id given in creation is different
     //       from the received one
     memcpy(peer->id, handshake + 1 + PROTOCOL_LEN + 8 + SHA1_DIGEST_SIZE,
            PEER_ID_SIZE);
 
-    LOG_INFO("Received handshake from peer: %s", peer->id);
+    // We always set the bit, so it's enough for the peer to set it too
+    peer->fast = (handshake[1 + PROTOCOL_LEN + HANDSHAKE_FAST_BYTE]
+                  & HANDSHAKE_FAST_BIT)
+                 != 0;
+
+    LOG_DEBUG("Received handshake from peer: %.*s", PEER_ID_SIZE, peer->id);
     return 0;
 }
 
+// Read whatever the socket has, first into the block being received in place
+// (if any) and then into the receive buffer, so a single call can bring in
+// the rest of a block along with the messages that follow it
+// Returns 1 if something was read, 0 if it would block, -1 on error
+static int peer_rx_read(peer_t* peer) {
+    struct iovec iov[3];
+    int          iovcnt    = 0;
+    size_t       dest_left = 0;
+
+    if (peer->rx_dest != NULL) {
+        dest_left       = peer->rx_dest_len - peer->rx_dest_recv;
+        iov[0].iov_base = peer->rx_dest + peer->rx_dest_recv;
+        iov[0].iov_len  = dest_left;
+        iovcnt          = 1;
+    }
+
+    iovcnt += ring_buf_free_iov(peer->rx, iov + iovcnt);
+    if (iovcnt == 0) {
+        LOG_ERROR("Receive buffer is full");
+        return -1;
+    }
+
+    ssize_t recv_len;
+    do {
+        recv_len = readv(peer->sockfd, iov, iovcnt);
+    } while (recv_len < 0 && errno == EINTR);
+
+    if (recv_len == 0) {
+        LOG_DEBUG("Peer closed the connection");
+        return -1;
+    }
+
+    if (recv_len < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+
+        LOG_DEBUG("Failed to receive from peer: %s", strerror(errno));
+        return -1;
+    }
+
+    size_t len = recv_len;
+    if (dest_left > 0) {
+        size_t dest_len     = len < dest_left ? len : dest_left;
+        peer->rx_dest_recv += dest_len;
+        len                -= dest_len;
+    }
+
+    ring_buf_produce(peer->rx, len);
+    peer->last_recv = time(NULL);
+    return 1;
+}
+
+static void peer_piece_header(const uint8_t header[PIECE_HEADER_LEN],
+                              uint32_t* index, uint32_t* begin) {
+    memcpy(index, header + sizeof(uint32_t) + 1, sizeof(*index));
+    memcpy(begin, header + sizeof(uint32_t) + 1 + sizeof(*index),
+           sizeof(*begin));
+
+    *index = ntohl(*index);
+    *begin = ntohl(*begin);
+}
+
+// Find where the block of a PIECE message should be received
+static uint8_t* peer_piece_dest(peer_t* peer, uint32_t index, uint32_t begin,
+                                uint32_t length) {
+    for (uint32_t i = 0; i < peer->num_requests; ++i) {
+        peer_request_t* request = &peer->requests[i];
+        if (request->index == index && request->begin == begin
+            && request->length == length) {
+            return request->dest;
+        }
+    }
+
+    return NULL;
+}
+
+// Move the buffered part of the block being received in place to its
+// destination
+// Returns 1 when the block is complete, 0 if more data is needed, -1 on error
+static int peer_rx_block(peer_t* peer, peer_msg_t** msg) {
+    size_t copied = ring_buf_peek(peer->rx, 0,
+                                  peer->rx_dest + peer->rx_dest_recv,
+                                  peer->rx_dest_len - peer->rx_dest_recv);
+    ring_buf_consume(peer->rx, copied);
+    peer->rx_dest_recv += copied;
+
+    if (peer->rx_dest_recv < peer->rx_dest_len) {
+        return 0;
+    }
+
+    *msg = malloc(sizeof(peer_msg_t));
+    if (*msg == NULL) {
+        LOG_ERROR("Failed to allocate message");
+        return -1;
+    }
+
+    (*msg)->type          = PEER_MSG_PIECE;
+    (*msg)->payload.piece = (peer_piece_msg_t){
+        .index  = peer->rx_dest_index,
+        .begin  = peer->rx_dest_begin,
+        .length = peer->rx_dest_len,
+        .block  = NULL,
+    };
+
+    peer->rx_dest = NULL;
+    return 1;
+}
+
+// Parse the next message out of the receive buffer
+// Returns 1 if a message was parsed, 0 if more data is needed, -1 on error
+static int peer_rx_parse(peer_t*       peer,
+                         const uint8_t info_hash[SHA1_DIGEST_SIZE],
+                         peer_msg_t**  msg) {
+    ring_buf_t* rx = peer->rx;
+
+    if (peer->rx_dest != NULL) {
+        return peer_rx_block(peer, msg);
+    }
+
+    if (peer->state == PEER_STATE_HANDSHAKE) {
+        if (ring_buf_len(rx) < HANDSHAKE_LEN) {
+            return 0;
+        }
+
+        uint8_t handshake[HANDSHAKE_LEN];
+        ring_buf_peek(rx, 0, handshake, HANDSHAKE_LEN);
+        if (peer_parse_handshake(peer, handshake, info_hash) != 0) {
+            return -1;
+        }
+
+        ring_buf_consume(rx, HANDSHAKE_LEN);
+        peer->state = PEER_STATE_ACTIVE;
+
+        // The info hash is known to be ours, so the connection is answered
+        if (peer->inbound && peer_queue_handshake(peer, info_hash) != 0) {
+            return -1;
+        }
+    }
+
+    if (peer->state != PEER_STATE_ACTIVE) {
+        LOG_WARN("Trying to read from a peer that is not connected");
+        return -1;
+    }
+
+    for (;;) {
+        uint32_t len;
+        if (ring_buf_peek(rx, 0, &len, sizeof(len)) < sizeof(len)) {
+            return 0;
+        }
+        len = ntohl(len);
+
+        if (len == 0) {
+            // Keep-alive
+            ring_buf_consume(rx, sizeof(len));
+            continue;
+        }
+
+        if (len > PEER_MSG_MAX_LEN) {
+            LOG_ERROR("Invalid message length %u", len);
+            return -1;
+        }
+
+        uint32_t header_len = PIECE_HEADER_LEN - sizeof(uint32_t);
+        if (len > header_len && ring_buf_len(rx) >= PIECE_HEADER_LEN) {
+            uint8_t header[PIECE_HEADER_LEN];
+            ring_buf_peek(rx, 0, header, PIECE_HEADER_LEN);
+
+            if (header[sizeof(uint32_t)] == PEER_MSG_PIECE) {
+                uint32_t index;
+                uint32_t begin;
+                peer_piece_header(header, &index, &begin);
+
+                // The rest of the block skips the receive buffer when it
+                // was requested
+                uint8_t* dest = peer_piece_dest(peer, index, begin,
+                                                len - header_len);
+                if (dest != NULL) {
+                    peer->rx_dest       = dest;
+                    peer->rx_dest_len   = len - header_len;
+                    peer->rx_dest_recv  = 0;
+                    peer->rx_dest_index = index;
+                    peer->rx_dest_begin = begin;
+
+                    ring_buf_consume(rx, PIECE_HEADER_LEN);
+                    return peer_rx_block(peer, msg);
+                }
+            }
+        }
+
+        size_t frame_len = sizeof(len) + len;
+        if (ring_buf_len(rx) < frame_len) {
+            // Make sure the whole message fits before reading more
+            return ring_buf_reserve(rx, frame_len) == 0 ? 0 : -1;
+        }
+
+        size_t         contiguous;
+        const uint8_t* data = ring_buf_data(rx, &contiguous);
+        if (contiguous >= frame_len) {
+            *msg = peer_msg_decode(data + sizeof(len), len);
+        } else {
+            uint8_t* frame = malloc(len);
+            if (frame == NULL) {
+                LOG_ERROR("Failed to allocate %u bytes for message", len);
+                return -1;
+            }
+
+            ring_buf_peek(rx, sizeof(len), frame, len);
+            *msg = peer_msg_decode(frame, len);
+            free(frame);
+        }
+
+        ring_buf_consume(rx, frame_len);
+        return *msg == NULL ? -1 : 1;
+    }
+}
+
 peer_t* peer_create(uint32_t ip, uint16_t port,
                     const uint8_t peer_id[PEER_ID_SIZE]) {
     peer_t* peer = malloc(sizeof(peer_t));
@@ -115,12 +360,16 @@ peer_t* peer_create(uint32_t ip, uint16_t port,
     memset(peer, 0, sizeof(peer_t));
 
     peer->sockfd               = -1;
+    peer->state                = PEER_STATE_DISCONNECTED;
     peer->addr.sin_family      = AF_INET;
     peer->addr.sin_port        = port;
     peer->addr.sin_addr.s_addr = ip;
     peer->choked               = true;
     peer->interested           = false;
+    peer->choking              = true;
+    peer->peer_interested      = false;
     peer->bitfield             = NULL;
+    peer->queue_depth          = PEER_DEFAULT_QUEUE_DEPTH;
 
     // NOTE: if the id received from the handshake is the same one
     //       from the tracker, just remove this from the peer creation
@@ -131,9 +380,48 @@ peer_t* peer_create(uint32_t ip, uint16_t port,
     return peer;
 }
 
-int peer_connect(peer_t* peer, const uint8_t info_hash[SHA1_DIGEST_SIZE]) {
-    if (peer == NULL || info_hash == NULL) {
-        LOG_WARN("Must provide a peer and an info hash");
+int peer_connect(peer_t* peer) {
+    if (peer == NULL) {
+        LOG_WARN("Must provide a peer");
+        return -1;
+    }
+
+    if (peer->sockfd != -1) {
+        LOG_WARN("Peer is already connected");
+        return -1;
+    }
+
+    int sockfd = socket(peer->addr.sin_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sockfd < 0) {
+        LOG_ERROR("Failed to create socket");
+        return -1;
+    }
+
+    // Messages are already coalesced by peer_flush, waiting for more data
+    // would only delay requests
+    int nodelay = 1;
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay))
+        != 0) {
+        LOG_WARN("Failed to disable Nagle's algorithm");
+    }
+
+    if (connect(sockfd, (struct sockaddr*)&peer->addr, sizeof(peer->addr))
+            != 0
+        && errno != EINPROGRESS) {
+        LOG_ERROR("Failed to connect to peer");
+        close(sockfd);
+        return -1;
+    }
+
+    peer->sockfd    = sockfd;
+    peer->state     = PEER_STATE_CONNECTING;
+    peer->last_recv = time(NULL);
+    return 0;
+}
+
+int peer_accept(peer_t* peer, int sockfd, const struct sockaddr_in* addr) {
+    if (peer == NULL || sockfd < 0 || addr == NULL) {
+        LOG_WARN("Must provide a peer, a socket and an address");
         return -1;
     }
 
@@ -142,37 +430,240 @@ int peer_connect(peer_t* peer, const uint8_t info_hash[SHA1_DIGEST_SIZE]) {
         return -1;
     }
 
-    peer->sockfd = peer_connect_socket(peer);
-    if (peer->sockfd < 0) {
+    // A slot may be reused, nothing is carried over from the previous peer
+    memset(peer->id, 0, PEER_ID_SIZE);
+    peer->addr            = *addr;
+    peer->sockfd          = sockfd;
+    peer->state           = PEER_STATE_HANDSHAKE;
+    peer->last_recv       = time(NULL);
+    peer->inbound         = true;
+    peer->fast            = false;
+    peer->queue_depth     = PEER_DEFAULT_QUEUE_DEPTH;
+    peer->bytes_down      = 0;
+    peer->bytes_down_tick = 0;
+    peer->download_rate   = 0;
+    peer->rtt_ms          = 0;
+    peer->bytes_up        = 0;
+    peer->bytes_up_tick   = 0;
+    peer->upload_rate     = 0;
+    return 0;
+}
+
+int peer_finish_connect(peer_t*       peer,
+                        const uint8_t info_hash[SHA1_DIGEST_SIZE]) {
+    if (peer == NULL || info_hash == NULL) {
+        LOG_WARN("Must provide a peer and an info hash");
+        return -1;
+    }
+
+    if (peer->state != PEER_STATE_CONNECTING) {
+        LOG_WARN("Peer is not connecting");
+        return -1;
+    }
+
+    int       err     = 0;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(peer->sockfd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0
+        || err != 0) {
+        LOG_DEBUG("Failed to connect to peer: %s", strerror(err));
+        return -1;
+    }
+
+    if (peer_queue_handshake(peer, info_hash) != 0
+        || peer_flush(peer) < 0) {
+        LOG_ERROR("Failed to send handshake");
+        return -1;
+    }
+
+    LOG_DEBUG("Sent handshake to peer");
+
+    peer->state = PEER_STATE_HANDSHAKE;
+    return 0;
+}
+
+int peer_read(peer_t* peer, const uint8_t info_hash[SHA1_DIGEST_SIZE],
+              peer_msg_t** msg) {
+    if (peer == NULL || info_hash == NULL || msg == NULL) {
+        LOG_WARN("Must provide a peer, an info hash and a message pointer");
+        return -1;
+    }
+
+    *msg = NULL;
+
+    if (peer->rx == NULL) {
+        peer->rx = ring_buf_create(PEER_RX_BUF_SIZE);
+        if (peer->rx == NULL) {
+            return -1;
+        }
+    }
+
+    // Messages already buffered are handed out before reading again, so a
+    // single large read can serve many calls
+    for (;;) {
+        int ret = peer_rx_parse(peer, info_hash, msg);
+        if (ret != 0) {
+            return ret;
+        }
+
+        ret = peer_rx_read(peer);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+}
+
+int peer_discard_block(peer_t* peer) {
+    if (peer == NULL) {
+        LOG_WARN("Must provide a peer");
         return -1;
     }
 
-    if (peer_send_handshake(peer->sockfd, info_hash) != 0) {
+    if (peer->rx_dest == NULL || peer->rx_dest == peer->rx_scratch) {
+        return 0;
+    }
+
+    // Only requested blocks are received in place, so they fit in a block
+    if (peer->rx_scratch == NULL) {
+        peer->rx_scratch = malloc(BLOCK_SIZE);
+        if (peer->rx_scratch == NULL) {
+            LOG_ERROR("Failed to allocate scratch block");
+            return -1;
+        }
+    }
+
+    peer->rx_dest = peer->rx_scratch;
+    return 0;
+}
+
+int peer_queue_msg(peer_t* peer, const peer_msg_t* msg) {
+    if (peer == NULL || msg == NULL) {
+        LOG_WARN("Must provide a peer and a message");
         return -1;
     }
 
-    if (peer_recv_handshake(peer, info_hash) != 0) {
+    size_t len = peer_msg_encoded_len(msg);
+    if (peer_tx_reserve(peer, len) != 0) {
         return -1;
     }
 
-    peer_msg_t* bitfield_msg = peer_recv_msg(peer->sockfd);
-    if (bitfield_msg == NULL) {
+    peer->tx_len += peer_msg_encode(msg, peer->tx + peer->tx_len);
+    return 0;
+}
+
+// Queue the length, type, index and begin of a PIECE message, the room for
+// it must be reserved
+static void peer_queue_block_header(peer_t*                   peer,
+                                    const peer_request_msg_t* request) {
+    uint32_t fields[3] = {
+        htonl(PIECE_HEADER_LEN - sizeof(uint32_t) + request->length),
+        htonl(request->index),
+        htonl(request->begin),
+    };
+
+    uint8_t* header = peer->tx + peer->tx_len;
+    memcpy(header, &fields[0], sizeof(uint32_t));
+    header[sizeof(uint32_t)] = PEER_MSG_PIECE;
+    memcpy(header + sizeof(uint32_t) + 1, &fields[1], 2 * sizeof(uint32_t));
+
+    peer->tx_len += PIECE_HEADER_LEN;
+}
+
+int peer_queue_block(peer_t* peer, const peer_request_msg_t* request,
+                     const uint8_t* data) {
+    if (peer == NULL || request == NULL || data == NULL) {
+        LOG_WARN("Must provide a peer, a request and data");
+        return -1;
+    }
+
+    if (peer_tx_reserve(peer, PIECE_HEADER_LEN + request->length) != 0) {
+        return -1;
+    }
+
+    peer_queue_block_header(peer, request);
+    memcpy(peer->tx + peer->tx_len, data, request->length);
+    peer->tx_len += request->length;
+    return 0;
+}
+
+int peer_queue_block_send(peer_t* peer, const peer_request_msg_t* request,
+                          uint64_t offset, peer_send_fn_t send, void* ctx) {
+    if (peer == NULL || request == NULL || send == NULL) {
+        LOG_WARN("Must provide a peer, a request and a send function");
         return -1;
     }
 
-    if (bitfield_msg->type != PEER_MSG_BITFIELD) {
-        LOG_ERROR("Expected bitfield message");
-        peer_msg_free(bitfield_msg);
+    if (peer->tx_block_left > 0) {
+        LOG_WARN("A block is already being sent");
         return -1;
     }
 
-    peer->bitfield                 = bitfield_msg->payload.bitfield;
-    bitfield_msg->payload.bitfield = NULL;
+    if (peer_tx_reserve(peer, PIECE_HEADER_LEN) != 0) {
+        return -1;
+    }
 
-    peer_msg_free(bitfield_msg);
+    peer_queue_block_header(peer, request);
+    peer->tx_send         = send;
+    peer->tx_send_ctx     = ctx;
+    peer->tx_block_offset = offset;
+    peer->tx_block_left   = request->length;
+    peer->tx_block_at     = peer->tx_len;
     return 0;
 }
 
+int peer_flush(peer_t* peer) {
+    if (peer == NULL) {
+        LOG_WARN("Must provide a peer");
+        return -1;
+    }
+
+    for (;;) {
+        // The header of a block sent separately is held back until the block
+        // follows, so it doesn't go out in a segment of its own
+        bool   block = peer->tx_block_left > 0;
+        size_t end   = block ? peer->tx_block_at : peer->tx_len;
+
+        ssize_t sent;
+        if (peer->tx_sent < end) {
+            sent = send(peer->sockfd, peer->tx + peer->tx_sent,
+                        end - peer->tx_sent,
+                        MSG_NOSIGNAL | (block ? MSG_MORE : 0));
+        } else if (block) {
+            sent = peer->tx_send(peer->tx_send_ctx, peer->sockfd,
+                                 peer->tx_block_offset, peer->tx_block_left);
+            if (sent == 0) {
+                LOG_ERROR("Block to send is past the end of the file");
+                return -1;
+            }
+        } else {
+            break;
+        }
+
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+
+            LOG_DEBUG("Failed to send to peer: %s", strerror(errno));
+            return -1;
+        }
+
+        if (peer->tx_sent < end) {
+            peer->tx_sent += sent;
+        } else {
+            peer->tx_block_offset += sent;
+            peer->tx_block_left   -= sent;
+        }
+    }
+
+    peer->tx_len  = 0;
+    peer->tx_sent = 0;
+    return 1;
+}
+
 bool peer_has_piece(peer_t* peer, uint32_t index) {
     if (peer == NULL) {
         LOG_WARN("Must provide a peer");
@@ -196,155 +687,111 @@ bool peer_has_piece(peer_t* peer, uint32_t index) {
     return (byte_result.byte & (1 << (CHAR_BIT - bit - 1))) != 0;
 }
 
-// TODO: This function should be responsible for downloading a single block from
-// a single peer
-//       Complexity should be moved to torrent.c
-int download_piece(peer_t* peer, torrent_t* torrent, uint32_t index) {
-    if (torrent == NULL || peer == NULL) {
-        LOG_WARN("Must provide a torrent and a peer");
+int peer_set_piece(peer_t* peer, uint32_t index) {
+    if (peer == NULL || peer->bitfield == NULL) {
+        LOG_WARN("Must provide a peer with a bitfield");
         return -1;
     }
 
-    if (peer->sockfd == -1) {
-        LOG_WARN("Peer is not connected");
-        return -1;
-    }
+    uint32_t byte = index / CHAR_BIT;
+    uint8_t  bit  = index % CHAR_BIT;
 
-    if (list_size(torrent->files) != 1) {
-        LOG_ERROR("Only single file torrents are supported");
+    if (byte >= peer->bitfield->len) {
+        LOG_ERROR("Piece %u is outside the bitfield", index);
         return -1;
     }
 
-    peer_msg_t interested_msg = {.type = PEER_MSG_INTERESTED};
+    peer->bitfield->data[byte] |= 1 << (CHAR_BIT - bit - 1);
+    return 0;
+}
 
-    if (peer_send_msg(peer->sockfd, &interested_msg) != 0) {
+int peer_allowed_fast_set(peer_t*       peer,
+                          const uint8_t info_hash[SHA1_DIGEST_SIZE],
+                          uint32_t      num_pieces) {
+    if (peer == NULL || info_hash == NULL) {
+        LOG_WARN("Must provide a peer and an info hash");
         return -1;
     }
 
-    peer->interested = true;
-
-    while (peer->choked) {
-        peer_msg_t* unchoke_msg = peer_recv_msg(peer->sockfd);
-        if (unchoke_msg == NULL) {
-            return -1;
-        }
-
-        switch (unchoke_msg->type) {
-        case PEER_MSG_UNCHOKE:
-            peer->choked = false;
-            break;
-        case PEER_MSG_CHOKE:
-            assert(0
-                   && "Peer sent CHOKE msg while choked, TODO: sleep and try "
-                      "later");
-            break;
-        case PEER_MSG_HAVE:
-            // TODO: update needed pieces
-            //      for now assume peer has all pieces
-            break;
-        case PEER_MSG_BITFIELD:
-            assert(0 && "Should not receive bitfield message after handshake");
-            break;
-        default:
-            // No need to handle other messages while choked
-            break;
-        }
-        peer_msg_free(unchoke_msg);
+    peer->num_allowed_up = 0;
+    if (num_pieces == 0) {
+        return 0;
     }
 
-    uint64_t piece_length = torrent->piece_length;
+    uint32_t k = num_pieces < PEER_ALLOWED_FAST_SET ? num_pieces
+                                                    : PEER_ALLOWED_FAST_SET;
 
-    // If this is the last piece, the length may be less than the piece length
-    if (index == torrent->num_pieces - 1) {
-        piece_length = torrent->total_down % torrent->piece_length;
-    }
+    // The first digest is of the /24 network followed by the info hash, the
+    // next ones of the previous digest
+    uint8_t  data[sizeof(uint32_t) + SHA1_DIGEST_SIZE];
+    uint32_t ip = peer->addr.sin_addr.s_addr & htonl(0xFFFFFF00);
+    memcpy(data, &ip, sizeof(ip));
+    memcpy(data + sizeof(ip), info_hash, SHA1_DIGEST_SIZE);
 
-    uint8_t piece[piece_length];
-    for (size_t i = 0; i < piece_length; i += BLOCK_SIZE) {
-        uint32_t block_size = BLOCK_SIZE;
-        if (i + BLOCK_SIZE > piece_length) {
-            block_size = piece_length - i;
-        }
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    sha1(data, sizeof(data), digest);
 
-        peer_msg_t request_msg = {
-            .type = PEER_MSG_REQUEST,
-            .payload.request =
-                (peer_request_msg_t){
-                    .index = index,
-                    .begin = i,
-                    .length = block_size,
-                },
-        };
-
-        if (peer_send_msg(peer->sockfd, &request_msg) != 0) {
-            return -1;
-        }
+    while (true) {
+        for (size_t i = 0; i < SHA1_DIGEST_SIZE; i += sizeof(uint32_t)) {
+            uint32_t y;
+            memcpy(&y, digest + i, sizeof(y));
+            uint32_t index = ntohl(y) % num_pieces;
 
-        peer_msg_t* piece_msg = peer_recv_msg(peer->sockfd);
-        if (piece_msg == NULL) {
-            return -1;
-        }
+            bool dup = false;
+            for (uint32_t j = 0; j < peer->num_allowed_up; j++) {
+                dup = dup || peer->allowed_up[j] == index;
+            }
 
-        switch (piece_msg->type) {
-        case PEER_MSG_CHOKE:
-            peer->choked = true;
-            LOG_WARN("Peer choked while downloading piece");
-            peer_msg_free(piece_msg);
-            return -1;
-        case PEER_MSG_UNCHOKE:
-            assert(0 && "Should not receive unchoke message while unchoked");
-        case PEER_MSG_HAVE:
-            // TODO: update needed pieces
-            //     for now assume peer has all pieces
-            LOG_WARN("Received HAVE message while waiting for PIECE");
-            break;
-        case PEER_MSG_BITFIELD:
-            assert(0 && "Should not receive bitfield message after handshake");
-        case PEER_MSG_PIECE:
-            if (piece_msg->payload.piece.index != index
-                || piece_msg->payload.piece.begin != i) {
-                LOG_ERROR("Invalid piece message");
-                peer_msg_free(piece_msg);
-                return -1;
+            if (!dup) {
+                peer->allowed_up[peer->num_allowed_up++] = index;
             }
 
-            memcpy(piece + i, piece_msg->payload.piece.block->data, block_size);
-        default:
-            // No need to handle other messages
-            break;
+            if (peer->num_allowed_up == k) {
+                return 0;
+            }
         }
-        peer_msg_free(piece_msg);
-    }
-
-    uint8_t recv_hash[SHA1_DIGEST_SIZE];
-    sha1(piece, piece_length, recv_hash);
-
-    if (memcmp(recv_hash, torrent->pieces[index], SHA1_DIGEST_SIZE) != 0) {
-        char exp[SHA1_DIGEST_SIZE * 2 + 1] = {0};
-        char got[SHA1_DIGEST_SIZE * 2 + 1] = {0};
-
-        int exp_walk = 0;
-        int got_walk = 0;
-        for (int i = 0; i < SHA1_DIGEST_SIZE; ++i) {
-            exp_walk
-                += sprintf(exp + exp_walk, "%02x", torrent->pieces[index][i]);
-            got_walk += sprintf(got + got_walk, "%02x", recv_hash[i]);
-        };
 
-        LOG_ERROR("Invalid piece hash, expected %s, got %s", exp, got);
-        return -1;
+        memcpy(data, digest, SHA1_DIGEST_SIZE);
+        sha1(data, SHA1_DIGEST_SIZE, digest);
     }
+}
 
-    // TODO: Find a way to add the piece to correct files in multi file torrents
+void peer_disconnect(peer_t* peer) {
+    if (peer == NULL) {
+        LOG_WARN("Must provide a peer");
+        return;
+    }
 
-    file_t* file = *(file_t**)list_at(torrent->files, 0);
-    if (write_data_to_file(file, index * torrent->piece_length, piece,
-                           piece_length)
-        != 0) {
-        return -1;
+    if (peer->sockfd != -1) {
+        close(peer->sockfd);
     }
 
-    return 0;
+    free(peer->bitfield);
+    ring_buf_free(peer->rx);
+    free(peer->tx);
+    free(peer->rx_scratch);
+
+    peer->sockfd           = -1;
+    peer->state            = PEER_STATE_DISCONNECTED;
+    peer->bitfield         = NULL;
+    peer->choked           = true;
+    peer->interested       = false;
+    peer->choking          = true;
+    peer->peer_interested  = false;
+    peer->rx               = NULL;
+    peer->tx               = NULL;
+    peer->tx_len           = 0;
+    peer->tx_sent          = 0;
+    peer->tx_cap           = 0;
+    peer->tx_block_left    = 0;
+    peer->rx_dest          = NULL;
+    peer->rx_scratch       = NULL;
+    peer->num_requests     = 0;
+    peer->num_uploads      = 0;
+    peer->fast             = false;
+    peer->num_allowed_fast = 0;
+    peer->num_suggested    = 0;
+    peer->num_allowed_up   = 0;
 }
 
 void peer_free(peer_t* peer) {
@@ -353,7 +800,6 @@ void peer_free(peer_t* peer) {
         return;
     }
 
-    close(peer->sockfd);
-    free(peer->bitfield);
+    peer_disconnect(peer);
     free(peer);
 }
@@ -7,8 +7,6 @@
 #include <netinet/in.h>
 #include <stdint.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <sys/types.h>
 
 static const char* peer_msg_type_str(peer_msg_type_t type) {
     switch (type) {
@@ -30,12 +28,22 @@ static const char* peer_msg_type_str(peer_msg_type_t type) {
         return "PIECE";
     case PEER_MSG_CANCEL:
         return "CANCEL";
+    case PEER_MSG_SUGGEST:
+        return "SUGGEST";
+    case PEER_MSG_HAVE_ALL:
+        return "HAVE ALL";
+    case PEER_MSG_HAVE_NONE:
+        return "HAVE NONE";
+    case PEER_MSG_REJECT:
+        return "REJECT";
+    case PEER_MSG_ALLOWED_FAST:
+        return "ALLOWED FAST";
     default:
         assert(0 && "Invalid peer message type");
     }
 }
 
-static uint32_t peer_msg_size(peer_msg_t* msg) {
+static uint32_t peer_msg_size(const peer_msg_t* msg) {
     if (msg == NULL) {
         LOG_WARN("Must provide a message");
         return 0;
@@ -46,201 +54,130 @@ static uint32_t peer_msg_size(peer_msg_t* msg) {
     case PEER_MSG_UNCHOKE:
     case PEER_MSG_INTERESTED:
     case PEER_MSG_NOT_INTERESTED:
+    case PEER_MSG_HAVE_ALL:
+    case PEER_MSG_HAVE_NONE:
         return sizeof(peer_msg_type_t);
     case PEER_MSG_HAVE:
+    case PEER_MSG_SUGGEST:
+    case PEER_MSG_ALLOWED_FAST:
         return sizeof(peer_msg_type_t) + sizeof(uint32_t);
     case PEER_MSG_BITFIELD:
         return sizeof(peer_msg_type_t) + msg->payload.bitfield->len;
     case PEER_MSG_REQUEST:
+    case PEER_MSG_CANCEL:
+    case PEER_MSG_REJECT:
         return sizeof(peer_msg_type_t) + sizeof(peer_request_msg_t);
     case PEER_MSG_PIECE:
         return sizeof(peer_msg_type_t) + 2 * sizeof(uint32_t)
                + msg->payload.piece.block->len;
     default:
-        LOG_ERROR("Invalid message type");
-        return -1;
+        assert(0 && "Invalid message type");
     }
 }
 
-static int send_have_msg(int sockfd, peer_msg_t* msg) {
-    if (msg == NULL) {
-        LOG_WARN("Must provide a message");
-        return -1;
-    }
-
-    if (msg->type != PEER_MSG_HAVE) {
-        LOG_ERROR("Trying to send %s message as a HAVE message",
-                  peer_msg_type_str(msg->type));
-        return -1;
-    }
-
-    uint32_t idx = htonl(msg->payload.index);
-    if (send(sockfd, &idx, sizeof(idx), 0) != sizeof(idx)) {
-        LOG_ERROR("Failed to send HAVE message");
-        return -1;
-    }
-
-    return 0;
+static uint8_t* encode_u32(uint8_t* buf, uint32_t value) {
+    value = htonl(value);
+    memcpy(buf, &value, sizeof(value));
+    return buf + sizeof(value);
 }
 
-static int send_bitfield_msg(int sockfd, peer_msg_t* msg) {
-    if (msg == NULL) {
+static int decode_piece_msg(peer_msg_t* msg, const uint8_t* data,
+                            uint32_t len) {
+    if (msg == NULL || data == NULL) {
         LOG_WARN("Must provide a message");
         return -1;
     }
 
-    if (msg->type != PEER_MSG_BITFIELD) {
-        LOG_ERROR("Trying to send %s message as a BITFIELD message",
-                  peer_msg_type_str(msg->type));
-        return -1;
-    }
-
-    ssize_t sent = send(sockfd, msg->payload.bitfield->data,
-                        msg->payload.bitfield->len, 0);
-    if (sent < 0 || (size_t)sent != msg->payload.bitfield->len) {
-        LOG_ERROR("Failed to send BITFIELD message");
-        return -1;
-    }
-
-    return 0;
-}
-
-// CANCEL messages also use this function
-static int send_request_msg(int sockfd, peer_msg_t* msg) {
-    if (msg == NULL) {
-        LOG_WARN("Must provide a message");
-        return -1;
-    }
-
-    if (msg->type != PEER_MSG_REQUEST && msg->type != PEER_MSG_CANCEL) {
-        LOG_ERROR("Trying to send %s message as a REQUEST/CANCEL "
-                  "message",
-                  peer_msg_type_str(msg->type));
-        return -1;
-    }
-
-    uint32_t idx    = htonl(msg->payload.request.index);
-    uint32_t begin  = htonl(msg->payload.request.begin);
-    uint32_t length = htonl(msg->payload.request.length);
-
-    if (send(sockfd, &idx, sizeof(idx), 0) != sizeof(idx)) {
-        LOG_ERROR("Failed to send %s message", peer_msg_type_str(msg->type));
-        return -1;
-    }
-
-    if (send(sockfd, &begin, sizeof(begin), 0) != sizeof(begin)) {
-        LOG_ERROR("Failed to send %s message", peer_msg_type_str(msg->type));
-        return -1;
-    }
-
-    if (send(sockfd, &length, sizeof(length), 0) != sizeof(length)) {
-        LOG_ERROR("Failed to send %s message", peer_msg_type_str(msg->type));
-        return -1;
-    }
-
-    return 0;
-}
-
-static int recv_piece_msg(int sockfd, peer_msg_t* msg, size_t len) {
-    if (msg == NULL) {
-        LOG_WARN("Must provide a message");
+    if (len < 2 * sizeof(uint32_t)) {
+        LOG_ERROR("Invalid PIECE message length %u", len);
         return -1;
     }
 
     uint32_t idx;
-    if (recv(sockfd, &idx, sizeof(uint32_t), 0) != sizeof(uint32_t)) {
-        LOG_ERROR("Failed to receive piece message");
-        return -1;
-    }
+    memcpy(&idx, data, sizeof(uint32_t));
     msg->payload.piece.index = ntohl(idx);
 
     uint32_t begin;
-    if (recv(sockfd, &begin, sizeof(uint32_t), 0) != sizeof(uint32_t)) {
-        LOG_ERROR("Failed to receive piece message");
-        return -1;
-    }
+    memcpy(&begin, data + sizeof(uint32_t), sizeof(uint32_t));
     msg->payload.piece.begin = ntohl(begin);
 
-    uint32_t block_len = len - 2 * sizeof(uint32_t);
+    uint32_t block_len        = len - 2 * sizeof(uint32_t);
+    msg->payload.piece.length = block_len;
 
-    uint8_t buf[block_len];
-    for (uint32_t total_recv = 0; total_recv < block_len;) {
-        ssize_t recv_len
-            = recv(sockfd, buf + total_recv, block_len - total_recv, 0);
-        if (recv_len <= 0) {
-            LOG_ERROR("Failed to receive piece message");
-            return -1;
-        }
-        total_recv += recv_len;
+    msg->payload.piece.block
+        = byte_str_create(data + 2 * sizeof(uint32_t), block_len);
+    if (msg->payload.piece.block == NULL) {
+        return -1;
     }
 
-    msg->payload.piece.block = byte_str_create(buf, len);
     return 0;
 }
 
-int peer_send_msg(int sockfd, peer_msg_t* msg) {
-    if (sockfd < 0 || msg == NULL) {
-        LOG_WARN("Must provide a valid socket and message");
-        return -1;
+size_t peer_msg_encoded_len(const peer_msg_t* msg) {
+    if (msg == NULL) {
+        LOG_WARN("Must provide a message");
+        return 0;
     }
 
-    uint32_t len = htonl(peer_msg_size(msg));
+    return sizeof(uint32_t) + peer_msg_size(msg);
+}
 
-    if (send(sockfd, &len, sizeof(len), 0) != sizeof(len)) {
-        LOG_ERROR("Failed to send message length");
-        return -1;
+size_t peer_msg_encode(const peer_msg_t* msg, uint8_t* buf) {
+    if (msg == NULL || buf == NULL) {
+        LOG_WARN("Must provide a message and a buffer");
+        return 0;
     }
 
-    if (send(sockfd, &msg->type, sizeof(msg->type), 0) != sizeof(msg->type)) {
-        LOG_ERROR("Failed to send message type");
-        return -1;
-    }
+    uint8_t* ptr = encode_u32(buf, peer_msg_size(msg));
+    *ptr++       = msg->type;
 
     switch (msg->type) {
     case PEER_MSG_CHOKE:
     case PEER_MSG_UNCHOKE:
     case PEER_MSG_INTERESTED:
     case PEER_MSG_NOT_INTERESTED:
-        assert(ntohl(len) == sizeof(peer_msg_type_t)
-               && "Invalid message length");
-        return 0;
+    case PEER_MSG_HAVE_ALL:
+    case PEER_MSG_HAVE_NONE:
+        break;
     case PEER_MSG_HAVE:
-        return send_have_msg(sockfd, msg);
+    case PEER_MSG_SUGGEST:
+    case PEER_MSG_ALLOWED_FAST:
+        ptr = encode_u32(ptr, msg->payload.index);
+        break;
     case PEER_MSG_BITFIELD:
         assert(msg->payload.bitfield != NULL && "Invalid message payload");
-        return send_bitfield_msg(sockfd, msg);
+        memcpy(ptr, msg->payload.bitfield->data, msg->payload.bitfield->len);
+        ptr += msg->payload.bitfield->len;
+        break;
     case PEER_MSG_REQUEST:
-        return send_request_msg(sockfd, msg);
-    case PEER_MSG_PIECE:
-        // NOTE: For now, we don't send PIECE messages
-        assert(0 && "PIECE message not implemented");
     case PEER_MSG_CANCEL:
-        assert(0 && "CANCEL message not implemented");
+    case PEER_MSG_REJECT:
+        ptr = encode_u32(ptr, msg->payload.request.index);
+        ptr = encode_u32(ptr, msg->payload.request.begin);
+        ptr = encode_u32(ptr, msg->payload.request.length);
+        break;
+    case PEER_MSG_PIECE:
+        assert(msg->payload.piece.block != NULL && "Invalid message payload");
+        ptr = encode_u32(ptr, msg->payload.piece.index);
+        ptr = encode_u32(ptr, msg->payload.piece.begin);
+        memcpy(ptr, msg->payload.piece.block->data,
+               msg->payload.piece.block->len);
+        ptr += msg->payload.piece.block->len;
+        break;
     default:
         assert(0 && "Invalid message type");
     }
-}
-
-peer_msg_t* peer_recv_msg(int sockfd) {
-    if (sockfd < 0) {
-        LOG_WARN("Must provide a valid socket");
-        return NULL;
-    }
 
-    uint32_t len;
-    if (recv(sockfd, &len, sizeof(len), 0) != sizeof(len)) {
-        LOG_ERROR("Failed to receive message length");
-        return NULL;
-    }
-    len = ntohl(len);
+    return ptr - buf;
+}
 
-    peer_msg_type_t type;
-    if (recv(sockfd, &type, sizeof(type), 0) != sizeof(type)) {
-        LOG_ERROR("Failed to receive message type");
+peer_msg_t* peer_msg_decode(const uint8_t* data, uint32_t len) {
+    if (data == NULL || len < sizeof(peer_msg_type_t)) {
+        LOG_WARN("Must provide a message with at least a type");
         return NULL;
     }
 
-    // TODO: validate len
+    peer_msg_type_t type = (peer_msg_type_t)data[0];
 
     peer_msg_t* msg = malloc(sizeof(peer_msg_t));
     if (msg == NULL) {
@@ -250,12 +187,15 @@ peer_msg_t* peer_recv_msg(int sockfd) {
 
     msg->type = type;
 
-    uint32_t left = len - sizeof(type);
+    const uint8_t* payload = data + sizeof(type);
+    uint32_t       left    = len - sizeof(type);
     switch (type) {
     case PEER_MSG_CHOKE:
     case PEER_MSG_UNCHOKE:
     case PEER_MSG_INTERESTED:
     case PEER_MSG_NOT_INTERESTED:
+    case PEER_MSG_HAVE_ALL:
+    case PEER_MSG_HAVE_NONE:
         if (left != 0) {
             LOG_ERROR("Invalid message length");
             peer_msg_free(msg);
@@ -263,44 +203,56 @@ peer_msg_t* peer_recv_msg(int sockfd) {
         }
         return msg;
     case PEER_MSG_HAVE:
-        // NOTE: For now, we don't receive HAVE messages
-        LOG_WARN("HAVE message not implemented");
-        peer_msg_free(msg);
-        return NULL;
-    case PEER_MSG_BITFIELD: {
-        uint8_t buf[left];
-        if (recv(sockfd, buf, left, 0) != left) {
-            LOG_ERROR("Failed to receive message");
+    case PEER_MSG_SUGGEST:
+    case PEER_MSG_ALLOWED_FAST: {
+        if (left != sizeof(uint32_t)) {
+            LOG_ERROR("Invalid %s message length %u", peer_msg_type_str(type),
+                      left);
             peer_msg_free(msg);
             return NULL;
         }
 
-        msg->payload.bitfield = byte_str_create(buf, left);
+        uint32_t index;
+        memcpy(&index, payload, sizeof(index));
+        msg->payload.index = ntohl(index);
+        return msg;
+    }
+    case PEER_MSG_BITFIELD:
+        msg->payload.bitfield = byte_str_create(payload, left);
         if (msg->payload.bitfield == NULL) {
             peer_msg_free(msg);
             return NULL;
         }
         return msg;
-    }
     case PEER_MSG_REQUEST:
-        // NOTE: For now, we don't receive REQUEST messages
-        LOG_WARN("REQUEST message not implemented");
-        peer_msg_free(msg);
-        return NULL;
-    case PEER_MSG_PIECE:
-        if (recv_piece_msg(sockfd, msg, left) != 0) {
+    case PEER_MSG_CANCEL:
+    case PEER_MSG_REJECT: {
+        if (left != sizeof(peer_request_msg_t)) {
+            LOG_ERROR("Invalid %s message length %u", peer_msg_type_str(type),
+                      left);
             peer_msg_free(msg);
             return NULL;
         }
+
+        uint32_t fields[3];
+        memcpy(fields, payload, sizeof(fields));
+        msg->payload.request = (peer_request_msg_t){
+            .index  = ntohl(fields[0]),
+            .begin  = ntohl(fields[1]),
+            .length = ntohl(fields[2]),
+        };
+        return msg;
+    }
+    case PEER_MSG_PIECE:
+        if (decode_piece_msg(msg, payload, left) != 0) {
+            // No block was allocated
+            free(msg);
+            return NULL;
+        }
         return msg;
-    case PEER_MSG_CANCEL:
-        // NOTE: For now, we don't receive CANCEL messages
-        LOG_WARN("CANCEL message not implemented");
-        peer_msg_free(msg);
-        return NULL;
     default:
-        LOG_ERROR("Invalid message type");
-        peer_msg_free(msg);
+        LOG_ERROR("Invalid message type %hhu", (uint8_t)type);
+        free(msg);
         return NULL;
     }
 }
@@ -319,6 +271,11 @@ void peer_msg_free(peer_msg_t* msg) {
     case PEER_MSG_HAVE:
     case PEER_MSG_REQUEST:
     case PEER_MSG_CANCEL:
+    case PEER_MSG_SUGGEST:
+    case PEER_MSG_HAVE_ALL:
+    case PEER_MSG_HAVE_NONE:
+    case PEER_MSG_REJECT:
+    case PEER_MSG_ALLOWED_FAST:
         // Nothing to free
         break;
     case PEER_MSG_BITFIELD:
@@ -0,0 +1,318 @@
+#include "picker.h"
+
+#include "log.h"
+
+#include <limits.h>
+#include <stdbool.h>
+
+// Position of a piece that is not wanted
+#define PICKER_NONE UINT32_MAX
+
+/*
+ * Wanted pieces are stored in `order`, sorted by availability and split in
+ * buckets of pieces with the same availability:
+ *
+ * | availability 0 | availability 1 | ... | availability max_level |
+ * ^bucket[0]       ^bucket[1]             ^bucket[max_level]      ^num_wanted
+ *
+ * A piece whose availability changes by one only has to swap places with the
+ * first or last piece of its bucket and move the boundary between the two
+ * buckets.
+ */
+struct picker {
+    size_t    num_pieces;
+    uint32_t* availability; // number of peers that have each piece
+    uint32_t* order;        // wanted pieces, rarest first
+    uint32_t* pos;          // position of each piece in `order`
+    size_t    num_wanted;
+
+    uint32_t* bucket; // first position of each availability in `order`
+    uint32_t  max_level;
+    uint32_t  bucket_cap;
+};
+
+static bool bitfield_has(const byte_str_t* bitfield, uint32_t index) {
+    uint32_t byte = index / CHAR_BIT;
+    uint8_t  bit  = index % CHAR_BIT;
+
+    return byte < bitfield->len
+           && (bitfield->data[byte] & (1 << (CHAR_BIT - bit - 1))) != 0;
+}
+
+static void picker_swap(picker_t* picker, uint32_t i, uint32_t j) {
+    uint32_t piece_i = picker->order[i];
+    uint32_t piece_j = picker->order[j];
+
+    picker->order[i]     = piece_j;
+    picker->order[j]     = piece_i;
+    picker->pos[piece_i] = j;
+    picker->pos[piece_j] = i;
+}
+
+// Make sure there is a bucket for `level`, new buckets are empty
+static int picker_grow(picker_t* picker, uint32_t level) {
+    if (level >= picker->bucket_cap) {
+        uint32_t cap = picker->bucket_cap * 2;
+        while (cap <= level) {
+            cap *= 2;
+        }
+
+        uint32_t* bucket = realloc(picker->bucket, cap * sizeof(uint32_t));
+        if (bucket == NULL) {
+            LOG_ERROR("Failed to allocate memory for picker buckets");
+            return -1;
+        }
+
+        picker->bucket     = bucket;
+        picker->bucket_cap = cap;
+    }
+
+    while (picker->max_level < level) {
+        picker->bucket[++picker->max_level] = picker->num_wanted;
+    }
+
+    return 0;
+}
+
+static void picker_inc(picker_t* picker, uint32_t index) {
+    uint32_t level = picker->availability[index];
+
+    // Without a bucket the piece would end up misplaced, keep it where it is
+    // with its old availability rather than corrupting the order
+    if (picker->pos[index] != PICKER_NONE
+        && picker_grow(picker, level + 1) != 0) {
+        return;
+    }
+
+    picker->availability[index]++;
+    if (picker->pos[index] == PICKER_NONE) {
+        return;
+    }
+
+    // Last of its bucket, then first of the next one
+    uint32_t last = picker->bucket[level + 1] - 1;
+    picker_swap(picker, picker->pos[index], last);
+    picker->bucket[level + 1]--;
+}
+
+static void picker_dec(picker_t* picker, uint32_t index) {
+    uint32_t level = picker->availability[index];
+    if (level == 0) {
+        LOG_WARN("Piece %u has no availability to remove", index);
+        return;
+    }
+
+    picker->availability[index]--;
+    if (picker->pos[index] == PICKER_NONE) {
+        return;
+    }
+
+    // First of its bucket, then last of the previous one
+    uint32_t first = picker->bucket[level];
+    picker_swap(picker, picker->pos[index], first);
+    picker->bucket[level]++;
+}
+
+// Take a wanted piece out of `order`
+static void picker_remove(picker_t* picker, uint32_t index) {
+    uint32_t level = picker->availability[index];
+
+    // Walk the piece up to the end of the array, one bucket at a time
+    for (uint32_t i = level + 1; i <= picker->max_level; ++i) {
+        picker_swap(picker, picker->pos[index], picker->bucket[i] - 1);
+        picker->bucket[i]--;
+    }
+
+    picker_swap(picker, picker->pos[index], picker->num_wanted - 1);
+    picker->num_wanted--;
+    picker->pos[index] = PICKER_NONE;
+}
+
+picker_t* picker_create(size_t num_pieces) {
+    picker_t* picker = malloc(sizeof(picker_t));
+    if (picker == NULL) {
+        LOG_ERROR("Failed to allocate memory for picker");
+        return NULL;
+    }
+
+    picker->num_pieces   = num_pieces;
+    picker->availability = calloc(num_pieces, sizeof(uint32_t));
+    picker->order        = malloc(num_pieces * sizeof(uint32_t));
+    picker->pos          = malloc(num_pieces * sizeof(uint32_t));
+    picker->bucket_cap   = 16;
+    picker->bucket       = malloc(picker->bucket_cap * sizeof(uint32_t));
+
+    if (picker->availability == NULL || picker->order == NULL
+        || picker->pos == NULL || picker->bucket == NULL) {
+        LOG_ERROR("Failed to allocate memory for %zu pieces", num_pieces);
+        picker_free(picker);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < num_pieces; ++i) {
+        picker->order[i] = i;
+        picker->pos[i]   = i;
+    }
+
+    picker->num_wanted = num_pieces;
+    picker->bucket[0]  = 0;
+    picker->max_level  = 0;
+
+    return picker;
+}
+
+void picker_free(picker_t* picker) {
+    if (picker == NULL) {
+        LOG_WARN("Trying to free NULL picker");
+        return;
+    }
+
+    free(picker->availability);
+    free(picker->order);
+    free(picker->pos);
+    free(picker->bucket);
+    free(picker);
+}
+
+void picker_add_bitfield(picker_t* picker, const byte_str_t* bitfield) {
+    if (picker == NULL || bitfield == NULL) {
+        LOG_WARN("Must provide a picker and a bitfield");
+        return;
+    }
+
+    for (size_t byte = 0; byte < bitfield->len; ++byte) {
+        // Most bitfields are either full or sparse
+        if (bitfield->data[byte] == 0) {
+            continue;
+        }
+
+        for (uint32_t i = byte * CHAR_BIT;
+             i < (byte + 1) * CHAR_BIT && i < picker->num_pieces; ++i) {
+            if (bitfield_has(bitfield, i)) {
+                picker_inc(picker, i);
+            }
+        }
+    }
+}
+
+void picker_remove_bitfield(picker_t* picker, const byte_str_t* bitfield) {
+    if (picker == NULL || bitfield == NULL) {
+        LOG_WARN("Must provide a picker and a bitfield");
+        return;
+    }
+
+    for (size_t byte = 0; byte < bitfield->len; ++byte) {
+        if (bitfield->data[byte] == 0) {
+            continue;
+        }
+
+        for (uint32_t i = byte * CHAR_BIT;
+             i < (byte + 1) * CHAR_BIT && i < picker->num_pieces; ++i) {
+            if (bitfield_has(bitfield, i)) {
+                picker_dec(picker, i);
+            }
+        }
+    }
+}
+
+void picker_add_have(picker_t* picker, uint32_t index) {
+    if (picker == NULL || index >= picker->num_pieces) {
+        LOG_WARN("Must provide a picker and a valid piece index");
+        return;
+    }
+
+    picker_inc(picker, index);
+}
+
+int picker_pick(picker_t* picker, const byte_str_t* bitfield,
+                uint32_t* index) {
+    if (picker == NULL || bitfield == NULL || index == NULL) {
+        LOG_WARN("Must provide a picker, a bitfield and an index pointer");
+        return -1;
+    }
+
+    // Pieces nobody has are skipped, the peer would have counted for them
+    uint32_t start
+        = picker->max_level > 0 ? picker->bucket[1] : picker->num_wanted;
+
+    for (size_t i = start; i < picker->num_wanted; ++i) {
+        uint32_t piece = picker->order[i];
+        if (bitfield_has(bitfield, piece)) {
+            picker_remove(picker, piece);
+            *index = piece;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int picker_take(picker_t* picker, uint32_t index) {
+    if (picker == NULL || index >= picker->num_pieces) {
+        LOG_WARN("Must provide a picker and a valid piece index");
+        return -1;
+    }
+
+    if (picker->pos[index] == PICKER_NONE) {
+        return -1;
+    }
+
+    picker_remove(picker, index);
+    return 0;
+}
+
+void picker_release(picker_t* picker, uint32_t index) {
+    if (picker == NULL || index >= picker->num_pieces) {
+        LOG_WARN("Must provide a picker and a valid piece index");
+        return;
+    }
+
+    if (picker->pos[index] != PICKER_NONE) {
+        LOG_WARN("Piece %u is already wanted", index);
+        return;
+    }
+
+    uint32_t level = picker->availability[index];
+    if (picker_grow(picker, level) != 0) {
+        return;
+    }
+
+    // Append the piece to the last bucket and walk it down to its own one
+    picker->order[picker->num_wanted] = index;
+    picker->pos[index]                = picker->num_wanted;
+    picker->num_wanted++;
+
+    for (uint32_t i = picker->max_level; i > level; --i) {
+        picker_swap(picker, picker->pos[index], picker->bucket[i]);
+        picker->bucket[i]++;
+    }
+}
+
+void picker_set_have(picker_t* picker, uint32_t index) {
+    if (picker == NULL || index >= picker->num_pieces) {
+        LOG_WARN("Must provide a picker and a valid piece index");
+        return;
+    }
+
+    if (picker->pos[index] != PICKER_NONE) {
+        picker_remove(picker, index);
+    }
+}
+
+size_t picker_num_wanted(const picker_t* picker) {
+    if (picker == NULL) {
+        LOG_WARN("Must provide a picker");
+        return 0;
+    }
+
+    return picker->num_wanted;
+}
+
+uint32_t picker_availability(const picker_t* picker, uint32_t index) {
+    if (picker == NULL || index >= picker->num_pieces) {
+        LOG_WARN("Must provide a picker and a valid piece index");
+        return 0;
+    }
+
+    return picker->availability[index];
+}
@@ -0,0 +1,192 @@
+#include "piece.h"
+
+#include "log.h"
+
+#include <limits.h>
+#include <string.h>
+
+#define BITMAP_LEN(bits) (((bits) + CHAR_BIT - 1) / CHAR_BIT)
+
+static bool bitmap_get(const uint8_t* bitmap, uint32_t bit) {
+    return (bitmap[bit / CHAR_BIT] & (1 << (bit % CHAR_BIT))) != 0;
+}
+
+static void bitmap_set(uint8_t* bitmap, uint32_t bit) {
+    bitmap[bit / CHAR_BIT] |= 1 << (bit % CHAR_BIT);
+}
+
+static void bitmap_clear(uint8_t* bitmap, uint32_t bit) {
+    bitmap[bit / CHAR_BIT] &= ~(1 << (bit % CHAR_BIT));
+}
+
+piece_t* piece_create(uint32_t index, uint32_t length, uint8_t* data) {
+    if (length == 0) {
+        LOG_WARN("Must provide a piece length");
+        return NULL;
+    }
+
+    piece_t* piece = malloc(sizeof(piece_t));
+    if (piece == NULL) {
+        LOG_ERROR("Failed to allocate memory for piece");
+        return NULL;
+    }
+
+    piece->index         = index;
+    piece->length        = length;
+    piece->num_blocks    = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    piece->num_requested = 0;
+    piece->num_received  = 0;
+    piece->num_hashed    = 0;
+
+    size_t bitmap_len = BITMAP_LEN(piece->num_blocks);
+
+    piece->mapped    = data != NULL;
+    piece->data      = data != NULL ? data : malloc(length);
+    piece->requested = calloc(bitmap_len, 1);
+    piece->received  = calloc(bitmap_len, 1);
+    piece->written   = calloc(bitmap_len, 1);
+    piece->pending   = calloc(piece->num_blocks, sizeof(uint8_t));
+    piece->owners    = calloc(piece->num_blocks, sizeof(peer_t*));
+    piece->hash      = sha1_create();
+
+    if (piece->data == NULL || piece->requested == NULL
+        || piece->received == NULL || piece->written == NULL
+        || piece->pending == NULL || piece->owners == NULL
+        || piece->hash == NULL) {
+        LOG_ERROR("Failed to allocate memory for piece %u", index);
+        piece_free(piece);
+        return NULL;
+    }
+
+    return piece;
+}
+
+void piece_free(piece_t* piece) {
+    if (piece == NULL) {
+        LOG_WARN("Trying to free NULL piece");
+        return;
+    }
+
+    if (!piece->mapped) {
+        free(piece->data);
+    }
+    free(piece->requested);
+    free(piece->received);
+    free(piece->written);
+    free(piece->pending);
+    free(piece->owners);
+    sha1_free(piece->hash);
+    free(piece);
+}
+
+uint32_t piece_block_length(const piece_t* piece, uint32_t block) {
+    if (block == piece->num_blocks - 1) {
+        return piece->length - block * BLOCK_SIZE;
+    }
+
+    return BLOCK_SIZE;
+}
+
+int piece_next_block(const piece_t* piece, uint32_t* block) {
+    if (piece->num_requested == piece->num_blocks) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < piece->num_blocks; ++i) {
+        if (!bitmap_get(piece->requested, i)) {
+            *block = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+bool piece_has_block(const piece_t* piece, uint32_t block) {
+    return bitmap_get(piece->received, block);
+}
+
+void piece_request_block(piece_t* piece, uint32_t block) {
+    if (bitmap_get(piece->received, block)) {
+        LOG_WARN("Block %u of piece %u was already received", block,
+                 piece->index);
+        return;
+    }
+
+    if (piece->pending[block] == UINT8_MAX) {
+        LOG_WARN("Too many requests for block %u of piece %u", block,
+                 piece->index);
+        return;
+    }
+
+    if (!bitmap_get(piece->requested, block)) {
+        bitmap_set(piece->requested, block);
+        piece->num_requested++;
+    }
+
+    piece->pending[block]++;
+}
+
+void piece_unrequest_block(piece_t* piece, uint32_t block) {
+    if (bitmap_get(piece->received, block) || piece->pending[block] == 0) {
+        return;
+    }
+
+    if (--piece->pending[block] > 0) {
+        return;
+    }
+
+    bitmap_clear(piece->requested, block);
+    piece->num_requested--;
+}
+
+bool piece_receive_block(piece_t* piece, uint32_t block, peer_t* owner) {
+    if (bitmap_get(piece->received, block)) {
+        return false;
+    }
+
+    if (!bitmap_get(piece->requested, block)) {
+        bitmap_set(piece->requested, block);
+        piece->num_requested++;
+    }
+
+    bitmap_set(piece->received, block);
+    piece->num_received++;
+    piece->pending[block] = 0;
+    piece->owners[block]  = owner;
+
+    // Blocks received after a gap are hashed by the hasher threads
+    if (block == piece->num_hashed) {
+        sha1_update(piece->hash, piece->data + block * BLOCK_SIZE,
+                    piece_block_length(piece, block));
+        piece->num_hashed++;
+    }
+
+    return true;
+}
+
+void piece_mark_written(piece_t* piece) {
+    memset(piece->written, 0xff, BITMAP_LEN(piece->num_blocks));
+}
+
+void piece_mark_block_written(piece_t* piece, uint32_t block) {
+    bitmap_set(piece->written, block);
+}
+
+bool piece_block_written(const piece_t* piece, uint32_t block) {
+    return bitmap_get(piece->written, block);
+}
+
+int piece_digest(piece_t* piece, uint8_t digest[SHA1_DIGEST_SIZE]) {
+    if (piece->num_hashed != piece->num_blocks) {
+        LOG_WARN("Piece %u is not hashed", piece->index);
+        return -1;
+    }
+
+    sha1_final(piece->hash, digest);
+    return 0;
+}
+
+bool piece_is_complete(const piece_t* piece) {
+    return piece->num_received == piece->num_blocks;
+}
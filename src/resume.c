@@ -0,0 +1,434 @@
+#include "resume.h"
+
+#include "bencode.h"
+#include "file.h"
+#include "log.h"
+#include "peer.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bumped whenever the layout of the file changes
+#define RESUME_VERSION 1
+
+static bencode_node_t* resume_get(const bencode_node_t* dict, const char* key,
+                                  bencode_type_t type) {
+    bencode_node_t* node = (bencode_node_t*)dict_get(dict->value.d, key);
+    if (node == NULL || node->type != type) {
+        return NULL;
+    }
+
+    return node;
+}
+
+/*
+ * Skip one bencoded value, NULL if it is malformed or runs past `end`.
+ * bencode_parse trusts its input, so the file is walked once before it is
+ * handed over.
+ */
+static const char* resume_skip(const char* data, const char* end,
+                               int depth) {
+    if (data >= end || depth > 8) {
+        return NULL;
+    }
+
+    if (*data == 'l' || *data == 'd') {
+        bool   dict = *data == 'd';
+        size_t num  = 0;
+        for (data++; data < end && *data != 'e'; ++num) {
+            // Keys of a dictionary are strings, each followed by a value
+            if (dict && num % 2 == 0 && !isdigit((unsigned char)*data)) {
+                return NULL;
+            }
+
+            data = resume_skip(data, end, depth + 1);
+            if (data == NULL) {
+                return NULL;
+            }
+        }
+
+        return data < end && (!dict || num % 2 == 0) ? data + 1 : NULL;
+    }
+
+    if (*data == 'i') {
+        data++;
+        if (data < end && *data == '-') {
+            data++;
+        }
+
+        const char* digits = data;
+        while (data < end && isdigit((unsigned char)*data)) {
+            data++;
+        }
+
+        return data > digits && data < end && *data == 'e' ? data + 1 : NULL;
+    }
+
+    size_t len = 0;
+    while (data < end && isdigit((unsigned char)*data)) {
+        if (len > (size_t)(end - data)) {
+            return NULL;
+        }
+        len = len * 10 + (*data++ - '0');
+    }
+
+    if (data >= end || *data != ':' || len > (size_t)(end - data - 1)) {
+        return NULL;
+    }
+
+    return data + 1 + len;
+}
+
+static bencode_node_t* resume_parse(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        LOG_DEBUG("No resume file `%s`", path);
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char* data = malloc(size > 0 ? size + 1 : 1);
+    if (data == NULL) {
+        LOG_ERROR("Failed to allocate memory for resume file `%s`", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    if (size <= 0 || fread(data, 1, size, fp) != (size_t)size) {
+        LOG_WARN("Failed to read resume file `%s`", path);
+        free(data);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+
+    data[size] = '\0';
+    if (data[0] != 'd' || resume_skip(data, data + size, 0) != data + size) {
+        LOG_WARN("Invalid resume file `%s`", path);
+        free(data);
+        return NULL;
+    }
+
+    const char*     endptr = data;
+    bencode_node_t* node   = bencode_parse(data, &endptr);
+    free(data);
+
+    return node;
+}
+
+// Check that the files are exactly as they were when the progress was saved
+static bool resume_files_match(const torrent_t*      torrent,
+                               const bencode_node_t* files) {
+    if (list_size(files->value.l) != list_size(torrent->files)) {
+        LOG_INFO("Resume data has a different number of files");
+        return false;
+    }
+
+    const list_iterator_t* saved = list_iterator_first(files->value.l);
+    for (const list_iterator_t* it = list_iterator_first(torrent->files);
+         it != NULL; it            = list_iterator_next(it),
+                                saved = list_iterator_next(saved)) {
+        const file_t*         file = *(file_t**)list_iterator_get(it);
+        const bencode_node_t* node = list_iterator_get(saved);
+        if (node->type != BENCODE_DICT) {
+            return false;
+        }
+
+        const bencode_node_t* size  = resume_get(node, "size", BENCODE_INT);
+        const bencode_node_t* mtime = resume_get(node, "mtime", BENCODE_INT);
+        const bencode_node_t* nsec
+            = resume_get(node, "mtime_nsec", BENCODE_INT);
+        if (size == NULL || mtime == NULL || nsec == NULL) {
+            return false;
+        }
+
+        struct stat st;
+        if (stat(get_file_path(file), &st) != 0) {
+            LOG_INFO("File `%s` is missing", get_file_path(file));
+            return false;
+        }
+
+        if (size->value.i != st.st_size
+            || mtime->value.i != st.st_mtim.tv_sec
+            || nsec->value.i != st.st_mtim.tv_nsec) {
+            LOG_INFO("File `%s` changed since the resume data was saved",
+                     get_file_path(file));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static size_t resume_count_bits(const byte_str_t* bitfield, size_t num_bits) {
+    size_t count = 0;
+    for (size_t i = 0; i < num_bits; ++i) {
+        if (bitfield->data[i / CHAR_BIT] & 1 << (CHAR_BIT - i % CHAR_BIT - 1)) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+// The bits past `num_bits` must be clear, as in a BITFIELD message
+static bool resume_valid_bitfield(const byte_str_t* bitfield,
+                                  size_t            num_bits) {
+    if (bitfield->len != (num_bits + CHAR_BIT - 1) / CHAR_BIT) {
+        return false;
+    }
+
+    size_t spare = bitfield->len * CHAR_BIT - num_bits;
+    return spare == 0
+        || (bitfield->data[bitfield->len - 1] & ((1 << spare) - 1)) == 0;
+}
+
+static byte_str_t* resume_copy_bitfield(const byte_str_t* src) {
+    byte_str_t* dst = malloc(sizeof(byte_str_t) + src->len + 1);
+    if (dst == NULL) {
+        LOG_ERROR("Failed to allocate memory for bitfield");
+        return NULL;
+    }
+
+    dst->len = src->len;
+    memcpy(dst->data, src->data, src->len);
+    dst->data[src->len] = '\0';
+    return dst;
+}
+
+static int resume_get_pieces(resume_t* resume, const torrent_t* torrent,
+                             const bencode_node_t* unfinished) {
+    size_t num = list_size(unfinished->value.l);
+    if (num == 0) {
+        return 0;
+    }
+
+    resume->pieces = calloc(num, sizeof(resume_piece_t));
+    if (resume->pieces == NULL) {
+        LOG_ERROR("Failed to allocate memory for %zu pieces", num);
+        return -1;
+    }
+
+    for (const list_iterator_t* it = list_iterator_first(unfinished->value.l);
+         it != NULL; it            = list_iterator_next(it)) {
+        const bencode_node_t* node = list_iterator_get(it);
+        if (node->type != BENCODE_DICT) {
+            return -1;
+        }
+
+        const bencode_node_t* index  = resume_get(node, "piece", BENCODE_INT);
+        const bencode_node_t* blocks = resume_get(node, "blocks", BENCODE_STR);
+        if (index == NULL || blocks == NULL || index->value.i < 0
+            || (uint64_t)index->value.i >= torrent->num_pieces) {
+            return -1;
+        }
+
+        uint64_t length     = torrent_piece_length(torrent, index->value.i);
+        size_t   num_blocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (!resume_valid_bitfield(blocks->value.s, num_blocks)
+            || resume_count_bits(blocks->value.s, num_blocks) == 0) {
+            return -1;
+        }
+
+        resume_piece_t* piece = &resume->pieces[resume->num_pieces];
+
+        piece->index  = (uint32_t)index->value.i;
+        piece->blocks = resume_copy_bitfield(blocks->value.s);
+        if (piece->blocks == NULL) {
+            return -1;
+        }
+        resume->num_pieces++;
+    }
+
+    return 0;
+}
+
+resume_t* resume_load(const char* path, torrent_t* torrent) {
+    if (path == NULL || torrent == NULL) {
+        LOG_WARN("Must provide a path and a torrent");
+        return NULL;
+    }
+
+    bencode_node_t* node = resume_parse(path);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    const bencode_node_t* version = resume_get(node, "version", BENCODE_INT);
+    const bencode_node_t* hash = resume_get(node, "info-hash", BENCODE_STR);
+    const bencode_node_t* files = resume_get(node, "files", BENCODE_LIST);
+    const bencode_node_t* have = resume_get(node, "pieces", BENCODE_STR);
+    const bencode_node_t* unfinished
+        = resume_get(node, "unfinished", BENCODE_LIST);
+
+    if (version == NULL || version->value.i != RESUME_VERSION || hash == NULL
+        || files == NULL || have == NULL || unfinished == NULL) {
+        LOG_WARN("Invalid resume file `%s`", path);
+        bencode_free(node);
+        return NULL;
+    }
+
+    if (hash->value.s->len != SHA1_DIGEST_SIZE
+        || memcmp(hash->value.s->data, torrent->info_hash, SHA1_DIGEST_SIZE)
+               != 0) {
+        LOG_WARN("Resume file `%s` belongs to another torrent", path);
+        bencode_free(node);
+        return NULL;
+    }
+
+    if (!resume_valid_bitfield(have->value.s, torrent->num_pieces)) {
+        LOG_WARN("Invalid bitfield in resume file `%s`", path);
+        bencode_free(node);
+        return NULL;
+    }
+
+    if (!resume_files_match(torrent, files)) {
+        bencode_free(node);
+        return NULL;
+    }
+
+    resume_t* resume = calloc(1, sizeof(resume_t));
+    if (resume == NULL) {
+        LOG_ERROR("Failed to allocate memory for resume data");
+        bencode_free(node);
+        return NULL;
+    }
+
+    resume->have = resume_copy_bitfield(have->value.s);
+    if (resume->have == NULL
+        || resume_get_pieces(resume, torrent, unfinished) != 0) {
+        LOG_WARN("Invalid resume file `%s`", path);
+        resume_free(resume);
+        bencode_free(node);
+        return NULL;
+    }
+    bencode_free(node);
+
+    size_t complete      = resume_count_bits(resume->have, torrent->num_pieces);
+    torrent->pieces_left = torrent->num_pieces - complete;
+
+    LOG_INFO("Resuming with %zu/%zu pieces and %zu partial pieces", complete,
+             torrent->num_pieces, resume->num_pieces);
+    return resume;
+}
+
+static void resume_write_str(FILE* fp, const uint8_t* data, size_t len) {
+    fprintf(fp, "%zu:", len);
+    fwrite(data, 1, len, fp);
+}
+
+// Flush a file of the torrent and write its size and modification time
+static int resume_write_file(FILE* fp, const file_t* file) {
+    int fd = open(get_file_path(file), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERROR("Failed to open file `%s`: %s", get_file_path(file),
+                  strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fsync(fd) != 0 || fstat(fd, &st) != 0) {
+        LOG_ERROR("Failed to sync file `%s`: %s", get_file_path(file),
+                  strerror(errno));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    // Keys of a dictionary are sorted
+    fprintf(fp, "d5:mtimei%" PRId64 "e10:mtime_nseci%" PRId64 "e4:sizei%" PRId64
+                "ee",
+            (int64_t)st.st_mtim.tv_sec, (int64_t)st.st_mtim.tv_nsec,
+            (int64_t)st.st_size);
+    return 0;
+}
+
+int resume_save(const char* path, const torrent_t* torrent,
+                const byte_str_t* have, const resume_piece_t* pieces,
+                size_t num_pieces) {
+    if (path == NULL || torrent == NULL || have == NULL) {
+        LOG_WARN("Must provide a path, a torrent and a bitfield");
+        return -1;
+    }
+
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path)
+        >= (int)sizeof(tmp_path)) {
+        LOG_ERROR("Resume file path `%s` is too long", path);
+        return -1;
+    }
+
+    FILE* fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        LOG_ERROR("Failed to open file `%s` in write mode", tmp_path);
+        return -1;
+    }
+
+    fprintf(fp, "d5:filesl");
+    for (const list_iterator_t* it = list_iterator_first(torrent->files);
+         it != NULL; it            = list_iterator_next(it)) {
+        if (resume_write_file(fp, *(file_t**)list_iterator_get(it)) != 0) {
+            fclose(fp);
+            unlink(tmp_path);
+            return -1;
+        }
+    }
+
+    fprintf(fp, "e9:info-hash");
+    resume_write_str(fp, torrent->info_hash, SHA1_DIGEST_SIZE);
+    fprintf(fp, "6:pieces");
+    resume_write_str(fp, have->data, have->len);
+
+    fprintf(fp, "10:unfinishedl");
+    for (size_t i = 0; i < num_pieces; ++i) {
+        fprintf(fp, "d6:blocks");
+        resume_write_str(fp, pieces[i].blocks->data, pieces[i].blocks->len);
+        fprintf(fp, "5:piecei%" PRIu32 "ee", pieces[i].index);
+    }
+    fprintf(fp, "e7:versioni%dee", RESUME_VERSION);
+
+    if (fflush(fp) != 0 || ferror(fp) || fsync(fileno(fp)) != 0) {
+        LOG_ERROR("Failed to write resume file `%s`", tmp_path);
+        fclose(fp);
+        unlink(tmp_path);
+        return -1;
+    }
+    fclose(fp);
+
+    if (rename(tmp_path, path) != 0) {
+        LOG_ERROR("Failed to rename `%s` to `%s`: %s", tmp_path, path,
+                  strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+
+    LOG_DEBUG("Saved resume file `%s` with %zu partial pieces", path,
+              num_pieces);
+    return 0;
+}
+
+void resume_free(resume_t* resume) {
+    if (resume == NULL) {
+        LOG_WARN("Trying to free NULL resume data");
+        return;
+    }
+
+    for (size_t i = 0; i < resume->num_pieces; ++i) {
+        free(resume->pieces[i].blocks);
+    }
+
+    free(resume->pieces);
+    free(resume->have);
+    free(resume);
+}
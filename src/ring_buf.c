@@ -0,0 +1,153 @@
+#include "ring_buf.h"
+
+#include "log.h"
+
+#include <assert.h>
+#include <string.h>
+
+struct ring_buf {
+    uint8_t* data;
+    size_t   capacity; // always a power of two
+    size_t   head;     // index of the oldest byte
+    size_t   len;
+};
+
+static size_t round_up_pow2(size_t n) {
+    size_t pow2 = 1;
+    while (pow2 < n) {
+        pow2 <<= 1;
+    }
+    return pow2;
+}
+
+ring_buf_t* ring_buf_create(size_t capacity) {
+    ring_buf_t* ring = malloc(sizeof(ring_buf_t));
+    if (ring == NULL) {
+        LOG_ERROR("Failed to allocate memory for ring buffer");
+        return NULL;
+    }
+
+    ring->capacity = round_up_pow2(capacity);
+    ring->head     = 0;
+    ring->len      = 0;
+
+    ring->data = malloc(ring->capacity);
+    if (ring->data == NULL) {
+        LOG_ERROR("Failed to allocate %zu bytes for ring buffer",
+                  ring->capacity);
+        free(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+void ring_buf_free(ring_buf_t* ring) {
+    if (ring == NULL) {
+        return;
+    }
+
+    free(ring->data);
+    free(ring);
+}
+
+int ring_buf_reserve(ring_buf_t* ring, size_t capacity) {
+    if (ring == NULL) {
+        LOG_WARN("Must provide a ring buffer");
+        return -1;
+    }
+
+    if (capacity <= ring->capacity) {
+        return 0;
+    }
+
+    capacity = round_up_pow2(capacity);
+
+    uint8_t* data = malloc(capacity);
+    if (data == NULL) {
+        LOG_ERROR("Failed to allocate %zu bytes for ring buffer", capacity);
+        return -1;
+    }
+
+    // Unwrap the data to the start of the new buffer
+    ring_buf_peek(ring, 0, data, ring->len);
+
+    free(ring->data);
+    ring->data     = data;
+    ring->capacity = capacity;
+    ring->head     = 0;
+    return 0;
+}
+
+size_t ring_buf_len(const ring_buf_t* ring) {
+    return ring->len;
+}
+
+size_t ring_buf_capacity(const ring_buf_t* ring) {
+    return ring->capacity;
+}
+
+int ring_buf_free_iov(ring_buf_t* ring, struct iovec iov[2]) {
+    size_t space = ring->capacity - ring->len;
+    if (space == 0) {
+        return 0;
+    }
+
+    size_t tail  = (ring->head + ring->len) & (ring->capacity - 1);
+    size_t first = ring->capacity - tail;
+
+    iov[0].iov_base = ring->data + tail;
+    if (first >= space) {
+        iov[0].iov_len = space;
+        return 1;
+    }
+
+    iov[0].iov_len  = first;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len  = space - first;
+    return 2;
+}
+
+void ring_buf_produce(ring_buf_t* ring, size_t len) {
+    assert(ring->len + len <= ring->capacity && "Ring buffer overflow");
+    ring->len += len;
+}
+
+const uint8_t* ring_buf_data(const ring_buf_t* ring, size_t* len) {
+    size_t first = ring->capacity - ring->head;
+    *len         = ring->len < first ? ring->len : first;
+    return ring->data + ring->head;
+}
+
+size_t ring_buf_peek(const ring_buf_t* ring, size_t offset, void* dst,
+                     size_t len) {
+    if (offset >= ring->len) {
+        return 0;
+    }
+
+    if (len > ring->len - offset) {
+        len = ring->len - offset;
+    }
+
+    size_t start = (ring->head + offset) & (ring->capacity - 1);
+    size_t first = ring->capacity - start;
+    if (first > len) {
+        first = len;
+    }
+
+    memcpy(dst, ring->data + start, first);
+    memcpy((uint8_t*)dst + first, ring->data, len - first);
+    return len;
+}
+
+void ring_buf_consume(ring_buf_t* ring, size_t len) {
+    assert(len <= ring->len && "Consuming more than the ring buffer holds");
+
+    ring->head = (ring->head + len) & (ring->capacity - 1);
+    ring->len -= len;
+
+    // Start over from the beginning so reads are less likely to wrap
+    if (ring->len == 0) {
+        ring->head = 0;
+    }
+}
@@ -0,0 +1,2558 @@
+#include "session.h"
+
+#include "cache.h"
+#include "disk.h"
+#include "file.h"
+#include "hasher.h"
+#include "list.h"
+#include "listener.h"
+#include "log.h"
+#include "peer.h"
+#include "peer_msg.h"
+#include "picker.h"
+#include "piece.h"
+#include "resume.h"
+#include "sha1.h"
+#include "storage.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SESSION_MAX_EVENTS 64
+#define SESSION_TICK_MS    1000
+
+// Seconds without receiving anything before a peer is dropped
+#define PEER_CONNECT_TIMEOUT 10
+#define PEER_IDLE_TIMEOUT    120
+
+// Seconds between two peer statistics reports
+#define SESSION_STATS_INTERVAL 10
+
+// Seconds between two saves of the fast-resume file
+#define SESSION_RESUME_INTERVAL 30
+
+// Peers unchoked at once: the fastest ones, and one picked in turn whatever
+// its rate (optimistic unchoke) so new peers get a chance to show theirs
+#define SESSION_UPLOAD_SLOTS 4
+
+// Seconds between two rankings of the peers, and between two optimistic
+// unchokes
+#define SESSION_RECHOKE_INTERVAL    10
+#define SESSION_OPTIMISTIC_INTERVAL 30
+
+// Pieces left out of the bitfield sent while seeding, and announced with HAVE
+// messages right after it (lazy bitfield)
+#define SESSION_LAZY_PIECES 8
+
+// Default memory budget for the pieces being downloaded, verified or waiting
+// in the write cache
+#define SESSION_MAX_MEMORY ((size_t)64 << 20)
+
+// An interested peer and the rate it is ranked by when rechoking
+typedef struct {
+    peer_t*  peer;
+    uint64_t rate;
+} session_rank_t;
+
+// A block copied out of a partial piece, to be written before the progress
+// is saved
+typedef struct {
+    uint64_t offset; // in the torrent data
+    uint32_t length;
+    uint8_t* data;
+} session_block_t;
+
+// A snapshot of the progress, saved by a disk thread, see session_save_async
+typedef struct {
+    session_t*       session;
+    byte_str_t*      have;
+    resume_piece_t*  pieces;
+    size_t           num_pieces;
+    session_block_t* blocks;
+    size_t           num_blocks;
+    uint8_t*         data; // the copies of the blocks
+} session_save_t;
+
+struct session {
+    int        epfd;
+    torrent_t* torrent;
+    storage_t* storage;
+    list_t*    peers;
+
+    // Next peer in `peers` that was never connected to
+    const list_iterator_t* next_peer;
+    size_t                 num_connections;
+
+    // Accepts the peers that connect to us, NULL if not listening
+    listener_t* listener;
+
+    // Pieces that are neither downloaded nor being downloaded
+    picker_t* picker;
+
+    // Pieces being downloaded, by index (NULL if none) and in the order they
+    // were started, so the oldest ones are finished first
+    piece_t** pieces;
+    piece_t** active;
+    size_t    num_active;
+    size_t    active_cap;
+
+    time_t    last_tick;
+    uint64_t  last_rate_ms;
+    time_t    last_stats;
+
+    // Every block left is requested, so they are requested from several
+    // peers at once
+    bool endgame;
+
+    // Complete pieces are verified off the network thread
+    hasher_t* hasher;
+    size_t    hash_threads; // 0 for one per CPU
+    size_t    num_verifying;
+
+    // Verified pieces waiting to be written to disk, by the disk threads so
+    // the network loop never waits on the disk
+    disk_t*  disk;
+    cache_t* cache;
+
+    // Bytes held by the pieces being downloaded or verified, new pieces are
+    // not started while they and the cache are over `max_memory`
+    size_t max_memory;
+    size_t mem_bytes;
+    bool   throttled; // a peer was left idle because of the budget
+
+    // Set when the download can't go on, e.g. a piece can't be written
+    bool failed;
+
+    // Keep running once every piece is downloaded, to upload them
+    bool seed;
+
+    // Peers we serve requests from, see session_rechoke
+    size_t          num_unchoked;
+    peer_t*         optimistic; // NULL if none
+    time_t          last_rechoke;
+    time_t          last_optimistic;
+    session_rank_t* ranked;
+    size_t          ranked_cap;
+
+    // Set from a signal handler to leave the loop
+    volatile sig_atomic_t stop;
+
+    // Pieces verified and written to disk (or to the cache), as sent in a
+    // BITFIELD message
+    byte_str_t* have;
+
+    // Progress is saved here periodically, NULL if it is not
+    char*           resume_path;
+    time_t          last_resume;
+    session_save_t* saving; // save in flight on the disk threads, NULL if none
+
+    // Fixed number of outstanding requests per peer, 0 to auto-tune
+    uint32_t queue_depth;
+
+    // Peers with queued messages, flushed once per loop iteration
+    peer_t** flush_queue;
+    size_t   flush_len;
+    size_t   flush_cap;
+};
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool session_has_piece(const session_t* session, uint32_t index) {
+    return (session->have->data[index / CHAR_BIT]
+            & 1 << (CHAR_BIT - index % CHAR_BIT - 1))
+           != 0;
+}
+
+static int session_add_piece(session_t* session, piece_t* piece) {
+    if (session->num_active == session->active_cap) {
+        size_t cap = session->active_cap > 0 ? session->active_cap * 2 : 16;
+
+        piece_t** active = realloc(session->active, cap * sizeof(piece_t*));
+        if (active == NULL) {
+            LOG_ERROR("Failed to allocate memory for active pieces");
+            return -1;
+        }
+
+        session->active     = active;
+        session->active_cap = cap;
+    }
+
+    session->active[session->num_active++] = piece;
+    session->pieces[piece->index]          = piece;
+    return 0;
+}
+
+// Free a piece, giving its data back to the storage if it was mapped
+static void session_free_piece(session_t* session, piece_t* piece) {
+    if (piece->mapped) {
+        storage_unpin(session->storage,
+                      piece->index * session->torrent->piece_length);
+    } else {
+        session->mem_bytes -= piece->length;
+    }
+
+    piece_free(piece);
+}
+
+// Create a piece, with its blocks received straight into the file mapping
+// when the storage allows it
+static piece_t* session_create_piece(session_t* session, uint32_t index) {
+    torrent_t* torrent = session->torrent;
+    uint64_t   length  = torrent_piece_length(torrent, index);
+    uint8_t*   data
+        = storage_pin(session->storage, index * torrent->piece_length, length);
+
+    piece_t* piece = piece_create(index, length, data);
+    if (piece == NULL) {
+        if (data != NULL) {
+            storage_unpin(session->storage, index * torrent->piece_length);
+        }
+        return NULL;
+    }
+
+    if (!piece->mapped) {
+        session->mem_bytes += piece->length;
+    }
+
+    return piece;
+}
+
+// Stop tracking a piece without freeing it
+static void session_detach_piece(session_t* session, piece_t* piece) {
+    for (size_t i = 0; i < session->num_active; ++i) {
+        if (session->active[i] == piece) {
+            memmove(&session->active[i], &session->active[i + 1],
+                    (session->num_active - i - 1) * sizeof(piece_t*));
+            session->num_active--;
+            break;
+        }
+    }
+
+    session->pieces[piece->index] = NULL;
+}
+
+static void session_remove_piece(session_t* session, piece_t* piece) {
+    session_detach_piece(session, piece);
+    session_free_piece(session, piece);
+}
+
+// Give a block requested from a peer back so other peers can request it
+static void session_release_request(session_t*            session,
+                                    const peer_request_t* request) {
+    piece_t* piece = session->pieces[request->index];
+    if (piece == NULL) {
+        return;
+    }
+
+    piece_unrequest_block(piece, request->begin / BLOCK_SIZE);
+
+    // Nothing was received, the piece can be picked from scratch
+    if (piece->num_requested == 0) {
+        picker_release(session->picker, piece->index);
+        session_remove_piece(session, piece);
+    }
+}
+
+static void session_release_requests(session_t* session, peer_t* peer) {
+    for (uint32_t i = 0; i < peer->num_requests; ++i) {
+        session_release_request(session, &peer->requests[i]);
+    }
+
+    peer->num_requests = 0;
+}
+
+static bool session_in_set(const uint32_t* set, uint32_t len, uint32_t index) {
+    for (uint32_t i = 0; i < len; ++i) {
+        if (set[i] == index) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void session_drop_peer(session_t* session, peer_t* peer) {
+    LOG_DEBUG("Dropping peer %s:%d", inet_ntoa(peer->addr.sin_addr),
+              ntohs(peer->addr.sin_port));
+
+    // The blocks go back to the pool so other peers can download them
+    session_release_requests(session, peer);
+
+    // Blocks it already sent are no longer blamed on it, its slot may be
+    // given to another peer
+    for (size_t i = 0; i < session->num_active; ++i) {
+        piece_t* piece = session->active[i];
+        for (uint32_t j = 0; j < piece->num_blocks; ++j) {
+            if (piece->owners[j] == peer) {
+                piece->owners[j] = NULL;
+            }
+        }
+    }
+
+    if (peer->bitfield != NULL) {
+        picker_remove_bitfield(session->picker, peer->bitfield);
+    }
+
+    if (!peer->choking) {
+        session->num_unchoked--;
+    }
+
+    if (peer == session->optimistic) {
+        session->optimistic = NULL;
+    }
+
+    if (peer->sockfd != -1) {
+        epoll_ctl(session->epfd, EPOLL_CTL_DEL, peer->sockfd, NULL);
+        session->num_connections--;
+    }
+
+    peer_disconnect(peer);
+}
+
+// Flush the peer at the end of the current loop iteration
+static int session_queue_flush(session_t* session, peer_t* peer) {
+    if (peer->flush_queued) {
+        return 0;
+    }
+
+    if (session->flush_len == session->flush_cap) {
+        size_t   cap   = session->flush_cap > 0 ? session->flush_cap * 2 : 16;
+        peer_t** queue = realloc(session->flush_queue, cap * sizeof(peer_t*));
+        if (queue == NULL) {
+            LOG_ERROR("Failed to allocate memory for flush queue");
+            return -1;
+        }
+
+        session->flush_queue = queue;
+        session->flush_cap   = cap;
+    }
+
+    session->flush_queue[session->flush_len++] = peer;
+    peer->flush_queued                         = true;
+    return 0;
+}
+
+// Queue a message, it is sent with everything else queued for the peer at
+// the end of the current loop iteration
+static int session_send(session_t* session, peer_t* peer,
+                        const peer_msg_t* msg) {
+    if (peer_queue_msg(peer, msg) != 0) {
+        return -1;
+    }
+
+    return session_queue_flush(session, peer);
+}
+
+static ssize_t session_send_block(void* ctx, int sockfd, uint64_t offset,
+                                  size_t len) {
+    return storage_sendfile(ctx, sockfd, offset, len);
+}
+
+// Queue the PIECE message of the oldest request of a peer
+static int session_upload_block(session_t* session, peer_t* peer) {
+    peer_request_msg_t request = peer->uploads[0];
+    peer->num_uploads--;
+    memmove(peer->uploads, peer->uploads + 1,
+            peer->num_uploads * sizeof(peer_request_msg_t));
+
+    // Pieces still in the cache are not on disk yet, so they are copied from
+    // the cache (the only blocks that go through user space). Anything else
+    // is sent from the page cache.
+    const uint8_t* data = cache_find(session->cache, request.index);
+
+    int ret;
+    if (data != NULL) {
+        // The copy would read past the piece buffer, see
+        // session_handle_request
+        assert(torrent_block_in_piece(session->torrent, request.index,
+                                      request.begin, request.length));
+        ret = peer_queue_block(peer, &request, data + request.begin);
+    } else {
+        uint64_t offset = (uint64_t)request.index
+                              * session->torrent->piece_length
+                          + request.begin;
+        ret = peer_queue_block_send(peer, &request, offset,
+                                    session_send_block, session->storage);
+    }
+
+    if (ret != 0) {
+        return -1;
+    }
+
+    peer->bytes_up      += request.length;
+    peer->bytes_up_tick += request.length;
+    return 0;
+}
+
+// Send what is queued for a peer, then the blocks it requested one at a time
+// until the socket would block
+static int session_peer_flush(session_t* session, peer_t* peer) {
+    for (;;) {
+        int ret = peer_flush(peer);
+        if (ret <= 0) {
+            return ret;
+        }
+
+        if (peer->num_uploads == 0) {
+            return 1;
+        }
+
+        if (session_upload_block(session, peer) != 0) {
+            return -1;
+        }
+    }
+}
+
+// Tell a peer with the Fast Extension that a request won't be served, other
+// peers find out by themselves
+static int session_reject(session_t* session, peer_t* peer,
+                          const peer_request_msg_t* request) {
+    if (!peer->fast) {
+        return 0;
+    }
+
+    peer_msg_t reject_msg = {
+        .type            = PEER_MSG_REJECT,
+        .payload.request = *request,
+    };
+    return session_send(session, peer, &reject_msg);
+}
+
+static int session_set_choking(session_t* session, peer_t* peer,
+                               bool choking) {
+    if (peer->choking == choking) {
+        return 0;
+    }
+
+    peer_msg_t msg = {.type = choking ? PEER_MSG_CHOKE : PEER_MSG_UNCHOKE};
+    if (session_send(session, peer, &msg) != 0) {
+        return -1;
+    }
+
+    peer->choking = choking;
+    if (choking) {
+        // The peer discards its requests when it is choked, with the Fast
+        // Extension it is told so and keeps those of its allowed fast set
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < peer->num_uploads; ++i) {
+            if (peer->fast
+                && session_in_set(peer->allowed_up, peer->num_allowed_up,
+                                  peer->uploads[i].index)) {
+                peer->uploads[kept++] = peer->uploads[i];
+            } else if (session_reject(session, peer, &peer->uploads[i]) != 0) {
+                return -1;
+            }
+        }
+
+        peer->num_uploads = kept;
+        session->num_unchoked--;
+    } else {
+        session->num_unchoked++;
+    }
+
+    return 0;
+}
+
+static int session_rank_cmp(const void* a, const void* b) {
+    uint64_t rate_a = ((const session_rank_t*)a)->rate;
+    uint64_t rate_b = ((const session_rank_t*)b)->rate;
+
+    // Fastest first
+    return (rate_a < rate_b) - (rate_a > rate_b);
+}
+
+static bool session_is_regular(const session_t* session, size_t num_regular,
+                               const peer_t* peer) {
+    for (size_t i = 0; i < num_regular; ++i) {
+        if (session->ranked[i].peer == peer) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Next interested peer after the optimistic one in the peers list, wrapping
+// around, that is not already unchoked for its rate. NULL if there is none.
+static peer_t* session_next_optimistic(const session_t* session,
+                                       size_t           num_regular) {
+    peer_t* first = NULL;
+    bool    after = session->optimistic == NULL;
+
+    for (const list_iterator_t* it = list_iterator_first(session->peers);
+         it != NULL; it            = list_iterator_next(it)) {
+        peer_t* peer = list_iterator_get(it);
+        if (peer == session->optimistic) {
+            after = true;
+            continue;
+        }
+
+        if (peer->state != PEER_STATE_ACTIVE || !peer->peer_interested
+            || session_is_regular(session, num_regular, peer)) {
+            continue;
+        }
+
+        if (after) {
+            return peer;
+        }
+
+        if (first == NULL) {
+            first = peer;
+        }
+    }
+
+    return first;
+}
+
+// Unchoke the interested peers that give us the most, by the rate they send
+// at while downloading and the rate they take at while seeding, plus the
+// optimistic one. Every other peer is choked.
+static void session_rechoke(session_t* session, time_t now) {
+    bool   seeding = session->torrent->pieces_left == 0;
+    size_t num     = 0;
+
+    for (const list_iterator_t* it = list_iterator_first(session->peers);
+         it != NULL; it            = list_iterator_next(it)) {
+        peer_t* peer = list_iterator_get(it);
+        if (peer->state != PEER_STATE_ACTIVE || !peer->peer_interested) {
+            continue;
+        }
+
+        if (num == session->ranked_cap) {
+            size_t cap = session->ranked_cap > 0 ? session->ranked_cap * 2
+                                                 : 16;
+            session_rank_t* ranked = realloc(session->ranked,
+                                             cap * sizeof(session_rank_t));
+            if (ranked == NULL) {
+                LOG_ERROR("Failed to allocate memory for peer ranking");
+                return;
+            }
+
+            session->ranked     = ranked;
+            session->ranked_cap = cap;
+        }
+
+        session->ranked[num++] = (session_rank_t){
+            .peer = peer,
+            .rate = seeding ? peer->upload_rate : peer->download_rate,
+        };
+    }
+
+    if (num > 1) {
+        qsort(session->ranked, num, sizeof(session_rank_t), session_rank_cmp);
+    }
+
+    size_t num_regular = num < SESSION_UPLOAD_SLOTS - 1
+                             ? num
+                             : SESSION_UPLOAD_SLOTS - 1;
+
+    // The optimistic peer is kept for a while so it can reciprocate, unless
+    // it left, lost interest or earned a regular slot
+    peer_t* optimistic = session->optimistic;
+    if (optimistic == NULL || !optimistic->peer_interested
+        || session_is_regular(session, num_regular, optimistic)
+        || now - session->last_optimistic >= SESSION_OPTIMISTIC_INTERVAL) {
+        session->optimistic      = session_next_optimistic(session,
+                                                           num_regular);
+        session->last_optimistic = now;
+    }
+
+    for (const list_iterator_t* it = list_iterator_first(session->peers);
+         it != NULL; it            = list_iterator_next(it)) {
+        peer_t* peer = list_iterator_get(it);
+        if (peer->state != PEER_STATE_ACTIVE) {
+            continue;
+        }
+
+        bool unchoke = peer == session->optimistic
+                       || session_is_regular(session, num_regular, peer);
+        if (session_set_choking(session, peer, !unchoke) != 0) {
+            session_drop_peer(session, peer);
+        }
+    }
+}
+
+static void session_flush_peers(session_t* session) {
+    for (size_t i = 0; i < session->flush_len; ++i) {
+        peer_t* peer       = session->flush_queue[i];
+        peer->flush_queued = false;
+
+        // Dropped after queueing
+        if (peer->state == PEER_STATE_DISCONNECTED) {
+            continue;
+        }
+
+        // Anything left is sent when the socket becomes writable
+        if (session_peer_flush(session, peer) < 0) {
+            session_drop_peer(session, peer);
+        }
+    }
+
+    session->flush_len = 0;
+}
+
+static void session_connect_peers(session_t* session) {
+    while (session->num_connections < session->torrent->max_peers
+           && session->next_peer != NULL) {
+        peer_t* peer       = list_iterator_get(session->next_peer);
+        session->next_peer = list_iterator_next(session->next_peer);
+
+        // Added by the listener, their port is not the one they listen on
+        if (peer->inbound) {
+            continue;
+        }
+
+        LOG_DEBUG("Connecting to peer %s:%d", inet_ntoa(peer->addr.sin_addr),
+                  ntohs(peer->addr.sin_port));
+
+        if (peer_connect(peer) != 0) {
+            continue;
+        }
+
+        if (session->queue_depth != 0) {
+            peer->queue_depth = session->queue_depth;
+        }
+
+        struct epoll_event event = {
+            .events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = peer,
+        };
+
+        if (epoll_ctl(session->epfd, EPOLL_CTL_ADD, peer->sockfd, &event)
+            != 0) {
+            LOG_ERROR("Failed to add peer socket to epoll: %s",
+                      strerror(errno));
+            peer_disconnect(peer);
+            continue;
+        }
+
+        session->num_connections++;
+    }
+}
+
+// Disconnected inbound peers are reused, so the list doesn't grow with every
+// connection
+static peer_t* session_inbound_peer(session_t*                session,
+                                    const struct sockaddr_in* addr) {
+    for (const list_iterator_t* it = list_iterator_first(session->peers);
+         it != NULL; it            = list_iterator_next(it)) {
+        peer_t* peer = list_iterator_get(it);
+
+        // A piece that fails its hash check would blame the new peer
+        if (peer->inbound && peer->state == PEER_STATE_DISCONNECTED
+            && peer->blocks_verifying == 0) {
+            return peer;
+        }
+    }
+
+    peer_t* peer = peer_create(addr->sin_addr.s_addr, addr->sin_port, NULL);
+    if (peer == NULL) {
+        return NULL;
+    }
+
+    if (list_push(session->peers, peer, sizeof(peer_t)) != 0) {
+        free(peer);
+        return NULL;
+    }
+
+    // The peer is copied to the list
+    free(peer);
+    return list_at(session->peers, list_size(session->peers) - 1);
+}
+
+static void session_accept_peers(session_t* session) {
+    for (;;) {
+        struct sockaddr_in addr;
+
+        int sockfd = listener_accept(session->listener, &addr);
+        if (sockfd < 0) {
+            return;
+        }
+
+        // Refused before anything is allocated for the peer
+        if (session->num_connections >= session->torrent->max_peers) {
+            LOG_DEBUG("Refusing peer %s:%d, too many connections",
+                      inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+            close(sockfd);
+            continue;
+        }
+
+        peer_t* peer = session_inbound_peer(session, &addr);
+        if (peer == NULL || peer_accept(peer, sockfd, &addr) != 0) {
+            close(sockfd);
+            continue;
+        }
+
+        if (session->queue_depth != 0) {
+            peer->queue_depth = session->queue_depth;
+        }
+
+        struct epoll_event event = {
+            .events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = peer,
+        };
+
+        if (epoll_ctl(session->epfd, EPOLL_CTL_ADD, sockfd, &event) != 0) {
+            LOG_ERROR("Failed to add peer socket to epoll: %s",
+                      strerror(errno));
+            peer_disconnect(peer);
+            continue;
+        }
+
+        session->num_connections++;
+        LOG_INFO("Accepted peer %s:%d", inet_ntoa(addr.sin_addr),
+                 ntohs(addr.sin_port));
+    }
+}
+
+static bool session_peer_requested(peer_t* peer, uint32_t index,
+                                   uint32_t begin) {
+    for (uint32_t i = 0; i < peer->num_requests; ++i) {
+        if (peer->requests[i].index == index
+            && peer->requests[i].begin == begin) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Find a block that is still missing and was not requested from this peer
+static int session_endgame_block(session_t* session, peer_t* peer,
+                                 piece_t** piece, uint32_t* block) {
+    for (size_t i = 0; i < session->num_active; ++i) {
+        piece_t* active = session->active[i];
+        if (!peer_has_piece(peer, active->index)) {
+            continue;
+        }
+
+        for (uint32_t j = 0; j < active->num_blocks; ++j) {
+            if (!piece_has_block(active, j)
+                && !session_peer_requested(peer, active->index,
+                                           j * BLOCK_SIZE)) {
+                *piece = active;
+                *block = j;
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int session_flush_cache(session_t* session) {
+    // The save may write blocks of a piece that failed its hash since, they
+    // must not land over the cached piece downloaded again. The cache is
+    // flushed once the save is done.
+    if (session->saving != NULL) {
+        return 0;
+    }
+
+    if (cache_flush(session->cache) != 0) {
+        LOG_ERROR("Failed to write cached pieces");
+        session->failed = true;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Check if a new piece fits in the memory budget. Otherwise the cache is
+// flushed to make room and the peer waits for the writes to complete. A
+// single piece is always allowed so the download can't stall on a budget
+// smaller than a piece.
+static bool session_has_room(session_t* session) {
+    size_t length = session->torrent->piece_length;
+    if (session->mem_bytes == 0
+        || session->mem_bytes + cache_bytes(session->cache) + length
+               <= session->max_memory) {
+        return true;
+    }
+
+    if (cache_dirty_bytes(session->cache) > 0) {
+        session_flush_cache(session);
+    }
+
+    session->throttled = true;
+    return false;
+}
+
+// Start downloading a piece taken from the picker, from its first block
+static int session_start_piece(session_t* session, uint32_t index,
+                               piece_t** piece, uint32_t* block) {
+    *piece = session_create_piece(session, index);
+    if (*piece == NULL) {
+        picker_release(session->picker, index);
+        return -1;
+    }
+
+    if (session_add_piece(session, *piece) != 0) {
+        session_free_piece(session, *piece);
+        picker_release(session->picker, index);
+        return -1;
+    }
+
+    *block = 0;
+    return 1;
+}
+
+// Find a block of the pieces a peer lets us request while it chokes us
+static int session_allowed_block(session_t* session, peer_t* peer,
+                                 piece_t** piece, uint32_t* block) {
+    for (uint32_t i = 0; i < peer->num_allowed_fast; ++i) {
+        uint32_t index = peer->allowed_fast[i];
+        if (!peer_has_piece(peer, index)) {
+            continue;
+        }
+
+        piece_t* active = session->pieces[index];
+        if (active != NULL) {
+            if (active->num_requested < active->num_blocks
+                && piece_next_block(active, block) == 0) {
+                *piece = active;
+                return 1;
+            }
+        } else if (session_has_room(session)
+                   && picker_take(session->picker, index) == 0) {
+            return session_start_piece(session, index, piece, block);
+        }
+    }
+
+    return 0;
+}
+
+// Take the oldest piece suggested by the peer that is still wanted
+static int session_suggested_piece(session_t* session, peer_t* peer,
+                                   uint32_t* index) {
+    while (peer->num_suggested > 0) {
+        uint32_t suggested = peer->suggested[0];
+        peer->num_suggested--;
+        memmove(peer->suggested, peer->suggested + 1,
+                peer->num_suggested * sizeof(uint32_t));
+
+        if (peer_has_piece(peer, suggested)
+            && picker_take(session->picker, suggested) == 0) {
+            *index = suggested;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// Find a block the peer has that nobody was asked for, pieces already being
+// downloaded come first so they are completed before new ones are started
+// Returns 1 if a block was found, 0 if there is none, -1 on error
+static int session_next_block(session_t* session, peer_t* peer,
+                              piece_t** piece, uint32_t* block) {
+    if (peer->choked) {
+        return session_allowed_block(session, peer, piece, block);
+    }
+
+    for (size_t i = 0; i < session->num_active; ++i) {
+        piece_t* active = session->active[i];
+        if (active->num_requested < active->num_blocks
+            && peer_has_piece(peer, active->index)
+            && piece_next_block(active, block) == 0) {
+            *piece = active;
+            return 1;
+        }
+    }
+
+    // Pieces being downloaded are finished first, this only holds back new
+    // ones until the disk catches up
+    if (!session_has_room(session)) {
+        return 0;
+    }
+
+    // The peer suggests pieces it can serve quickly, e.g. from its cache
+    uint32_t index;
+    if (session_suggested_piece(session, peer, &index) != 0
+        && picker_pick(session->picker, peer->bitfield, &index) != 0) {
+        if (picker_num_wanted(session->picker) > 0) {
+            return 0;
+        }
+
+        // Only blocks in flight are left, instead of waiting on the slowest
+        // peer they are also requested from this one
+        if (!session->endgame) {
+            LOG_INFO("Entering endgame mode");
+            session->endgame = true;
+        }
+
+        return session_endgame_block(session, peer, piece, block);
+    }
+
+    return session_start_piece(session, index, piece, block);
+}
+
+// Keep up to `queue_depth` requests in flight for the peer
+static int session_fill_requests(session_t* session, peer_t* peer) {
+    uint64_t now = now_ms();
+
+    while (peer->num_requests < peer->queue_depth) {
+        piece_t* piece;
+        uint32_t block;
+
+        int ret = session_next_block(session, peer, &piece, &block);
+        if (ret <= 0) {
+            return ret;
+        }
+
+        uint32_t begin  = block * BLOCK_SIZE;
+        uint32_t length = piece_block_length(piece, block);
+
+        peer_msg_t request_msg = {
+            .type = PEER_MSG_REQUEST,
+            .payload.request =
+                (peer_request_msg_t){
+                    .index = piece->index,
+                    .begin = begin,
+                    .length = length,
+                },
+        };
+
+        if (session_send(session, peer, &request_msg) != 0) {
+            return -1;
+        }
+
+        piece_request_block(piece, block);
+
+        // Only a request sent while nothing else is in flight measures the
+        // round trip, the others also wait for the blocks queued before them
+        peer->requests[peer->num_requests] = (peer_request_t){
+            .index   = piece->index,
+            .begin   = begin,
+            .length  = length,
+            .dest    = piece->data + begin,
+            .sent_ms = peer->num_requests == 0 ? now : 0,
+        };
+        peer->num_requests++;
+    }
+
+    return 0;
+}
+
+// Start (or continue) downloading from an unchoked peer, or from a choking
+// one that allows some pieces
+static int session_peer_download(session_t* session, peer_t* peer) {
+    if (peer->state != PEER_STATE_ACTIVE
+        || (peer->choked && peer->num_allowed_fast == 0)) {
+        return 0;
+    }
+
+    return session_fill_requests(session, peer);
+}
+
+// Refill the requests of every peer, e.g. when new pieces can be started
+static void session_download_all(session_t* session) {
+    for (const list_iterator_t* it = list_iterator_first(session->peers);
+         it != NULL; it            = list_iterator_next(it)) {
+        peer_t* peer = list_iterator_get(it);
+        if (peer->state == PEER_STATE_ACTIVE
+            && session_peer_download(session, peer) != 0) {
+            session_drop_peer(session, peer);
+        }
+    }
+}
+
+// Hand a complete piece to the hashing threads, no peer writes to it anymore
+static int session_piece_done(session_t* session, piece_t* piece) {
+    session_detach_piece(session, piece);
+
+    if (hasher_submit(session->hasher, piece,
+                      session->torrent->pieces[piece->index])
+        != 0) {
+        picker_release(session->picker, piece->index);
+        session_free_piece(session, piece);
+        return -1;
+    }
+
+    // The hasher threads never touch the owners, and the piece lives until
+    // hasher_poll hands it back on this thread
+    for (uint32_t i = 0; i < piece->num_blocks; ++i) {
+        if (piece->owners[i] != NULL) {
+            piece->owners[i]->blocks_verifying++;
+        }
+    }
+
+    session->num_verifying++;
+    return 0;
+}
+
+// Tell the connected peers about a new piece, with HAVE messages that go out
+// with everything else queued for each of them at the end of the loop
+// iteration
+static void session_announce_piece(session_t* session, uint32_t index) {
+    peer_msg_t have_msg = {.type = PEER_MSG_HAVE, .payload.index = index};
+    bool       complete = session->torrent->pieces_left == 0;
+
+    for (const list_iterator_t* it = list_iterator_first(session->peers);
+         it != NULL; it            = list_iterator_next(it)) {
+        peer_t* peer = list_iterator_get(it);
+
+        // Peers still handshaking get the piece in our bitfield
+        if (peer->state != PEER_STATE_ACTIVE) {
+            continue;
+        }
+
+        // Nothing left to download from anyone
+        if (complete && peer->interested) {
+            peer_msg_t not_interested_msg = {.type = PEER_MSG_NOT_INTERESTED};
+            if (session_send(session, peer, &not_interested_msg) != 0) {
+                session_drop_peer(session, peer);
+                continue;
+            }
+            peer->interested = false;
+        }
+
+        // Nothing new for a peer that has the piece already
+        if (peer->bitfield != NULL && peer_has_piece(peer, index)) {
+            continue;
+        }
+
+        if (session_send(session, peer, &have_msg) != 0) {
+            session_drop_peer(session, peer);
+        }
+    }
+}
+
+static void session_piece_verified(void* ctx, const hasher_result_t* result) {
+    session_t* session = ctx;
+    torrent_t* torrent = session->torrent;
+    piece_t*   piece   = result->piece;
+    uint32_t   index   = piece->index;
+
+    session->num_verifying--;
+
+    for (uint32_t i = 0; i < piece->num_blocks; ++i) {
+        if (piece->owners[i] != NULL) {
+            piece->owners[i]->blocks_verifying--;
+        }
+    }
+
+    if (!result->valid) {
+        char exp[SHA1_DIGEST_SIZE * 2 + 1] = {0};
+        char got[SHA1_DIGEST_SIZE * 2 + 1] = {0};
+
+        int exp_walk = 0;
+        int got_walk = 0;
+        for (int i = 0; i < SHA1_DIGEST_SIZE; ++i) {
+            exp_walk
+                += sprintf(exp + exp_walk, "%02x", torrent->pieces[index][i]);
+            got_walk += sprintf(got + got_walk, "%02x", result->digest[i]);
+        };
+
+        LOG_ERROR("Invalid piece hash, expected %s, got %s", exp, got);
+
+        // The culprit is only known if a single peer sent the whole piece
+        peer_t* owner = piece->owners[0];
+        for (uint32_t i = 1; i < piece->num_blocks; ++i) {
+            if (piece->owners[i] != owner) {
+                owner = NULL;
+                break;
+            }
+        }
+
+        if (owner != NULL && owner->state != PEER_STATE_DISCONNECTED) {
+            session_drop_peer(session, owner);
+        }
+
+        picker_release(session->picker, index);
+        session_free_piece(session, piece);
+        return;
+    }
+
+    // A mapped piece was received in place, it is already in the page cache.
+    // Others are written with their neighbors when the cache is flushed,
+    // the cache is always flushed before the progress is saved.
+    if (piece->mapped) {
+        session_free_piece(session, piece);
+    } else {
+        if (cache_add(session->cache, piece) != 0) {
+            session->failed = true;
+            session_free_piece(session, piece);
+            return;
+        }
+
+        session->mem_bytes -= piece->length;
+    }
+
+    torrent->pieces_left -= 1;
+    session->have->data[index / CHAR_BIT]
+        |= 1 << (CHAR_BIT - index % CHAR_BIT - 1);
+
+    LOG_INFO("Piece %d/%d downloaded successfully", index + 1,
+             torrent->num_pieces);
+
+    session_announce_piece(session, index);
+
+    if (cache_dirty_bytes(session->cache) >= session->max_memory / 2) {
+        session_flush_cache(session);
+    }
+}
+
+// Called once writes of the cache completed
+static void session_pieces_written(session_t* session) {
+    if (cache_failed(session->cache)) {
+        session->failed = true;
+        return;
+    }
+
+    // Peers left idle by the memory budget can start new pieces
+    if (session->throttled) {
+        session->throttled = false;
+        session_download_all(session);
+    }
+}
+
+// Cancel the requests other peers have for a block that was just received
+static void session_cancel_block(session_t* session, peer_t* from,
+                                 uint32_t index, uint32_t begin) {
+    for (const list_iterator_t* it = list_iterator_first(session->peers);
+         it != NULL; it            = list_iterator_next(it)) {
+        peer_t* peer = list_iterator_get(it);
+        if (peer == from || peer->state != PEER_STATE_ACTIVE) {
+            continue;
+        }
+
+        uint32_t i = 0;
+        while (i < peer->num_requests
+               && (peer->requests[i].index != index
+                   || peer->requests[i].begin != begin)) {
+            ++i;
+        }
+
+        if (i == peer->num_requests) {
+            continue;
+        }
+
+        peer_msg_t cancel_msg = {
+            .type = PEER_MSG_CANCEL,
+            .payload.request =
+                (peer_request_msg_t){
+                    .index = index,
+                    .begin = begin,
+                    .length = peer->requests[i].length,
+                },
+        };
+
+        peer_request_t* request = &peer->requests[i];
+        memmove(request, request + 1,
+                (peer->num_requests - i - 1) * sizeof(peer_request_t));
+        peer->num_requests--;
+
+        // The block may be on its way into the piece, which is about to be
+        // completed and freed
+        if (peer->rx_dest != NULL && peer->rx_dest_index == index
+            && peer->rx_dest_begin == begin
+            && peer_discard_block(peer) != 0) {
+            session_drop_peer(session, peer);
+            continue;
+        }
+
+        if (session_send(session, peer, &cancel_msg) != 0
+            || session_peer_download(session, peer) != 0) {
+            session_drop_peer(session, peer);
+        }
+    }
+}
+
+static int session_handle_piece(session_t* session, peer_t* peer,
+                                peer_piece_msg_t* piece) {
+    uint32_t i = 0;
+    while (i < peer->num_requests
+           && (peer->requests[i].index != piece->index
+               || peer->requests[i].begin != piece->begin)) {
+        ++i;
+    }
+
+    if (i == peer->num_requests) {
+        // Requests are dropped on CHOKE and CANCEL, a block may still be on
+        // its way
+        LOG_DEBUG("Received block that was not requested");
+        return 0;
+    }
+
+    // A requested block is received in place unless its length is wrong
+    peer_request_t* request = &peer->requests[i];
+    if (piece->block != NULL || piece->length != request->length) {
+        LOG_ERROR("Invalid piece message");
+        return -1;
+    }
+
+    if (request->sent_ms != 0) {
+        uint32_t rtt = now_ms() - request->sent_ms;
+        if (rtt == 0) {
+            rtt = 1;
+        }
+
+        // Smoothed the same way TCP does it (RFC 6298)
+        if (peer->rtt_ms == 0) {
+            peer->rtt_ms = rtt;
+        } else {
+            peer->rtt_ms = (7 * peer->rtt_ms + rtt) / 8;
+        }
+    }
+
+    peer->bytes_down      += piece->length;
+    peer->bytes_down_tick += piece->length;
+
+    memmove(request, request + 1,
+            (peer->num_requests - i - 1) * sizeof(peer_request_t));
+    peer->num_requests--;
+
+    piece_t* active = session->pieces[piece->index];
+    piece_receive_block(active, piece->begin / BLOCK_SIZE, peer);
+
+    if (session->endgame) {
+        session_cancel_block(session, peer, piece->index, piece->begin);
+    }
+
+    if (piece_is_complete(active) && session_piece_done(session, active) != 0) {
+        return -1;
+    }
+
+    return session_peer_download(session, peer);
+}
+
+// Tell the peer we want its pieces, once
+static int session_want(session_t* session, peer_t* peer) {
+    if (peer->interested || session->torrent->pieces_left == 0) {
+        return 0;
+    }
+
+    peer_msg_t interested_msg = {.type = PEER_MSG_INTERESTED};
+    if (session_send(session, peer, &interested_msg) != 0) {
+        return -1;
+    }
+
+    peer->interested = true;
+    return 0;
+}
+
+static int session_handle_request(session_t* session, peer_t* peer,
+                                  const peer_request_msg_t* request) {
+    uint32_t index = request->index;
+    if (request->length == 0 || request->length > BLOCK_SIZE
+        || !torrent_block_in_piece(session->torrent, index, request->begin,
+                                   request->length)) {
+        LOG_ERROR("Invalid request of %u bytes at %u in piece %u",
+                  request->length, request->begin, index);
+        return -1;
+    }
+
+    // Sent before the peer got our CHOKE, it drops them as well. Pieces of
+    // its allowed fast set are served anyway.
+    if (peer->choking
+        && !session_in_set(peer->allowed_up, peer->num_allowed_up, index)) {
+        return session_reject(session, peer, request);
+    }
+
+    if (!session_has_piece(session, index)) {
+        LOG_WARN("Peer requested piece %u that we don't have", index);
+        return session_reject(session, peer, request);
+    }
+
+    for (uint32_t i = 0; i < peer->num_uploads; ++i) {
+        if (peer->uploads[i].index == index
+            && peer->uploads[i].begin == request->begin) {
+            return 0;
+        }
+    }
+
+    if (peer->num_uploads == PEER_MAX_UPLOADS) {
+        LOG_WARN("Peer has too many pending requests, ignoring one");
+        return session_reject(session, peer, request);
+    }
+
+    peer->uploads[peer->num_uploads++] = *request;
+    return session_queue_flush(session, peer);
+}
+
+// With the Fast Extension, a cancelled request is answered with the block
+// if it is already on its way, or a REJECT otherwise
+static int session_handle_cancel(session_t* session, peer_t* peer,
+                                 const peer_request_msg_t* request) {
+    for (uint32_t i = 0; i < peer->num_uploads; ++i) {
+        if (peer->uploads[i].index == request->index
+            && peer->uploads[i].begin == request->begin) {
+            peer_request_msg_t cancelled = peer->uploads[i];
+            peer->num_uploads--;
+            memmove(peer->uploads + i, peer->uploads + i + 1,
+                    (peer->num_uploads - i) * sizeof(peer_request_msg_t));
+            return session_reject(session, peer, &cancelled);
+        }
+    }
+
+    return 0;
+}
+
+static int session_handle_reject(session_t* session, peer_t* peer,
+                                 const peer_request_msg_t* reject) {
+    uint32_t i = 0;
+    while (i < peer->num_requests
+           && (peer->requests[i].index != reject->index
+               || peer->requests[i].begin != reject->begin)) {
+        ++i;
+    }
+
+    // Requests cancelled in endgame mode are rejected after the CANCEL
+    if (i == peer->num_requests) {
+        LOG_DEBUG("Received reject for a request that is not pending");
+        return 0;
+    }
+
+    peer_request_t request = peer->requests[i];
+    memmove(&peer->requests[i], &peer->requests[i + 1],
+            (peer->num_requests - i - 1) * sizeof(peer_request_t));
+    peer->num_requests--;
+
+    // The block goes to other peers, this one gets more requests at the
+    // next tick so a peer that rejects everything isn't asked in a loop
+    session_release_request(session, &request);
+
+    // No longer allowed while choked, the peer changed its mind
+    if (peer->choked) {
+        for (uint32_t j = 0; j < peer->num_allowed_fast; ++j) {
+            if (peer->allowed_fast[j] == request.index) {
+                peer->num_allowed_fast--;
+                memmove(&peer->allowed_fast[j], &peer->allowed_fast[j + 1],
+                        (peer->num_allowed_fast - j) * sizeof(uint32_t));
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Set the pieces of a peer that didn't start with a BITFIELD message, it
+// has all of them after HAVE ALL and none otherwise (lazy bitfield)
+static int session_set_bitfield(session_t* session, peer_t* peer, bool all) {
+    uint32_t num_pieces   = session->torrent->num_pieces;
+    size_t   bitfield_len = (num_pieces + CHAR_BIT - 1) / CHAR_BIT;
+
+    peer->bitfield = calloc(1, sizeof(byte_str_t) + bitfield_len + 1);
+    if (peer->bitfield == NULL) {
+        LOG_ERROR("Failed to allocate memory for bitfield");
+        return -1;
+    }
+    peer->bitfield->len = bitfield_len;
+
+    if (all) {
+        memset(peer->bitfield->data, 0xFF, bitfield_len);
+
+        // The spare bits of the last byte stay clear
+        if (num_pieces % CHAR_BIT != 0) {
+            peer->bitfield->data[bitfield_len - 1]
+                = (uint8_t)(0xFF << (CHAR_BIT - num_pieces % CHAR_BIT));
+        }
+    }
+
+    picker_add_bitfield(session->picker, peer->bitfield);
+    return 0;
+}
+
+static int session_handle_msg(session_t* session, peer_t* peer,
+                              peer_msg_t* msg) {
+    if (msg->type >= PEER_MSG_SUGGEST && !peer->fast) {
+        LOG_ERROR("Received Fast Extension message %d from a peer without it",
+                  msg->type);
+        return -1;
+    }
+
+    // The first message tells the pieces of the peer, a peer without any may
+    // skip it
+    bool first = peer->bitfield == NULL;
+    if (first && msg->type != PEER_MSG_BITFIELD
+        && session_set_bitfield(session, peer, msg->type == PEER_MSG_HAVE_ALL)
+               != 0) {
+        return -1;
+    }
+
+    switch (msg->type) {
+    case PEER_MSG_CHOKE:
+        peer->choked = true;
+
+        // With the Fast Extension the peer rejects the requests it drops,
+        // and may still serve those of its allowed fast set
+        if (peer->fast) {
+            return 0;
+        }
+
+        if (peer->num_requests > 0) {
+            // The peer discards our requests, so the blocks are given to
+            // other peers. The one being received may end up in a piece that
+            // is freed or completed by someone else.
+            LOG_WARN("Peer choked with %u outstanding requests",
+                     peer->num_requests);
+            if (peer_discard_block(peer) != 0) {
+                return -1;
+            }
+            session_release_requests(session, peer);
+        }
+        return 0;
+    case PEER_MSG_UNCHOKE:
+        peer->choked = false;
+        return session_peer_download(session, peer);
+    case PEER_MSG_HAVE: {
+        uint32_t index = msg->payload.index;
+        if (index >= session->torrent->num_pieces) {
+            LOG_ERROR("Invalid piece index %u in HAVE message", index);
+            return -1;
+        }
+
+        if (peer_has_piece(peer, index)) {
+            return 0;
+        }
+
+        if (peer_set_piece(peer, index) != 0) {
+            return -1;
+        }
+
+        picker_add_have(session->picker, index);
+
+        if (!session_has_piece(session, index)
+            && session_want(session, peer) != 0) {
+            return -1;
+        }
+
+        // The peer may have been idle for lack of pieces
+        return session_peer_download(session, peer);
+    }
+    case PEER_MSG_BITFIELD: {
+        if (peer->bitfield != NULL) {
+            LOG_ERROR("Should not receive bitfield message after handshake");
+            return -1;
+        }
+
+        size_t bitfield_len = (session->torrent->num_pieces + CHAR_BIT - 1)
+                              / CHAR_BIT;
+        if (msg->payload.bitfield->len != bitfield_len) {
+            LOG_ERROR("Invalid bitfield length %zu, expected %zu",
+                      msg->payload.bitfield->len, bitfield_len);
+            return -1;
+        }
+
+        peer->bitfield        = msg->payload.bitfield;
+        msg->payload.bitfield = NULL;
+        picker_add_bitfield(session->picker, peer->bitfield);
+
+        return session_want(session, peer);
+    }
+    case PEER_MSG_HAVE_ALL:
+    case PEER_MSG_HAVE_NONE:
+        if (!first) {
+            LOG_ERROR("Should not receive have all or none message after "
+                      "handshake");
+            return -1;
+        }
+
+        return msg->type == PEER_MSG_HAVE_ALL ? session_want(session, peer)
+                                              : 0;
+    case PEER_MSG_INTERESTED:
+        // A free slot is not left empty until the next rechoke
+        peer->peer_interested = true;
+        if (session->num_unchoked < SESSION_UPLOAD_SLOTS) {
+            return session_set_choking(session, peer, false);
+        }
+        return 0;
+    case PEER_MSG_NOT_INTERESTED:
+        // The slot goes to another peer at the next rechoke
+        peer->peer_interested = false;
+        return session_set_choking(session, peer, true);
+    case PEER_MSG_REQUEST:
+        return session_handle_request(session, peer, &msg->payload.request);
+    case PEER_MSG_CANCEL:
+        return session_handle_cancel(session, peer, &msg->payload.request);
+    case PEER_MSG_PIECE:
+        return session_handle_piece(session, peer, &msg->payload.piece);
+    case PEER_MSG_REJECT:
+        return session_handle_reject(session, peer, &msg->payload.request);
+    case PEER_MSG_SUGGEST: {
+        uint32_t index = msg->payload.index;
+        if (index >= session->torrent->num_pieces) {
+            LOG_ERROR("Invalid piece index %u in SUGGEST message", index);
+            return -1;
+        }
+
+        if (session_has_piece(session, index)
+            || session_in_set(peer->suggested, peer->num_suggested, index)) {
+            return 0;
+        }
+
+        // The oldest suggestion makes room for the new one
+        if (peer->num_suggested == PEER_MAX_SUGGESTED) {
+            peer->num_suggested--;
+            memmove(peer->suggested, peer->suggested + 1,
+                    peer->num_suggested * sizeof(uint32_t));
+        }
+
+        peer->suggested[peer->num_suggested++] = index;
+        return 0;
+    }
+    case PEER_MSG_ALLOWED_FAST: {
+        uint32_t index = msg->payload.index;
+        if (index >= session->torrent->num_pieces) {
+            LOG_ERROR("Invalid piece index %u in ALLOWED FAST message", index);
+            return -1;
+        }
+
+        if (session_has_piece(session, index)
+            || peer->num_allowed_fast == PEER_MAX_ALLOWED_FAST
+            || session_in_set(peer->allowed_fast, peer->num_allowed_fast,
+                              index)) {
+            return 0;
+        }
+
+        peer->allowed_fast[peer->num_allowed_fast++] = index;
+
+        // Can be requested right away, even while choked
+        return session_peer_download(session, peer);
+    }
+    default:
+        // No need to handle other messages
+        return 0;
+    }
+}
+
+// Send our bitfield with a few pieces left out, followed by HAVE messages for
+// them, so a seed doesn't give itself away with a full bitfield
+static int session_send_lazy_bitfield(session_t* session, peer_t* peer) {
+    uint32_t    num_pieces = session->torrent->num_pieces;
+    byte_str_t* bitfield
+        = byte_str_create(session->have->data, session->have->len);
+    if (bitfield == NULL) {
+        return -1;
+    }
+
+    uint32_t lazy[SESSION_LAZY_PIECES];
+    uint32_t num_lazy = 0;
+    while (num_lazy < SESSION_LAZY_PIECES && num_lazy < num_pieces) {
+        uint32_t index = (uint32_t)rand() % num_pieces;
+        uint8_t  mask  = 1 << (CHAR_BIT - index % CHAR_BIT - 1);
+        if (bitfield->data[index / CHAR_BIT] & mask) {
+            bitfield->data[index / CHAR_BIT] &= ~mask;
+            lazy[num_lazy++]                  = index;
+        }
+    }
+
+    peer_msg_t bitfield_msg = {
+        .type             = PEER_MSG_BITFIELD,
+        .payload.bitfield = bitfield,
+    };
+    int ret = session_send(session, peer, &bitfield_msg);
+    free(bitfield);
+
+    for (uint32_t i = 0; i < num_lazy && ret == 0; ++i) {
+        peer_msg_t have_msg = {.type = PEER_MSG_HAVE, .payload.index = lazy[i]};
+        ret                 = session_send(session, peer, &have_msg);
+    }
+
+    return ret;
+}
+
+// Tell the peer which pieces we have, nothing at all if we have none unless
+// it supports the Fast Extension
+static int session_send_have(session_t* session, peer_t* peer) {
+    torrent_t* torrent = session->torrent;
+
+    if (peer->fast
+        && (torrent->pieces_left == 0
+            || torrent->pieces_left == torrent->num_pieces)) {
+        peer_msg_t msg = {
+            .type = torrent->pieces_left == 0 ? PEER_MSG_HAVE_ALL
+                                              : PEER_MSG_HAVE_NONE,
+        };
+        return session_send(session, peer, &msg);
+    }
+
+    if (torrent->pieces_left == torrent->num_pieces) {
+        return session_queue_flush(session, peer);
+    }
+
+    if (torrent->pieces_left == 0) {
+        return session_send_lazy_bitfield(session, peer);
+    }
+
+    peer_msg_t bitfield_msg = {
+        .type             = PEER_MSG_BITFIELD,
+        .payload.bitfield = session->have,
+    };
+    return session_send(session, peer, &bitfield_msg);
+}
+
+// Send our pieces once the peer's handshake is in, after our own handshake
+// for inbound peers, then the pieces a peer with the Fast Extension may
+// request while we choke it
+static int session_handshake_done(session_t* session, peer_t* peer) {
+    if (session_send_have(session, peer) != 0) {
+        return -1;
+    }
+
+    if (!peer->fast) {
+        return 0;
+    }
+
+    if (peer_allowed_fast_set(peer, session->torrent->info_hash,
+                              session->torrent->num_pieces)
+        != 0) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < peer->num_allowed_up; ++i) {
+        peer_msg_t allowed_msg = {
+            .type          = PEER_MSG_ALLOWED_FAST,
+            .payload.index = peer->allowed_up[i],
+        };
+        if (session_send(session, peer, &allowed_msg) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void session_handle_event(session_t* session, peer_t* peer,
+                                 uint32_t events) {
+    // Dropped while handling an earlier event of the same batch
+    if (peer->state == PEER_STATE_DISCONNECTED) {
+        return;
+    }
+
+    if (events & EPOLLERR) {
+        session_drop_peer(session, peer);
+        return;
+    }
+
+    if (peer->state == PEER_STATE_CONNECTING) {
+        if (!(events & EPOLLOUT)) {
+            return;
+        }
+
+        if (peer_finish_connect(peer, session->torrent->info_hash) != 0) {
+            session_drop_peer(session, peer);
+            return;
+        }
+
+        LOG_INFO("Connected to peer %s:%d", inet_ntoa(peer->addr.sin_addr),
+                 ntohs(peer->addr.sin_port));
+    } else if ((events & EPOLLOUT) && session_peer_flush(session, peer) < 0) {
+        session_drop_peer(session, peer);
+        return;
+    }
+
+    if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+        return;
+    }
+
+    // Edge-triggered, so read until the socket would block
+    for (;;) {
+        peer_msg_t* msg       = NULL;
+        bool        handshake = peer->state == PEER_STATE_HANDSHAKE;
+
+        int ret = peer_read(peer, session->torrent->info_hash, &msg);
+
+        // Goes out before any answer to the messages that follow
+        if (ret >= 0 && handshake && peer->state == PEER_STATE_ACTIVE
+            && session_handshake_done(session, peer) != 0) {
+            ret = -1;
+        }
+
+        if (ret < 0) {
+            if (msg != NULL) {
+                peer_msg_free(msg);
+            }
+            session_drop_peer(session, peer);
+            return;
+        }
+
+        if (ret == 0) {
+            return;
+        }
+
+        ret = session_handle_msg(session, peer, msg);
+        peer_msg_free(msg);
+
+        if (ret != 0) {
+            session_drop_peer(session, peer);
+            return;
+        }
+    }
+}
+
+static void session_update_rate(session_t* session, peer_t* peer,
+                                uint64_t elapsed_ms) {
+    uint64_t rate         = peer->bytes_down_tick * 1000 / elapsed_ms;
+    peer->bytes_down_tick = 0;
+
+    if (peer->download_rate == 0) {
+        peer->download_rate = rate;
+    } else {
+        peer->download_rate = (3 * peer->download_rate + rate) / 4;
+    }
+
+    uint64_t up_rate    = peer->bytes_up_tick * 1000 / elapsed_ms;
+    peer->bytes_up_tick = 0;
+
+    if (peer->upload_rate == 0) {
+        peer->upload_rate = up_rate;
+    } else {
+        peer->upload_rate = (3 * peer->upload_rate + up_rate) / 4;
+    }
+
+    if (session->queue_depth != 0) {
+        peer->queue_depth = session->queue_depth;
+        return;
+    }
+
+    if (peer->rtt_ms == 0 || peer->download_rate == 0) {
+        return;
+    }
+
+    // Enough requests to cover twice the bandwidth-delay product. While the
+    // link is not saturated the rate follows the queue depth, so this
+    // doubles the depth on each update until the rate stops growing.
+    uint64_t bdp   = peer->download_rate * peer->rtt_ms / 1000;
+    uint64_t depth = 2 * bdp / BLOCK_SIZE + 1;
+
+    if (depth < PEER_MIN_QUEUE_DEPTH) {
+        depth = PEER_MIN_QUEUE_DEPTH;
+    } else if (depth > PEER_MAX_QUEUE_DEPTH) {
+        depth = PEER_MAX_QUEUE_DEPTH;
+    }
+
+    peer->queue_depth = depth;
+}
+
+static void session_log_stats(session_t* session) {
+    for (const list_iterator_t* it = list_iterator_first(session->peers);
+         it != NULL; it            = list_iterator_next(it)) {
+        peer_t* peer = list_iterator_get(it);
+        if (peer->state != PEER_STATE_ACTIVE) {
+            continue;
+        }
+
+        LOG_INFO("Peer %s:%d: %lu KiB/s down, %lu KiB/s up, rtt %u ms, "
+                 "queue depth %u (%u outstanding)",
+                 inet_ntoa(peer->addr.sin_addr), ntohs(peer->addr.sin_port),
+                 peer->download_rate / 1024, peer->upload_rate / 1024,
+                 peer->rtt_ms, peer->queue_depth, peer->num_requests);
+    }
+
+    hasher_log_stats(session->hasher);
+    disk_log_stats(session->disk);
+}
+
+// Count the blocks that are only in memory
+static size_t session_unwritten_blocks(const session_t* session) {
+    size_t num = 0;
+    for (size_t i = 0; i < session->num_active; ++i) {
+        const piece_t* piece = session->active[i];
+        if (piece->mapped) {
+            continue;
+        }
+
+        for (uint32_t j = 0; j < piece->num_blocks; ++j) {
+            if (piece_has_block(piece, j) && !piece_block_written(piece, j)) {
+                num++;
+            }
+        }
+    }
+
+    return num;
+}
+
+// Fill in which blocks of a piece are on disk, writing the ones that are only
+// in memory, or copying them to `save` to be written by a disk thread. Returns
+// 1 if some blocks are saved, 0 if none is, -1 on error
+static int session_save_piece(session_t* session, piece_t* piece,
+                              resume_piece_t* saved, session_save_t* save) {
+    torrent_t* torrent = session->torrent;
+    size_t     len     = (piece->num_blocks + CHAR_BIT - 1) / CHAR_BIT;
+
+    byte_str_t* blocks = calloc(1, sizeof(byte_str_t) + len + 1);
+    if (blocks == NULL) {
+        LOG_ERROR("Failed to allocate memory for piece %u", piece->index);
+        return -1;
+    }
+    blocks->len = len;
+
+    size_t num_saved = 0;
+    for (uint32_t i = 0; i < piece->num_blocks; ++i) {
+        if (!piece_has_block(piece, i)) {
+            continue;
+        }
+
+        if (!piece_block_written(piece, i) && !piece->mapped) {
+            uint32_t begin  = i * BLOCK_SIZE;
+            uint64_t offset = piece->index * torrent->piece_length + begin;
+            uint32_t length = piece_block_length(piece, i);
+
+            if (save != NULL) {
+                session_block_t* block = &save->blocks[save->num_blocks];
+
+                block->offset = offset;
+                block->length = length;
+                block->data   = save->data + save->num_blocks * BLOCK_SIZE;
+                memcpy(block->data, piece->data + begin, length);
+                save->num_blocks++;
+            } else {
+                if (storage_write(session->storage, offset,
+                                  piece->data + begin, length)
+                    != 0) {
+                    free(blocks);
+                    return -1;
+                }
+                piece_mark_block_written(piece, i);
+            }
+        }
+
+        blocks->data[i / CHAR_BIT] |= 1 << (CHAR_BIT - i % CHAR_BIT - 1);
+        num_saved++;
+    }
+
+    if (num_saved == 0) {
+        free(blocks);
+        return 0;
+    }
+
+    saved->index  = piece->index;
+    saved->blocks = blocks;
+    return 1;
+}
+
+static void session_free_save(session_save_t* save) {
+    for (size_t i = 0; i < save->num_pieces; ++i) {
+        free(save->pieces[i].blocks);
+    }
+
+    free(save->pieces);
+    free(save->blocks);
+    free(save->data);
+    free(save->have);
+    free(save);
+}
+
+// Take a snapshot of the progress. Pieces still in the write cache are left
+// out, they are only complete once they are on disk.
+static session_save_t* session_snapshot(session_t* session) {
+    session_save_t* save = calloc(1, sizeof(session_save_t));
+    if (save == NULL) {
+        LOG_ERROR("Failed to allocate memory for resume data");
+        return NULL;
+    }
+    save->session = session;
+
+    size_t len = session->have->len;
+    size_t num = session_unwritten_blocks(session);
+
+    save->have   = malloc(sizeof(byte_str_t) + len + 1);
+    save->pieces = calloc(session->num_active, sizeof(resume_piece_t));
+    save->blocks = calloc(num, sizeof(session_block_t));
+    save->data   = malloc(num * BLOCK_SIZE);
+    if (save->have == NULL
+        || (session->num_active > 0 && save->pieces == NULL)
+        || (num > 0 && (save->blocks == NULL || save->data == NULL))) {
+        LOG_ERROR("Failed to allocate memory for resume data");
+        session_free_save(save);
+        return NULL;
+    }
+
+    save->have->len = len;
+    memcpy(save->have->data, session->have->data, len + 1);
+
+    torrent_t* torrent = session->torrent;
+    for (uint32_t i = 0; i < torrent->num_pieces; ++i) {
+        if (cache_find(session->cache, i) != NULL) {
+            save->have->data[i / CHAR_BIT]
+                &= ~(1 << (CHAR_BIT - i % CHAR_BIT - 1));
+        }
+    }
+
+    for (size_t i = 0; i < session->num_active; ++i) {
+        int saved = session_save_piece(session, session->active[i],
+                                       &save->pieces[save->num_pieces], save);
+        if (saved < 0) {
+            session_free_save(save);
+            return NULL;
+        }
+        save->num_pieces += saved;
+    }
+
+    return save;
+}
+
+// Called on a disk thread: write the blocks copied, then the fast-resume file
+static int session_save_work(void* ctx) {
+    session_save_t* save    = ctx;
+    session_t*      session = save->session;
+
+    for (size_t i = 0; i < save->num_blocks; ++i) {
+        const session_block_t* block = &save->blocks[i];
+        if (storage_write(session->storage, block->offset, block->data,
+                          block->length)
+            != 0) {
+            return -1;
+        }
+    }
+
+    // The blocks are on disk even if the file can't be saved
+    save->num_blocks = 0;
+
+    return resume_save(session->resume_path, session->torrent, save->have,
+                       save->pieces, save->num_pieces);
+}
+
+// The blocks written are marked so the next saves skip them. A piece that
+// was downloaded again meanwhile may be marked for blocks it received since,
+// they are then read back on resume and fail the hash.
+static void session_save_done(void* ctx, int result) {
+    session_save_t* save    = ctx;
+    session_t*      session = save->session;
+
+    if (save->num_blocks > 0) {
+        LOG_ERROR("Failed to write blocks for the resume data");
+    } else {
+        for (size_t i = 0; i < save->num_pieces; ++i) {
+            const resume_piece_t* saved = &save->pieces[i];
+
+            piece_t* piece = session->pieces[saved->index];
+            if (piece == NULL) {
+                continue;
+            }
+
+            for (uint32_t j = 0; j < piece->num_blocks; ++j) {
+                if (saved->blocks->data[j / CHAR_BIT]
+                        & 1 << (CHAR_BIT - j % CHAR_BIT - 1)
+                    && piece_has_block(piece, j)) {
+                    piece_mark_block_written(piece, j);
+                }
+            }
+        }
+
+        if (result != 0) {
+            LOG_ERROR("Failed to save resume data");
+        }
+    }
+
+    session->saving = NULL;
+    session_free_save(save);
+}
+
+// Save the progress on the disk threads, the network loop only copies the
+// blocks that are not on disk yet
+static int session_save_async(session_t* session) {
+    session_save_t* save = session_snapshot(session);
+    if (save == NULL) {
+        return -1;
+    }
+
+    if (disk_call(session->disk, session_save_work, session_save_done, save)
+        != 0) {
+        session_free_save(save);
+        return -1;
+    }
+
+    session->saving = save;
+    return 0;
+}
+
+static void session_tick(session_t* session) {
+    time_t now = time(NULL);
+    if (now == session->last_tick) {
+        return;
+    }
+    session->last_tick = now;
+
+    uint64_t now_rate   = now_ms();
+    uint64_t elapsed_ms = now_rate - session->last_rate_ms;
+    if (elapsed_ms == 0) {
+        elapsed_ms = 1;
+    }
+    session->last_rate_ms = now_rate;
+
+    for (const list_iterator_t* it = list_iterator_first(session->peers);
+         it != NULL; it            = list_iterator_next(it)) {
+        peer_t* peer = list_iterator_get(it);
+
+        switch (peer->state) {
+        case PEER_STATE_DISCONNECTED:
+            break;
+        case PEER_STATE_CONNECTING:
+        case PEER_STATE_HANDSHAKE:
+            if (now - peer->last_recv > PEER_CONNECT_TIMEOUT) {
+                LOG_DEBUG("Timed out connecting to peer");
+                session_drop_peer(session, peer);
+            }
+            break;
+        case PEER_STATE_ACTIVE:
+            session_update_rate(session, peer, elapsed_ms);
+
+            if (now - peer->last_recv > PEER_IDLE_TIMEOUT) {
+                LOG_DEBUG("Peer timed out");
+                session_drop_peer(session, peer);
+            } else if (session_peer_download(session, peer) != 0) {
+                // Blocks dropped by other peers may be available again
+                session_drop_peer(session, peer);
+            }
+            break;
+        }
+    }
+
+    // Pieces don't wait for the cache to fill when the download is slow
+    if (cache_expired(session->cache, now)) {
+        session_flush_cache(session);
+    }
+
+    // The previous save is still in flight when the disk can't keep up
+    if (session->resume_path != NULL && session->saving == NULL
+        && now - session->last_resume >= SESSION_RESUME_INTERVAL) {
+        session->last_resume = now;
+        session_save_async(session);
+    }
+
+    if (now - session->last_stats >= SESSION_STATS_INTERVAL) {
+        session->last_stats = now;
+        if (will_log(LOG_LEVEL_INFO)) {
+            session_log_stats(session);
+        }
+    }
+
+    // Rates were just updated
+    if (now - session->last_rechoke >= SESSION_RECHOKE_INTERVAL) {
+        session->last_rechoke = now;
+        session_rechoke(session, now);
+    }
+
+    session_connect_peers(session);
+}
+
+session_t* session_create(torrent_t* torrent, list_t* peers,
+                          storage_backend_t backend) {
+    if (torrent == NULL || peers == NULL) {
+        LOG_WARN("Must provide a torrent and a list of peers");
+        return NULL;
+    }
+
+    session_t* session = malloc(sizeof(session_t));
+    if (session == NULL) {
+        LOG_ERROR("Failed to allocate memory for session");
+        return NULL;
+    }
+
+    session->picker = picker_create(torrent->num_pieces);
+    if (session->picker == NULL) {
+        free(session);
+        return NULL;
+    }
+
+    session->pieces = calloc(torrent->num_pieces, sizeof(piece_t*));
+    if (session->pieces == NULL) {
+        LOG_ERROR("Failed to allocate memory for pieces");
+        picker_free(session->picker);
+        free(session);
+        return NULL;
+    }
+
+    size_t num_bytes = (torrent->num_pieces + CHAR_BIT - 1) / CHAR_BIT;
+    session->have    = calloc(1, sizeof(byte_str_t) + num_bytes + 1);
+    if (session->have == NULL) {
+        LOG_ERROR("Failed to allocate memory for bitfield");
+        picker_free(session->picker);
+        free(session->pieces);
+        free(session);
+        return NULL;
+    }
+    session->have->len = num_bytes;
+
+    session->storage = storage_create(torrent, backend);
+    if (session->storage == NULL) {
+        picker_free(session->picker);
+        free(session->have);
+        free(session->pieces);
+        free(session);
+        return NULL;
+    }
+
+    session->disk = disk_create(session->storage, 0);
+    if (session->disk == NULL) {
+        storage_free(session->storage);
+        picker_free(session->picker);
+        free(session->have);
+        free(session->pieces);
+        free(session);
+        return NULL;
+    }
+
+    session->cache = cache_create(session->disk, torrent->piece_length);
+    if (session->cache == NULL) {
+        disk_free(session->disk);
+        storage_free(session->storage);
+        picker_free(session->picker);
+        free(session->have);
+        free(session->pieces);
+        free(session);
+        return NULL;
+    }
+
+    session->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (session->epfd < 0) {
+        LOG_ERROR("Failed to create epoll instance: %s", strerror(errno));
+        cache_free(session->cache);
+        disk_free(session->disk);
+        storage_free(session->storage);
+        picker_free(session->picker);
+        free(session->have);
+        free(session->pieces);
+        free(session);
+        return NULL;
+    }
+
+    // Identified by its pointer like the hasher
+    struct epoll_event event = {
+        .events   = EPOLLIN,
+        .data.ptr = session->disk,
+    };
+
+    if (epoll_ctl(session->epfd, EPOLL_CTL_ADD, disk_fd(session->disk), &event)
+        != 0) {
+        LOG_ERROR("Failed to add disk to epoll: %s", strerror(errno));
+        close(session->epfd);
+        cache_free(session->cache);
+        disk_free(session->disk);
+        storage_free(session->storage);
+        picker_free(session->picker);
+        free(session->have);
+        free(session->pieces);
+        free(session);
+        return NULL;
+    }
+
+    session->torrent         = torrent;
+    session->peers           = peers;
+    session->next_peer       = list_iterator_first(peers);
+    session->num_connections = 0;
+    session->listener        = NULL;
+    session->last_tick       = 0;
+    session->last_rate_ms    = now_ms();
+    session->last_stats      = time(NULL);
+    session->queue_depth     = 0;
+    session->flush_queue     = NULL;
+    session->flush_len       = 0;
+    session->flush_cap       = 0;
+    session->endgame         = false;
+    session->hasher          = NULL;
+    session->hash_threads    = 0;
+    session->num_verifying   = 0;
+    session->max_memory      = SESSION_MAX_MEMORY;
+    session->mem_bytes       = 0;
+    session->throttled       = false;
+    session->failed          = false;
+    session->seed            = false;
+    session->num_unchoked    = 0;
+    session->optimistic      = NULL;
+    session->last_rechoke    = time(NULL);
+    session->last_optimistic = 0;
+    session->ranked          = NULL;
+    session->ranked_cap      = 0;
+    session->stop            = 0;
+    session->resume_path     = NULL;
+    session->last_resume     = time(NULL);
+    session->saving          = NULL;
+    session->active          = NULL;
+    session->num_active      = 0;
+    session->active_cap      = 0;
+
+    return session;
+}
+
+void session_set_queue_depth(session_t* session, uint32_t depth) {
+    if (session == NULL) {
+        LOG_WARN("Must provide a session");
+        return;
+    }
+
+    if (depth > PEER_MAX_QUEUE_DEPTH) {
+        LOG_WARN("Queue depth %u is too big, using %d", depth,
+                 PEER_MAX_QUEUE_DEPTH);
+        depth = PEER_MAX_QUEUE_DEPTH;
+    }
+
+    session->queue_depth = depth;
+}
+
+void session_set_hash_threads(session_t* session, size_t num_threads) {
+    if (session == NULL) {
+        LOG_WARN("Must provide a session");
+        return;
+    }
+
+    session->hash_threads = num_threads;
+}
+
+void session_set_max_memory(session_t* session, size_t max_memory) {
+    if (session == NULL) {
+        LOG_WARN("Must provide a session");
+        return;
+    }
+
+    session->max_memory = max_memory > 0 ? max_memory : SESSION_MAX_MEMORY;
+}
+
+int session_listen(session_t* session, uint16_t port) {
+    if (session == NULL) {
+        LOG_WARN("Must provide a session");
+        return -1;
+    }
+
+    if (session->listener != NULL) {
+        LOG_WARN("Session is already listening");
+        return -1;
+    }
+
+    listener_t* listener = listener_create(port);
+    if (listener == NULL) {
+        return -1;
+    }
+
+    // Identified by its pointer like the hasher and the disk
+    struct epoll_event event = {
+        .events   = EPOLLIN,
+        .data.ptr = listener,
+    };
+
+    if (epoll_ctl(session->epfd, EPOLL_CTL_ADD, listener_fd(listener), &event)
+        != 0) {
+        LOG_ERROR("Failed to add listener to epoll: %s", strerror(errno));
+        listener_free(listener);
+        return -1;
+    }
+
+    session->listener = listener;
+    return 0;
+}
+
+void session_set_seed(session_t* session, bool seed) {
+    if (session == NULL) {
+        LOG_WARN("Must provide a session");
+        return;
+    }
+
+    session->seed = seed;
+}
+
+void session_set_have(session_t* session, const byte_str_t* have) {
+    if (session == NULL || have == NULL) {
+        LOG_WARN("Must provide a session and a bitfield");
+        return;
+    }
+
+    for (uint32_t i = 0; i < session->torrent->num_pieces; ++i) {
+        uint32_t byte = i / CHAR_BIT;
+        uint8_t  bit  = i % CHAR_BIT;
+
+        if (byte < have->len
+            && (have->data[byte] & (1 << (CHAR_BIT - bit - 1))) != 0) {
+            picker_set_have(session->picker, i);
+            session->have->data[byte] |= 1 << (CHAR_BIT - bit - 1);
+        }
+    }
+}
+
+// Load the blocks of a partial piece back from disk
+static int session_resume_piece(session_t*            session,
+                                const resume_piece_t* saved) {
+    torrent_t* torrent = session->torrent;
+    uint32_t   index   = saved->index;
+
+    if (session->pieces[index] != NULL || session_has_piece(session, index)) {
+        LOG_WARN("Piece %u is resumed twice", index);
+        return 0;
+    }
+
+    piece_t* piece = session_create_piece(session, index);
+    if (piece == NULL) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < piece->num_blocks; ++i) {
+        if ((saved->blocks->data[i / CHAR_BIT]
+             & 1 << (CHAR_BIT - i % CHAR_BIT - 1))
+            == 0) {
+            continue;
+        }
+
+        uint32_t begin = i * BLOCK_SIZE;
+        if (!piece->mapped
+            && storage_read(session->storage,
+                            index * torrent->piece_length + begin,
+                            piece->data + begin, piece_block_length(piece, i))
+                   != 0) {
+            session_free_piece(session, piece);
+            return -1;
+        }
+
+        piece_receive_block(piece, i, NULL);
+        piece_mark_block_written(piece, i);
+    }
+
+    // Only pieces with missing blocks are saved, a complete one is simply
+    // downloaded again
+    if (piece_is_complete(piece)) {
+        session_free_piece(session, piece);
+        return 0;
+    }
+
+    if (session_add_piece(session, piece) != 0) {
+        session_free_piece(session, piece);
+        return -1;
+    }
+
+    picker_set_have(session->picker, index);
+    return 0;
+}
+
+int session_resume(session_t* session, const resume_t* resume) {
+    if (session == NULL || resume == NULL) {
+        LOG_WARN("Must provide a session and resume data");
+        return -1;
+    }
+
+    session_set_have(session, resume->have);
+
+    for (size_t i = 0; i < resume->num_pieces; ++i) {
+        if (session_resume_piece(session, &resume->pieces[i]) != 0) {
+            LOG_ERROR("Failed to resume piece %u", resume->pieces[i].index);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int session_set_resume_file(session_t* session, const char* path) {
+    if (session == NULL || path == NULL) {
+        LOG_WARN("Must provide a session and a path");
+        return -1;
+    }
+
+    char* copy = strdup(path);
+    if (copy == NULL) {
+        LOG_ERROR("Failed to allocate memory for path");
+        return -1;
+    }
+
+    free(session->resume_path);
+    session->resume_path = copy;
+    return 0;
+}
+
+int session_save_resume(session_t* session) {
+    if (session == NULL || session->resume_path == NULL) {
+        LOG_WARN("Must provide a session with a resume file");
+        return -1;
+    }
+
+    // The pieces marked as complete must be on disk, and a save in flight
+    // must be done
+    if (cache_sync(session->cache) != 0) {
+        LOG_ERROR("Failed to write cached pieces");
+        session->failed = true;
+        return -1;
+    }
+
+    resume_piece_t* pieces = NULL;
+    size_t          num    = 0;
+    int             ret    = 0;
+
+    if (session->num_active > 0) {
+        pieces = calloc(session->num_active, sizeof(resume_piece_t));
+        if (pieces == NULL) {
+            LOG_ERROR("Failed to allocate memory for %zu pieces",
+                      session->num_active);
+            return -1;
+        }
+    }
+
+    // Blocks are only kept in memory until the piece is verified, the ones
+    // already received are written now so they survive a restart
+    for (size_t i = 0; i < session->num_active && ret == 0; ++i) {
+        int saved = session_save_piece(session, session->active[i],
+                                       &pieces[num], NULL);
+        if (saved < 0) {
+            ret = -1;
+        } else {
+            num += saved;
+        }
+    }
+
+    if (ret == 0) {
+        ret = resume_save(session->resume_path, session->torrent,
+                          session->have, pieces, num);
+    }
+
+    for (size_t i = 0; i < num; ++i) {
+        free(pieces[i].blocks);
+    }
+    free(pieces);
+    return ret;
+}
+
+void session_stop(session_t* session) {
+    if (session != NULL) {
+        session->stop = 1;
+    }
+}
+
+int session_run(session_t* session) {
+    if (session == NULL) {
+        LOG_WARN("Must provide a session");
+        return -1;
+    }
+
+    if (session->hasher == NULL) {
+        session->hasher = hasher_create(session->hash_threads);
+        if (session->hasher == NULL) {
+            return -1;
+        }
+
+        // Identified by its pointer, every other event but the disk's and
+        // the listener's comes from a peer
+        struct epoll_event event = {
+            .events   = EPOLLIN,
+            .data.ptr = session->hasher,
+        };
+
+        if (epoll_ctl(session->epfd, EPOLL_CTL_ADD, hasher_fd(session->hasher),
+                      &event)
+            != 0) {
+            LOG_ERROR("Failed to add hasher to epoll: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    struct epoll_event events[SESSION_MAX_EVENTS];
+
+    session_connect_peers(session);
+
+    while (session->torrent->pieces_left > 0 || session->seed) {
+        if (session->failed) {
+            return -1;
+        }
+
+        bool complete = session->torrent->pieces_left == 0;
+        if (session->stop && complete) {
+            LOG_INFO("Stopping seeding");
+            break;
+        }
+
+        if (session->stop) {
+            LOG_INFO("Stopping with %zu/%zu pieces left",
+                     session->torrent->pieces_left,
+                     session->torrent->num_pieces);
+            return -1;
+        }
+
+        // A seed waits for peers to connect
+        if (!complete && session->num_connections == 0
+            && session->next_peer == NULL && session->num_verifying == 0) {
+            LOG_ERROR("Ran out of peers to download from");
+            return -1;
+        }
+
+        int n = epoll_wait(session->epfd, events, SESSION_MAX_EVENTS,
+                           SESSION_TICK_MS);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            LOG_ERROR("Failed to wait for events: %s", strerror(errno));
+            return -1;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.ptr == session->hasher) {
+                hasher_poll(session->hasher, session_piece_verified, session);
+                continue;
+            }
+
+            if (events[i].data.ptr == session->disk) {
+                disk_poll(session->disk);
+                session_pieces_written(session);
+                continue;
+            }
+
+            if (session->listener != NULL
+                && events[i].data.ptr == session->listener) {
+                session_accept_peers(session);
+                continue;
+            }
+
+            session_handle_event(session, events[i].data.ptr,
+                                 events[i].events);
+        }
+
+        session_tick(session);
+        session_flush_peers(session);
+    }
+
+    if (cache_sync(session->cache) != 0) {
+        LOG_ERROR("Failed to write cached pieces");
+        return -1;
+    }
+
+    return 0;
+}
+
+void session_free(session_t* session) {
+    if (session == NULL) {
+        LOG_WARN("Trying to free NULL session");
+        return;
+    }
+
+    close(session->epfd);
+
+    if (session->listener != NULL) {
+        listener_free(session->listener);
+    }
+
+    // Stops the hashing threads before the pieces they hold are freed
+    if (session->hasher != NULL) {
+        hasher_free(session->hasher);
+    }
+
+    // Peers close their own sockets
+    list_free(session->peers);
+    for (size_t i = 0; i < session->num_active; ++i) {
+        session_free_piece(session, session->active[i]);
+    }
+
+    // Writes in flight are completed first
+    disk_free(session->disk);
+    cache_free(session->cache);
+    picker_free(session->picker);
+    storage_free(session->storage);
+    free(session->have);
+    free(session->resume_path);
+    free(session->pieces);
+    free(session->active);
+    free(session->flush_queue);
+    free(session->ranked);
+    free(session);
+}
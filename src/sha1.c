@@ -1,6 +1,8 @@
 #include "sha1.h"
 
 #include "log.h"
+#include "sha1_mb.h"
+#include "sha1_x86.h"
 
 #include <assert.h>
 #include <stdint.h>
@@ -18,6 +20,9 @@ struct sha1_ctx {
 
 #define LEFT_ROTATE(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
 
+typedef void (*sha1_blocks_fn_t)(uint32_t state[5], const uint8_t* data,
+                                 size_t num_blocks);
+
 static void sha1_transform(uint32_t state[5], const uint8_t block[64]) {
     uint32_t w[80];
 
@@ -71,6 +76,108 @@ static void sha1_transform(uint32_t state[5], const uint8_t block[64]) {
     state[4] += e;
 }
 
+static void sha1_blocks_generic(uint32_t state[5], const uint8_t* data,
+                                size_t num_blocks) {
+    for (size_t i = 0; i < num_blocks; ++i) {
+        sha1_transform(state, data + i * 64);
+    }
+}
+
+static const struct {
+    const char*      name;
+    sha1_blocks_fn_t blocks;
+} sha1_impls[SHA1_IMPL_COUNT] = {
+    [SHA1_IMPL_GENERIC] = {"generic", sha1_blocks_generic},
+#if defined(__x86_64__) || defined(__i386__)
+    [SHA1_IMPL_SSSE3] = {"ssse3", sha1_blocks_ssse3},
+    [SHA1_IMPL_AVX2]  = {"avx2", sha1_blocks_avx2},
+    [SHA1_IMPL_SHANI] = {"sha-ni", sha1_blocks_shani},
+#else
+    [SHA1_IMPL_SSSE3] = {"ssse3", NULL},
+    [SHA1_IMPL_AVX2]  = {"avx2", NULL},
+    [SHA1_IMPL_SHANI] = {"sha-ni", NULL},
+#endif
+};
+
+static sha1_impl_t      sha1_impl   = SHA1_IMPL_GENERIC;
+static sha1_blocks_fn_t sha1_blocks = sha1_blocks_generic;
+
+static size_t              sha1_lanes        = 1;
+static sha1_mb_blocks_fn_t sha1_mb_blocks_fn = NULL;
+
+// Pick the fastest implementations once, before main runs
+__attribute__((constructor)) static void sha1_init(void) {
+    for (int impl = SHA1_IMPL_COUNT - 1; impl > SHA1_IMPL_GENERIC; --impl) {
+        if (sha1_set_impl(impl) == 0) {
+            break;
+        }
+    }
+
+    // SHA-NI beats four SSSE3 lanes per byte, not eight AVX2 ones
+    size_t lanes = sha1_mb_max_lanes();
+    if (sha1_impl != SHA1_IMPL_SHANI || lanes >= 8) {
+        sha1_set_lanes(lanes);
+    }
+}
+
+const char* sha1_impl_name(sha1_impl_t impl) {
+    if (impl >= SHA1_IMPL_COUNT) {
+        return "unknown";
+    }
+
+    return sha1_impls[impl].name;
+}
+
+bool sha1_impl_supported(sha1_impl_t impl) {
+    static const unsigned required[SHA1_IMPL_COUNT] = {
+        [SHA1_IMPL_GENERIC] = 0,
+        [SHA1_IMPL_SSSE3]   = SHA1_X86_SSSE3,
+        [SHA1_IMPL_AVX2]    = SHA1_X86_AVX2,
+        [SHA1_IMPL_SHANI]   = SHA1_X86_SHANI,
+    };
+
+    if (impl >= SHA1_IMPL_COUNT || sha1_impls[impl].blocks == NULL) {
+        return false;
+    }
+
+    return (sha1_x86_features() & required[impl]) == required[impl];
+}
+
+int sha1_set_impl(sha1_impl_t impl) {
+    if (!sha1_impl_supported(impl)) {
+        return -1;
+    }
+
+    sha1_impl   = impl;
+    sha1_blocks = sha1_impls[impl].blocks;
+    return 0;
+}
+
+sha1_impl_t sha1_get_impl(void) {
+    return sha1_impl;
+}
+
+int sha1_set_lanes(size_t lanes) {
+    if (lanes <= 1) {
+        sha1_lanes        = 1;
+        sha1_mb_blocks_fn = NULL;
+        return 0;
+    }
+
+    sha1_mb_blocks_fn_t blocks = sha1_mb_blocks(lanes);
+    if (blocks == NULL) {
+        return -1;
+    }
+
+    sha1_lanes        = lanes;
+    sha1_mb_blocks_fn = blocks;
+    return 0;
+}
+
+size_t sha1_get_lanes(void) {
+    return sha1_lanes;
+}
+
 sha1_ctx_t* sha1_create(void) {
     sha1_ctx_t* ctx = malloc(sizeof(sha1_ctx_t));
     if (ctx == NULL) {
@@ -95,13 +202,9 @@ void sha1_free(sha1_ctx_t* ctx) {
     free(ctx);
 }
 
-void sha1_update(sha1_ctx_t* ctx, const uint8_t* data, size_t size) {
-    if (ctx == NULL || data == NULL) {
-        LOG_WARN("Invalid SHA-1 context or data");
-        return;
-    }
-
-    uint32_t i = 0;
+// Add `size` bytes to the number of bits processed and return the byte offset
+// into the buffer before the update
+static uint32_t sha1_count(sha1_ctx_t* ctx, size_t size) {
     uint32_t j = ctx->count[0];
 
     // update the number of bits processed and check for overflow
@@ -114,7 +217,17 @@ void sha1_update(sha1_ctx_t* ctx, const uint8_t* data, size_t size) {
     ctx->count[1] += size >> 29;
 
     // byte offset into the buffer
-    j = (j >> 3) & 63;
+    return (j >> 3) & 63;
+}
+
+void sha1_update(sha1_ctx_t* ctx, const uint8_t* data, size_t size) {
+    if (ctx == NULL || data == NULL) {
+        LOG_WARN("Invalid SHA-1 context or data");
+        return;
+    }
+
+    size_t   i = 0;
+    uint32_t j = sha1_count(ctx, size);
 
     // if the buffer would overflow, process it
     if (j + size > 63) {
@@ -122,12 +235,14 @@ void sha1_update(sha1_ctx_t* ctx, const uint8_t* data, size_t size) {
         memcpy(&ctx->buffer[j], data, 64 - j);
 
         // process the buffer
-        sha1_transform(ctx->state, ctx->buffer);
+        sha1_blocks(ctx->state, ctx->buffer, 1);
 
-        // process the remaining 512-bit blocks of data
-        for (i = 64 - j; i + 63 < size; i += 64) {
-            sha1_transform(ctx->state, &data[i]);
-        }
+        // process the remaining 512-bit blocks of data in one call, so the
+        // vector implementations can work on several blocks at once
+        i                 = 64 - j;
+        size_t num_blocks = (size - i) / 64;
+        sha1_blocks(ctx->state, &data[i], num_blocks);
+        i += num_blocks * 64;
 
         j = 0;
     }
@@ -136,6 +251,137 @@ void sha1_update(sha1_ctx_t* ctx, const uint8_t* data, size_t size) {
     memcpy(&ctx->buffer[j], &data[i], size - i);
 }
 
+typedef struct {
+    sha1_ctx_t*    ctx;
+    const uint8_t* next;      // next block to hash
+    size_t         num_left;  // blocks left to hash
+    size_t         tail_size; // bytes after the last block, left to buffer
+} sha1_lane_t;
+
+/*
+ * Hand the next context with full blocks to hash to a lane. The bytes that
+ * complete a partially filled buffer and inputs shorter than a block go
+ * through sha1_update.
+ */
+static bool sha1_lane_fill(sha1_lane_t* lane, sha1_ctx_t* const ctx[],
+                           const uint8_t* const data[], const size_t size[],
+                           size_t count, size_t* next_job) {
+    while (*next_job < count) {
+        size_t         job    = (*next_job)++;
+        const uint8_t* bytes  = data[job];
+        size_t         length = size[job];
+        uint32_t       offset = (ctx[job]->count[0] >> 3) & 63;
+
+        if (offset != 0) {
+            size_t head = length < 64 - offset ? length : 64 - offset;
+            sha1_update(ctx[job], bytes, head);
+            bytes  += head;
+            length -= head;
+        }
+
+        size_t num_blocks = length / 64;
+        if (num_blocks == 0) {
+            sha1_update(ctx[job], bytes, length);
+            continue;
+        }
+
+        sha1_count(ctx[job], num_blocks * 64);
+        lane->ctx       = ctx[job];
+        lane->next      = bytes;
+        lane->num_left  = num_blocks;
+        lane->tail_size = length - num_blocks * 64;
+        return true;
+    }
+
+    return false;
+}
+
+void sha1_update_many(sha1_ctx_t* const ctx[], const uint8_t* const data[],
+                      const size_t size[], size_t count) {
+    if (ctx == NULL || data == NULL || size == NULL) {
+        LOG_WARN("Invalid SHA-1 contexts or data");
+        return;
+    }
+
+    size_t              lanes  = sha1_lanes;
+    sha1_mb_blocks_fn_t blocks = sha1_mb_blocks_fn;
+
+    if (lanes <= 1 || count < 2) {
+        for (size_t i = 0; i < count; ++i) {
+            sha1_update(ctx[i], data[i], size[i]);
+        }
+        return;
+    }
+
+    sha1_lane_t    lane[SHA1_MB_MAX_LANES] = {0};
+    uint32_t       state[5][SHA1_MB_MAX_LANES];
+    const uint8_t* next[SHA1_MB_MAX_LANES];
+    size_t         next_job = 0;
+
+    for (;;) {
+        // Refill the lanes that finished, the state is kept transposed
+        size_t num_active = 0;
+        size_t step       = SIZE_MAX;
+        size_t active     = 0;
+        for (size_t l = 0; l < lanes; ++l) {
+            if (lane[l].num_left == 0
+                && sha1_lane_fill(&lane[l], ctx, data, size, count,
+                                  &next_job)) {
+                for (int k = 0; k < 5; ++k) {
+                    state[k][l] = lane[l].ctx->state[k];
+                }
+            }
+
+            if (lane[l].num_left > 0) {
+                num_active++;
+                active = l;
+                if (lane[l].num_left < step) {
+                    step = lane[l].num_left;
+                }
+            }
+        }
+
+        if (num_active == 0) {
+            return;
+        }
+
+        // A single context left is faster on its own
+        if (num_active == 1 && next_job == count) {
+            sha1_ctx_t* last = lane[active].ctx;
+            for (int k = 0; k < 5; ++k) {
+                last->state[k] = state[k][active];
+            }
+
+            sha1_blocks(last->state, lane[active].next, lane[active].num_left);
+            sha1_update(last, lane[active].next + lane[active].num_left * 64,
+                        lane[active].tail_size);
+            return;
+        }
+
+        // Idle lanes hash the blocks of an active one, the result is dropped
+        for (size_t l = 0; l < lanes; ++l) {
+            next[l] = lane[l].num_left > 0 ? lane[l].next : lane[active].next;
+        }
+
+        blocks(state, next, step);
+
+        for (size_t l = 0; l < lanes; ++l) {
+            if (lane[l].num_left == 0) {
+                continue;
+            }
+
+            lane[l].next     += step * 64;
+            lane[l].num_left -= step;
+            if (lane[l].num_left == 0) {
+                for (int k = 0; k < 5; ++k) {
+                    lane[l].ctx->state[k] = state[k][l];
+                }
+                sha1_update(lane[l].ctx, lane[l].next, lane[l].tail_size);
+            }
+        }
+    }
+}
+
 void sha1_final(sha1_ctx_t* ctx, uint8_t digest[SHA1_DIGEST_SIZE]) {
     if (ctx == NULL || digest == NULL) {
         LOG_WARN("Invalid SHA-1 context or digest");
@@ -194,3 +440,38 @@ void sha1(const uint8_t* data, size_t size, uint8_t digest[SHA1_DIGEST_SIZE]) {
 
     sha1_free(ctx);
 }
+
+int sha1_many(const uint8_t* const data[], const size_t size[], size_t count,
+              uint8_t (*digests)[SHA1_DIGEST_SIZE]) {
+    sha1_ctx_t* ctx[SHA1_MB_MAX_LANES];
+
+    // One lane's worth of contexts at a time is enough to keep them all busy
+    for (size_t first = 0; first < count; first += SHA1_MB_MAX_LANES) {
+        size_t num = count - first;
+        if (num > SHA1_MB_MAX_LANES) {
+            num = SHA1_MB_MAX_LANES;
+        }
+
+        size_t created = 0;
+        while (created < num && (ctx[created] = sha1_create()) != NULL) {
+            created++;
+        }
+
+        if (created == num) {
+            sha1_update_many(ctx, data + first, size + first, num);
+            for (size_t i = 0; i < num; ++i) {
+                sha1_final(ctx[i], digests[first + i]);
+            }
+        }
+
+        for (size_t i = 0; i < created; ++i) {
+            sha1_free(ctx[i]);
+        }
+
+        if (created != num) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
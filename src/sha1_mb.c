@@ -0,0 +1,348 @@
+#include "sha1_mb.h"
+
+#include "sha1_x86.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#define K0 0x5A827999
+#define K1 0x6ED9EBA1
+#define K2 0x8F1BBCDC
+#define K3 0xCA62C1D6
+
+/*
+ * The rounds are the same for every vector width, they are written once with
+ * the V* operations, which each block function defines for its registers:
+ * - VT: the vector type
+ * - VADD, VXOR, VROL, VSET1: lane-wise operations
+ * - VCH, VPARITY, VMAJ: the round functions
+ *
+ * Only the last 16 message words are kept, w[t & 15] is word t.
+ */
+#define SHA1_MB_ROUND(t, f, k)                                                 \
+    do {                                                                       \
+        if ((t) >= 16) {                                                       \
+            w[(t) & 15]                                                        \
+                = VROL(VXOR(VXOR(w[((t) - 3) & 15], w[((t) - 8) & 15]),        \
+                            VXOR(w[((t) - 14) & 15], w[(t) & 15])),            \
+                       1);                                                     \
+        }                                                                      \
+        VT temp = VADD(VADD(VROL(a, 5), f(b, c, d)),                           \
+                       VADD(VADD(e, k), w[(t) & 15]));                         \
+        e       = d;                                                           \
+        d       = c;                                                           \
+        c       = VROL(b, 30);                                                 \
+        b       = a;                                                           \
+        a       = temp;                                                        \
+    } while (0)
+
+#define SHA1_MB_ROUNDS()                                                       \
+    do {                                                                       \
+        VT k = VSET1(K0);                                                      \
+        for (int t = 0; t < 20; ++t) {                                         \
+            SHA1_MB_ROUND(t, VCH, k);                                          \
+        }                                                                      \
+        k = VSET1(K1);                                                         \
+        for (int t = 20; t < 40; ++t) {                                        \
+            SHA1_MB_ROUND(t, VPARITY, k);                                      \
+        }                                                                      \
+        k = VSET1(K2);                                                         \
+        for (int t = 40; t < 60; ++t) {                                        \
+            SHA1_MB_ROUND(t, VMAJ, k);                                         \
+        }                                                                      \
+        k = VSET1(K3);                                                         \
+        for (int t = 60; t < 80; ++t) {                                        \
+            SHA1_MB_ROUND(t, VPARITY, k);                                      \
+        }                                                                      \
+    } while (0)
+
+// Four lanes, the words of each lane are transposed 4x4 at a time
+
+#define VT               __m128i
+#define VADD             _mm_add_epi32
+#define VXOR             _mm_xor_si128
+#define VROL(x, n)                                                             \
+    _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - n))
+#define VSET1            _mm_set1_epi32
+#define VCH(b, c, d)     VXOR(d, _mm_and_si128(b, VXOR(c, d)))
+#define VPARITY(b, c, d) VXOR(VXOR(b, c), d)
+#define VMAJ(b, c, d)                                                          \
+    _mm_or_si128(_mm_and_si128(b, c), _mm_and_si128(d, _mm_or_si128(b, c)))
+
+__attribute__((target("ssse3"))) static void
+sha1_mb_blocks_ssse3(uint32_t state[5][SHA1_MB_MAX_LANES],
+                     const uint8_t* const data[], size_t num_blocks) {
+    const __m128i bswap
+        = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+    VT a = _mm_loadu_si128((const __m128i*)state[0]);
+    VT b = _mm_loadu_si128((const __m128i*)state[1]);
+    VT c = _mm_loadu_si128((const __m128i*)state[2]);
+    VT d = _mm_loadu_si128((const __m128i*)state[3]);
+    VT e = _mm_loadu_si128((const __m128i*)state[4]);
+    VT w[16];
+
+    for (size_t block = 0; block < num_blocks; ++block) {
+        size_t offset = block * 64;
+
+        for (int q = 0; q < 4; ++q) {
+            VT r[4];
+            for (int lane = 0; lane < 4; ++lane) {
+                r[lane] = _mm_loadu_si128(
+                    (const __m128i*)(data[lane] + offset + q * 16));
+            }
+
+            VT t0 = _mm_unpacklo_epi32(r[0], r[1]);
+            VT t1 = _mm_unpackhi_epi32(r[0], r[1]);
+            VT t2 = _mm_unpacklo_epi32(r[2], r[3]);
+            VT t3 = _mm_unpackhi_epi32(r[2], r[3]);
+
+            w[q * 4 + 0] = _mm_shuffle_epi8(_mm_unpacklo_epi64(t0, t2), bswap);
+            w[q * 4 + 1] = _mm_shuffle_epi8(_mm_unpackhi_epi64(t0, t2), bswap);
+            w[q * 4 + 2] = _mm_shuffle_epi8(_mm_unpacklo_epi64(t1, t3), bswap);
+            w[q * 4 + 3] = _mm_shuffle_epi8(_mm_unpackhi_epi64(t1, t3), bswap);
+        }
+
+        VT sa = a, sb = b, sc = c, sd = d, se = e;
+        SHA1_MB_ROUNDS();
+        a = VADD(a, sa);
+        b = VADD(b, sb);
+        c = VADD(c, sc);
+        d = VADD(d, sd);
+        e = VADD(e, se);
+    }
+
+    _mm_storeu_si128((__m128i*)state[0], a);
+    _mm_storeu_si128((__m128i*)state[1], b);
+    _mm_storeu_si128((__m128i*)state[2], c);
+    _mm_storeu_si128((__m128i*)state[3], d);
+    _mm_storeu_si128((__m128i*)state[4], e);
+}
+
+#undef VT
+#undef VADD
+#undef VXOR
+#undef VROL
+#undef VSET1
+#undef VCH
+#undef VPARITY
+#undef VMAJ
+
+// Eight lanes, the words of each lane are transposed 8x8 at a time
+
+#define VT   __m256i
+#define VADD _mm256_add_epi32
+#define VXOR _mm256_xor_si256
+#define VROL(x, n)                                                             \
+    _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n))
+#define VSET1            _mm256_set1_epi32
+#define VCH(b, c, d)     VXOR(d, _mm256_and_si256(b, VXOR(c, d)))
+#define VPARITY(b, c, d) VXOR(VXOR(b, c), d)
+#define VMAJ(b, c, d)                                                          \
+    _mm256_or_si256(_mm256_and_si256(b, c),                                    \
+                    _mm256_and_si256(d, _mm256_or_si256(b, c)))
+
+__attribute__((target("avx2"))) static void
+sha1_mb_blocks_avx2(uint32_t state[5][SHA1_MB_MAX_LANES],
+                    const uint8_t* const data[], size_t num_blocks) {
+    const __m256i bswap = _mm256_set_epi8(
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3, 12, 13, 14, 15, 8,
+        9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+    VT a = _mm256_loadu_si256((const __m256i*)state[0]);
+    VT b = _mm256_loadu_si256((const __m256i*)state[1]);
+    VT c = _mm256_loadu_si256((const __m256i*)state[2]);
+    VT d = _mm256_loadu_si256((const __m256i*)state[3]);
+    VT e = _mm256_loadu_si256((const __m256i*)state[4]);
+    VT w[16];
+
+    for (size_t block = 0; block < num_blocks; ++block) {
+        size_t offset = block * 64;
+
+        for (int half = 0; half < 2; ++half) {
+            VT r[8], t[8], u[8];
+            for (int lane = 0; lane < 8; ++lane) {
+                r[lane] = _mm256_loadu_si256(
+                    (const __m256i*)(data[lane] + offset + half * 32));
+            }
+
+            for (int i = 0; i < 4; ++i) {
+                t[2 * i]     = _mm256_unpacklo_epi32(r[2 * i], r[2 * i + 1]);
+                t[2 * i + 1] = _mm256_unpackhi_epi32(r[2 * i], r[2 * i + 1]);
+            }
+
+            // u[i + j] holds word j (low half) and j + 4 (high half) of
+            // lanes i to i + 3
+            for (int i = 0; i < 8; i += 4) {
+                u[i]     = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+                u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+                u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+                u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+            }
+
+            for (int j = 0; j < 4; ++j) {
+                w[half * 8 + j] = _mm256_shuffle_epi8(
+                    _mm256_permute2x128_si256(u[j], u[4 + j], 0x20), bswap);
+                w[half * 8 + j + 4] = _mm256_shuffle_epi8(
+                    _mm256_permute2x128_si256(u[j], u[4 + j], 0x31), bswap);
+            }
+        }
+
+        VT sa = a, sb = b, sc = c, sd = d, se = e;
+        SHA1_MB_ROUNDS();
+        a = VADD(a, sa);
+        b = VADD(b, sb);
+        c = VADD(c, sc);
+        d = VADD(d, sd);
+        e = VADD(e, se);
+    }
+
+    _mm256_storeu_si256((__m256i*)state[0], a);
+    _mm256_storeu_si256((__m256i*)state[1], b);
+    _mm256_storeu_si256((__m256i*)state[2], c);
+    _mm256_storeu_si256((__m256i*)state[3], d);
+    _mm256_storeu_si256((__m256i*)state[4], e);
+}
+
+#undef VT
+#undef VADD
+#undef VXOR
+#undef VROL
+#undef VSET1
+#undef VCH
+#undef VPARITY
+#undef VMAJ
+
+// Sixteen lanes, the round functions are a single ternary logic instruction
+
+#define VT               __m512i
+#define VADD             _mm512_add_epi32
+#define VXOR             _mm512_xor_si512
+#define VROL             _mm512_rol_epi32
+#define VSET1            _mm512_set1_epi32
+#define VCH(b, c, d)     _mm512_ternarylogic_epi32(b, c, d, 0xCA)
+#define VPARITY(b, c, d) _mm512_ternarylogic_epi32(b, c, d, 0x96)
+#define VMAJ(b, c, d)    _mm512_ternarylogic_epi32(b, c, d, 0xE8)
+
+__attribute__((target("avx512f,avx512bw"))) static void
+sha1_mb_blocks_avx512(uint32_t state[5][SHA1_MB_MAX_LANES],
+                      const uint8_t* const data[], size_t num_blocks) {
+    const __m512i bswap = _mm512_broadcast_i32x4(
+        _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3));
+
+    VT a = _mm512_loadu_si512(state[0]);
+    VT b = _mm512_loadu_si512(state[1]);
+    VT c = _mm512_loadu_si512(state[2]);
+    VT d = _mm512_loadu_si512(state[3]);
+    VT e = _mm512_loadu_si512(state[4]);
+    VT w[16];
+
+    for (size_t block = 0; block < num_blocks; ++block) {
+        size_t offset = block * 64;
+        VT     r[16], t[16], u[16];
+
+        for (int lane = 0; lane < 16; ++lane) {
+            r[lane] = _mm512_loadu_si512(data[lane] + offset);
+        }
+
+        for (int i = 0; i < 8; ++i) {
+            t[2 * i]     = _mm512_unpacklo_epi32(r[2 * i], r[2 * i + 1]);
+            t[2 * i + 1] = _mm512_unpackhi_epi32(r[2 * i], r[2 * i + 1]);
+        }
+
+        // 128-bit chunk k of u[4i + j] holds word 4k + j of lanes 4i to 4i + 3
+        for (int i = 0; i < 4; ++i) {
+            u[4 * i]     = _mm512_unpacklo_epi64(t[4 * i], t[4 * i + 2]);
+            u[4 * i + 1] = _mm512_unpackhi_epi64(t[4 * i], t[4 * i + 2]);
+            u[4 * i + 2] = _mm512_unpacklo_epi64(t[4 * i + 1], t[4 * i + 3]);
+            u[4 * i + 3] = _mm512_unpackhi_epi64(t[4 * i + 1], t[4 * i + 3]);
+        }
+
+        for (int j = 0; j < 4; ++j) {
+            // Chunks 0 and 2 of lanes 0-3 and 4-7, then 1 and 3
+            VT lo_even = _mm512_shuffle_i32x4(u[j], u[4 + j], 0x88);
+            VT lo_odd  = _mm512_shuffle_i32x4(u[j], u[4 + j], 0xDD);
+            VT hi_even = _mm512_shuffle_i32x4(u[8 + j], u[12 + j], 0x88);
+            VT hi_odd  = _mm512_shuffle_i32x4(u[8 + j], u[12 + j], 0xDD);
+
+            w[j] = _mm512_shuffle_epi8(
+                _mm512_shuffle_i32x4(lo_even, hi_even, 0x88), bswap);
+            w[4 + j] = _mm512_shuffle_epi8(
+                _mm512_shuffle_i32x4(lo_odd, hi_odd, 0x88), bswap);
+            w[8 + j] = _mm512_shuffle_epi8(
+                _mm512_shuffle_i32x4(lo_even, hi_even, 0xDD), bswap);
+            w[12 + j] = _mm512_shuffle_epi8(
+                _mm512_shuffle_i32x4(lo_odd, hi_odd, 0xDD), bswap);
+        }
+
+        VT sa = a, sb = b, sc = c, sd = d, se = e;
+        SHA1_MB_ROUNDS();
+        a = VADD(a, sa);
+        b = VADD(b, sb);
+        c = VADD(c, sc);
+        d = VADD(d, sd);
+        e = VADD(e, se);
+    }
+
+    _mm512_storeu_si512(state[0], a);
+    _mm512_storeu_si512(state[1], b);
+    _mm512_storeu_si512(state[2], c);
+    _mm512_storeu_si512(state[3], d);
+    _mm512_storeu_si512(state[4], e);
+}
+
+#undef VT
+#undef VADD
+#undef VXOR
+#undef VROL
+#undef VSET1
+#undef VCH
+#undef VPARITY
+#undef VMAJ
+
+size_t sha1_mb_max_lanes(void) {
+    unsigned features = sha1_x86_features();
+
+    if (features & SHA1_X86_AVX512) {
+        return 16;
+    }
+
+    if (features & SHA1_X86_AVX2) {
+        return 8;
+    }
+
+    if (features & SHA1_X86_SSSE3) {
+        return 4;
+    }
+
+    return 1;
+}
+
+sha1_mb_blocks_fn_t sha1_mb_blocks(size_t lanes) {
+    unsigned features = sha1_x86_features();
+
+    switch (lanes) {
+    case 4:
+        return features & SHA1_X86_SSSE3 ? sha1_mb_blocks_ssse3 : NULL;
+    case 8:
+        return features & SHA1_X86_AVX2 ? sha1_mb_blocks_avx2 : NULL;
+    case 16:
+        return features & SHA1_X86_AVX512 ? sha1_mb_blocks_avx512 : NULL;
+    default:
+        return NULL;
+    }
+}
+
+#else
+
+size_t sha1_mb_max_lanes(void) {
+    return 1;
+}
+
+sha1_mb_blocks_fn_t sha1_mb_blocks(size_t lanes) {
+    (void)lanes;
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,302 @@
+#include "sha1_x86.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <stdbool.h>
+#include <immintrin.h>
+
+#define LEFT_ROTATE(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define K0 0x5A827999
+#define K1 0x6ED9EBA1
+#define K2 0x8F1BBCDC
+#define K3 0xCA62C1D6
+
+unsigned sha1_x86_features(void) {
+    unsigned eax, ebx, ecx, edx;
+    unsigned features = 0;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+
+    bool ssse3  = ecx & bit_SSSE3;
+    bool sse41  = ecx & bit_SSE4_1;
+    bool avx_os    = false;
+    bool avx512_os = false;
+
+    // The OS must save the YMM (and ZMM) registers for AVX to be usable
+    if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+        uint32_t xcr0_lo, xcr0_hi;
+        __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        avx_os    = (xcr0_lo & 0x6) == 0x6;
+        avx512_os = (xcr0_lo & 0xE6) == 0xE6;
+    }
+
+    if (ssse3) {
+        features |= SHA1_X86_SSSE3;
+    }
+
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        if (avx_os && (ebx & bit_AVX2)) {
+            features |= SHA1_X86_AVX2;
+        }
+
+        if (avx512_os && (ebx & bit_AVX512F) && (ebx & bit_AVX512BW)) {
+            features |= SHA1_X86_AVX512;
+        }
+
+        if (ssse3 && sse41 && (ebx & bit_SHA)) {
+            features |= SHA1_X86_SHANI;
+        }
+    }
+
+    return features;
+}
+
+// The 80 rounds, with the message schedule already added to the constants
+static inline void sha1_rounds(uint32_t state[5], const uint32_t wk[80]) {
+    uint32_t a = state[0];
+    uint32_t b = state[1];
+    uint32_t c = state[2];
+    uint32_t d = state[3];
+    uint32_t e = state[4];
+    uint32_t temp;
+
+#define SHA1_ROUND(f)                                                          \
+    temp = LEFT_ROTATE(a, 5) + (f) + e + wk[i];                                \
+    e    = d;                                                                  \
+    d    = c;                                                                  \
+    c    = LEFT_ROTATE(b, 30);                                                 \
+    b    = a;                                                                  \
+    a    = temp
+
+    for (int i = 0; i < 20; i++) {
+        SHA1_ROUND((b & c) | (~b & d));
+    }
+
+    for (int i = 20; i < 40; i++) {
+        SHA1_ROUND(b ^ c ^ d);
+    }
+
+    for (int i = 40; i < 60; i++) {
+        SHA1_ROUND((b & c) | (b & d) | (c & d));
+    }
+
+    for (int i = 60; i < 80; i++) {
+        SHA1_ROUND(b ^ c ^ d);
+    }
+
+#undef SHA1_ROUND
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+static inline uint32_t sha1_k(int group) {
+    static const uint32_t k[4] = {K0, K1, K2, K3};
+    return k[group / 5];
+}
+
+/*
+ * Message schedule, four words per vector, w[g] holds words 4g to 4g + 3:
+ * - words 16 to 31 use W[i] = rol1(W[i-3] ^ W[i-8] ^ W[i-14] ^ W[i-16]), the
+ *   last word of a vector depends on the first one so it is fixed afterwards
+ * - words 32 to 79 use the equivalent W[i] = rol2(W[i-6] ^ W[i-16] ^ W[i-28]
+ *   ^ W[i-32]), which has no dependency inside a vector
+ */
+__attribute__((target("ssse3"))) static inline __m128i
+sha1_rol_128(__m128i x, int n) {
+    return _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - n));
+}
+
+__attribute__((target("ssse3"))) void
+sha1_blocks_ssse3(uint32_t state[5], const uint8_t* data, size_t num_blocks) {
+    const __m128i bswap
+        = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+    __m128i  w[20];
+    uint32_t wk[80] __attribute__((aligned(16)));
+
+    for (size_t block = 0; block < num_blocks; ++block, data += 64) {
+        for (int g = 0; g < 20; ++g) {
+            if (g < 4) {
+                w[g] = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i*)(data + g * 16)), bswap);
+            } else if (g < 8) {
+                __m128i tmp = _mm_xor_si128(
+                    _mm_xor_si128(w[g - 4],
+                                  _mm_alignr_epi8(w[g - 3], w[g - 4], 8)),
+                    _mm_xor_si128(w[g - 2], _mm_srli_si128(w[g - 1], 4)));
+
+                w[g] = _mm_xor_si128(
+                    sha1_rol_128(tmp, 1),
+                    _mm_slli_si128(sha1_rol_128(tmp, 2), 12));
+            } else {
+                __m128i tmp = _mm_xor_si128(
+                    _mm_xor_si128(_mm_alignr_epi8(w[g - 1], w[g - 2], 8),
+                                  w[g - 4]),
+                    _mm_xor_si128(w[g - 7], w[g - 8]));
+
+                w[g] = sha1_rol_128(tmp, 2);
+            }
+
+            _mm_store_si128((__m128i*)(wk + g * 4),
+                            _mm_add_epi32(w[g], _mm_set1_epi32(sha1_k(g))));
+        }
+
+        sha1_rounds(state, wk);
+    }
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+sha1_rol_256(__m256i x, int n) {
+    return _mm256_or_si256(_mm256_slli_epi32(x, n),
+                           _mm256_srli_epi32(x, 32 - n));
+}
+
+// Same schedule as sha1_blocks_ssse3, with one block in each 128-bit lane
+__attribute__((target("avx2"))) void
+sha1_blocks_avx2(uint32_t state[5], const uint8_t* data, size_t num_blocks) {
+    const __m256i bswap = _mm256_set_epi8(
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3, 12, 13, 14, 15, 8,
+        9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+    __m256i  w[20];
+    uint32_t wk[2][80] __attribute__((aligned(32)));
+
+    for (size_t block = 0; block < num_blocks; block += 2) {
+        const uint8_t* first  = data + block * 64;
+        const uint8_t* second = block + 1 < num_blocks ? first + 64 : first;
+
+        for (int g = 0; g < 20; ++g) {
+            if (g < 4) {
+                w[g] = _mm256_shuffle_epi8(
+                    _mm256_inserti128_si256(
+                        _mm256_castsi128_si256(
+                            _mm_loadu_si128((const __m128i*)(first + g * 16))),
+                        _mm_loadu_si128((const __m128i*)(second + g * 16)), 1),
+                    bswap);
+            } else if (g < 8) {
+                __m256i tmp = _mm256_xor_si256(
+                    _mm256_xor_si256(w[g - 4],
+                                     _mm256_alignr_epi8(w[g - 3], w[g - 4], 8)),
+                    _mm256_xor_si256(w[g - 2], _mm256_srli_si256(w[g - 1], 4)));
+
+                w[g] = _mm256_xor_si256(
+                    sha1_rol_256(tmp, 1),
+                    _mm256_slli_si256(sha1_rol_256(tmp, 2), 12));
+            } else {
+                __m256i tmp = _mm256_xor_si256(
+                    _mm256_xor_si256(_mm256_alignr_epi8(w[g - 1], w[g - 2], 8),
+                                     w[g - 4]),
+                    _mm256_xor_si256(w[g - 7], w[g - 8]));
+
+                w[g] = sha1_rol_256(tmp, 2);
+            }
+
+            __m256i sum = _mm256_add_epi32(w[g], _mm256_set1_epi32(sha1_k(g)));
+            _mm_store_si128((__m128i*)(wk[0] + g * 4),
+                            _mm256_castsi256_si128(sum));
+            _mm_store_si128((__m128i*)(wk[1] + g * 4),
+                            _mm256_extracti128_si256(sum, 1));
+        }
+
+        sha1_rounds(state, wk[0]);
+        if (block + 1 < num_blocks) {
+            sha1_rounds(state, wk[1]);
+        }
+    }
+}
+
+/*
+ * Four rounds per sha1rnds4, so 20 groups of four rounds. Group g uses the
+ * message words in msg[g % 4], which sha1msg1, xor and sha1msg2 turn into the
+ * words of group g + 4 over the following groups. The fifth state word is
+ * carried in e[] and added to the message by sha1nexte.
+ */
+#define SHA1_NI_GROUP(g)                                                       \
+    do {                                                                       \
+        if ((g) == 0) {                                                        \
+            e[0] = _mm_add_epi32(e[0], msg[0]);                                \
+        } else {                                                               \
+            e[(g) & 1] = _mm_sha1nexte_epu32(e[(g) & 1], msg[(g) & 3]);        \
+        }                                                                      \
+        e[((g) + 1) & 1] = abcd;                                               \
+        if ((g) >= 3 && (g) <= 18) {                                           \
+            msg[((g) + 1) & 3]                                                 \
+                = _mm_sha1msg2_epu32(msg[((g) + 1) & 3], msg[(g) & 3]);        \
+        }                                                                      \
+        abcd = _mm_sha1rnds4_epu32(abcd, e[(g) & 1], (g) / 5);                 \
+        if ((g) >= 1 && (g) <= 16) {                                           \
+            msg[((g) + 3) & 3]                                                 \
+                = _mm_sha1msg1_epu32(msg[((g) + 3) & 3], msg[(g) & 3]);        \
+        }                                                                      \
+        if ((g) >= 2 && (g) <= 17) {                                           \
+            msg[((g) + 2) & 3]                                                 \
+                = _mm_xor_si128(msg[((g) + 2) & 3], msg[(g) & 3]);             \
+        }                                                                      \
+    } while (0)
+
+__attribute__((target("sha,sse4.1"))) void
+sha1_blocks_shani(uint32_t state[5], const uint8_t* data, size_t num_blocks) {
+    const __m128i bswap
+        = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+    // Words are kept in reverse order, a in the highest lane
+    __m128i abcd = _mm_shuffle_epi32(
+        _mm_loadu_si128((const __m128i*)state), 0x1B);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    for (size_t block = 0; block < num_blocks; ++block, data += 64) {
+        __m128i abcd_save = abcd;
+        __m128i e_save    = e0;
+        __m128i e[2]      = {e0, e0};
+        __m128i msg[4];
+
+        for (int i = 0; i < 4; ++i) {
+            msg[i] = _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i*)(data + i * 16)), bswap);
+        }
+
+        SHA1_NI_GROUP(0);
+        SHA1_NI_GROUP(1);
+        SHA1_NI_GROUP(2);
+        SHA1_NI_GROUP(3);
+        SHA1_NI_GROUP(4);
+        SHA1_NI_GROUP(5);
+        SHA1_NI_GROUP(6);
+        SHA1_NI_GROUP(7);
+        SHA1_NI_GROUP(8);
+        SHA1_NI_GROUP(9);
+        SHA1_NI_GROUP(10);
+        SHA1_NI_GROUP(11);
+        SHA1_NI_GROUP(12);
+        SHA1_NI_GROUP(13);
+        SHA1_NI_GROUP(14);
+        SHA1_NI_GROUP(15);
+        SHA1_NI_GROUP(16);
+        SHA1_NI_GROUP(17);
+        SHA1_NI_GROUP(18);
+        SHA1_NI_GROUP(19);
+
+        // Group 19 left the state of round 76 in e[0]
+        e0   = _mm_sha1nexte_epu32(e[0], e_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+#else
+
+unsigned sha1_x86_features(void) {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,540 @@
+#include "storage.h"
+
+#include "file.h"
+#include "list.h"
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Buffers passed to a single pwritev, more are split in several calls
+#define STORAGE_MAX_IOV 64
+
+// A window of a file mapped by the mmap backend
+typedef struct storage_window {
+    uint8_t* map; // NULL if not mapped
+    size_t   length;
+    uint32_t pins; // users of the mapping, it can't be unmapped
+
+    struct storage_window* lru_prev;
+    struct storage_window* lru_next;
+} storage_window_t;
+
+struct storage {
+    storage_backend_t backend;
+
+    file_t** files;
+    size_t   num_files;
+
+    // Offset of each file in the torrent data, followed by the total size so
+    // file `i` spans [offsets[i], offsets[i + 1])
+    uint64_t* offsets;
+
+    // Windows of every file, those of file `i` start at first_window[i].
+    // Mapped ones are also kept most recently used first.
+    storage_window_t* windows;
+    size_t*           first_window;
+    size_t            mapped; // bytes mapped
+    storage_window_t* lru_head;
+    storage_window_t* lru_tail;
+    pthread_mutex_t   lock;
+};
+
+static int storage_create_windows(storage_t* storage) {
+    storage->first_window = malloc((storage->num_files + 1) * sizeof(size_t));
+    if (storage->first_window == NULL) {
+        LOG_ERROR("Failed to allocate memory for windows");
+        return -1;
+    }
+
+    size_t num_windows = 0;
+    for (size_t i = 0; i < storage->num_files; ++i) {
+        uint64_t size = storage->offsets[i + 1] - storage->offsets[i];
+
+        storage->first_window[i] = num_windows;
+        num_windows += (size + STORAGE_WINDOW_SIZE - 1) / STORAGE_WINDOW_SIZE;
+    }
+    storage->first_window[storage->num_files] = num_windows;
+
+    storage->windows = calloc(num_windows, sizeof(storage_window_t));
+    if (storage->windows == NULL && num_windows > 0) {
+        LOG_ERROR("Failed to allocate memory for %zu windows", num_windows);
+        return -1;
+    }
+
+    LOG_DEBUG("Mapping files in %zu windows of %d MiB", num_windows,
+              STORAGE_WINDOW_SIZE >> 20);
+    return 0;
+}
+
+storage_t* storage_create(torrent_t* torrent, storage_backend_t backend) {
+    if (torrent == NULL) {
+        LOG_WARN("Must provide a torrent");
+        return NULL;
+    }
+
+    storage_t* storage = calloc(1, sizeof(storage_t));
+    if (storage == NULL) {
+        LOG_ERROR("Failed to allocate memory for storage");
+        return NULL;
+    }
+
+    storage->backend   = backend;
+    storage->num_files = list_size(torrent->files);
+    storage->files     = malloc(storage->num_files * sizeof(file_t*));
+    storage->offsets   = malloc((storage->num_files + 1) * sizeof(uint64_t));
+    if (storage->files == NULL || storage->offsets == NULL) {
+        LOG_ERROR("Failed to allocate memory for %zu files",
+                  storage->num_files);
+        free(storage->files);
+        free(storage->offsets);
+        free(storage);
+        return NULL;
+    }
+
+    uint64_t offset = 0;
+    size_t   i      = 0;
+    for (const list_iterator_t* it = list_iterator_first(torrent->files);
+         it != NULL; it            = list_iterator_next(it), ++i) {
+        storage->files[i]   = *(file_t**)list_iterator_get(it);
+        storage->offsets[i] = offset;
+        offset += get_file_size(storage->files[i]);
+    }
+    storage->offsets[i] = offset;
+
+    if (offset != torrent->total_down) {
+        LOG_WARN("Files hold %lu bytes, the torrent %lu", offset,
+                 torrent->total_down);
+    }
+
+    if (backend == STORAGE_BACKEND_MMAP
+        && storage_create_windows(storage) != 0) {
+        free(storage->first_window);
+        free(storage->files);
+        free(storage->offsets);
+        free(storage);
+        return NULL;
+    }
+
+    pthread_mutex_init(&storage->lock, NULL);
+    return storage;
+}
+
+void storage_free(storage_t* storage) {
+    if (storage == NULL) {
+        LOG_WARN("Trying to free NULL storage");
+        return;
+    }
+
+    // Dirty pages are written back by the kernel once unmapped
+    for (storage_window_t* w = storage->lru_head; w != NULL; w = w->lru_next) {
+        munmap(w->map, w->length);
+    }
+
+    pthread_mutex_destroy(&storage->lock);
+    free(storage->windows);
+    free(storage->first_window);
+    free(storage->files);
+    free(storage->offsets);
+    free(storage);
+}
+
+int storage_backend_parse(const char* name, storage_backend_t* backend) {
+    if (name == NULL || backend == NULL) {
+        LOG_WARN("Must provide a name and a backend");
+        return -1;
+    }
+
+    if (strcmp(name, "pwrite") == 0) {
+        *backend = STORAGE_BACKEND_PWRITE;
+    } else if (strcmp(name, "mmap") == 0) {
+        *backend = STORAGE_BACKEND_MMAP;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Index of the non-empty file holding the byte at `offset`
+static size_t storage_find_file(const storage_t* storage, uint64_t offset) {
+    size_t low  = 0;
+    size_t high = storage->num_files;
+
+    // Last file starting at or before `offset`, empty files starting at the
+    // same offset come before it
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+        if (storage->offsets[mid] <= offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+size_t storage_map(const storage_t* storage, uint64_t offset, uint64_t length,
+                   storage_span_t* spans, size_t max_spans) {
+    if (storage == NULL || spans == NULL) {
+        LOG_WARN("Must provide a storage and spans");
+        return 0;
+    }
+
+    if (offset + length > storage->offsets[storage->num_files]
+        || length == 0) {
+        LOG_ERROR("Range %lu+%lu is out of bounds", offset, length);
+        return 0;
+    }
+
+    size_t num = 0;
+    for (size_t i = storage_find_file(storage, offset); length > 0; ++i) {
+        uint64_t end = storage->offsets[i + 1];
+        if (end == storage->offsets[i]) {
+            continue;
+        }
+
+        if (num == max_spans) {
+            return 0;
+        }
+
+        uint64_t n = end - offset < length ? end - offset : length;
+        spans[num++] = (storage_span_t){
+            .file   = i,
+            .offset = offset - storage->offsets[i],
+            .length = n,
+        };
+
+        offset += n;
+        length -= n;
+    }
+
+    return num;
+}
+
+static void storage_lru_unlink(storage_t* storage, storage_window_t* w) {
+    if (w->lru_prev != NULL) {
+        w->lru_prev->lru_next = w->lru_next;
+    } else {
+        storage->lru_head = w->lru_next;
+    }
+
+    if (w->lru_next != NULL) {
+        w->lru_next->lru_prev = w->lru_prev;
+    } else {
+        storage->lru_tail = w->lru_prev;
+    }
+
+    w->lru_prev = NULL;
+    w->lru_next = NULL;
+}
+
+static void storage_lru_push(storage_t* storage, storage_window_t* w) {
+    w->lru_prev = NULL;
+    w->lru_next = storage->lru_head;
+    if (storage->lru_head != NULL) {
+        storage->lru_head->lru_prev = w;
+    } else {
+        storage->lru_tail = w;
+    }
+
+    storage->lru_head = w;
+}
+
+// Unmap the least recently used window that is not in use
+static bool storage_evict(storage_t* storage) {
+    for (storage_window_t* w = storage->lru_tail; w != NULL; w = w->lru_prev) {
+        if (w->pins == 0) {
+            storage_lru_unlink(storage, w);
+            munmap(w->map, w->length);
+            storage->mapped -= w->length;
+            w->map = NULL;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Pin the window of file `i` holding `file_offset`, mapping it if needed.
+ * Windows are unmapped once more than STORAGE_MAX_MAPPED bytes are mapped,
+ * unless they are all pinned.
+ */
+static storage_window_t* storage_window_pin(storage_t* storage, size_t i,
+                                            uint64_t file_offset) {
+    uint64_t index = file_offset / STORAGE_WINDOW_SIZE;
+    uint64_t start = index * STORAGE_WINDOW_SIZE;
+    uint64_t size  = storage->offsets[i + 1] - storage->offsets[i];
+
+    storage_window_t* w = &storage->windows[storage->first_window[i] + index];
+
+    pthread_mutex_lock(&storage->lock);
+
+    if (w->map != NULL) {
+        storage_lru_unlink(storage, w);
+    } else {
+        w->length = size - start < STORAGE_WINDOW_SIZE ? size - start
+                                                       : STORAGE_WINDOW_SIZE;
+
+        while (storage->mapped + w->length > STORAGE_MAX_MAPPED
+               && storage_evict(storage)) {
+        }
+
+        w->map = map_file(storage->files[i], start, w->length);
+        if (w->map == NULL) {
+            pthread_mutex_unlock(&storage->lock);
+            return NULL;
+        }
+        storage->mapped += w->length;
+    }
+
+    storage_lru_push(storage, w);
+    w->pins++;
+
+    pthread_mutex_unlock(&storage->lock);
+    return w;
+}
+
+static void storage_window_unpin(storage_t* storage, storage_window_t* w) {
+    pthread_mutex_lock(&storage->lock);
+    w->pins--;
+    pthread_mutex_unlock(&storage->lock);
+}
+
+uint8_t* storage_pin(storage_t* storage, uint64_t offset, size_t length) {
+    if (storage == NULL || storage->backend != STORAGE_BACKEND_MMAP
+        || length == 0
+        || offset + length > storage->offsets[storage->num_files]) {
+        return NULL;
+    }
+
+    size_t   i           = storage_find_file(storage, offset);
+    uint64_t file_offset = offset - storage->offsets[i];
+
+    // The range must be contiguous in memory
+    if (offset + length > storage->offsets[i + 1]
+        || file_offset / STORAGE_WINDOW_SIZE
+               != (file_offset + length - 1) / STORAGE_WINDOW_SIZE) {
+        return NULL;
+    }
+
+    storage_window_t* w = storage_window_pin(storage, i, file_offset);
+    if (w == NULL) {
+        return NULL;
+    }
+
+    return w->map + file_offset % STORAGE_WINDOW_SIZE;
+}
+
+void storage_unpin(storage_t* storage, uint64_t offset) {
+    if (storage == NULL || storage->backend != STORAGE_BACKEND_MMAP) {
+        LOG_WARN("Must provide a storage with the mmap backend");
+        return;
+    }
+
+    size_t   i           = storage_find_file(storage, offset);
+    uint64_t file_offset = offset - storage->offsets[i];
+    uint64_t index       = file_offset / STORAGE_WINDOW_SIZE;
+
+    storage_window_unpin(storage,
+                         &storage->windows[storage->first_window[i] + index]);
+}
+
+// Copy `length` bytes between a file and memory through its windows
+static int storage_copy(storage_t* storage, size_t i, uint64_t file_offset,
+                        uint8_t* data, size_t length, bool write) {
+    while (length > 0) {
+        storage_window_t* w = storage_window_pin(storage, i, file_offset);
+        if (w == NULL) {
+            return -1;
+        }
+
+        size_t start = file_offset % STORAGE_WINDOW_SIZE;
+        size_t n     = w->length - start < length ? w->length - start : length;
+        if (write) {
+            memcpy(w->map + start, data, n);
+        } else {
+            memcpy(data, w->map + start, n);
+        }
+
+        storage_window_unpin(storage, w);
+
+        file_offset += n;
+        data += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+// Write `length` bytes of the buffers, from the position `*idx`/`*skip`, to
+// file `i` and advance the position
+static int storage_write_file(storage_t* storage, size_t i,
+                              uint64_t file_offset, uint64_t length,
+                              const struct iovec* iov, int* idx,
+                              size_t* skip) {
+    while (length > 0) {
+        struct iovec chunk[STORAGE_MAX_IOV];
+        int          num   = 0;
+        uint64_t     bytes = 0;
+
+        for (; num < STORAGE_MAX_IOV && bytes < length; ++num) {
+            size_t n = iov[*idx].iov_len - *skip;
+            if (n > length - bytes) {
+                n = length - bytes;
+            }
+
+            chunk[num] = (struct iovec){
+                .iov_base = (uint8_t*)iov[*idx].iov_base + *skip,
+                .iov_len  = n,
+            };
+            bytes += n;
+
+            *skip += n;
+            if (*skip == iov[*idx].iov_len) {
+                (*idx)++;
+                *skip = 0;
+            }
+        }
+
+        if (storage->backend == STORAGE_BACKEND_MMAP) {
+            for (int j = 0; j < num; ++j) {
+                if (storage_copy(storage, i, file_offset, chunk[j].iov_base,
+                                 chunk[j].iov_len, true)
+                    != 0) {
+                    return -1;
+                }
+                file_offset += chunk[j].iov_len;
+            }
+        } else {
+            if (writev_data_to_file(storage->files[i], file_offset, chunk, num)
+                != 0) {
+                return -1;
+            }
+            file_offset += bytes;
+        }
+
+        length -= bytes;
+    }
+
+    return 0;
+}
+
+int storage_writev(storage_t* storage, uint64_t offset,
+                   const struct iovec* iov, int iovcnt) {
+    if (storage == NULL || iov == NULL) {
+        LOG_WARN("Must provide a storage and buffers");
+        return -1;
+    }
+
+    uint64_t length = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        length += iov[i].iov_len;
+    }
+
+    if (offset + length > storage->offsets[storage->num_files]) {
+        LOG_ERROR("Range %lu+%lu is out of bounds", offset, length);
+        return -1;
+    }
+
+    // Position in the buffers of the next byte to write
+    int    idx  = 0;
+    size_t skip = 0;
+
+    for (size_t i = storage_find_file(storage, offset); length > 0; ++i) {
+        uint64_t end = storage->offsets[i + 1];
+        if (end == storage->offsets[i]) {
+            continue;
+        }
+
+        uint64_t n = end - offset < length ? end - offset : length;
+        if (storage_write_file(storage, i, offset - storage->offsets[i], n,
+                               iov, &idx, &skip)
+            != 0) {
+            return -1;
+        }
+
+        offset += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+int storage_write(storage_t* storage, uint64_t offset, const uint8_t* data,
+                  size_t len) {
+    struct iovec iov = {
+        .iov_base = (uint8_t*)data,
+        .iov_len  = len,
+    };
+
+    return storage_writev(storage, offset, &iov, 1);
+}
+
+int storage_read(storage_t* storage, uint64_t offset, uint8_t* data,
+                 size_t len) {
+    if (storage == NULL || data == NULL) {
+        LOG_WARN("Must provide a storage and a buffer");
+        return -1;
+    }
+
+    if (offset + len > storage->offsets[storage->num_files]) {
+        LOG_ERROR("Range %lu+%zu is out of bounds", offset, len);
+        return -1;
+    }
+
+    for (size_t i = storage_find_file(storage, offset); len > 0; ++i) {
+        uint64_t end = storage->offsets[i + 1];
+        if (end == storage->offsets[i]) {
+            continue;
+        }
+
+        size_t   n           = end - offset < len ? end - offset : len;
+        uint64_t file_offset = offset - storage->offsets[i];
+
+        int ret = storage->backend == STORAGE_BACKEND_MMAP
+                      ? storage_copy(storage, i, file_offset, data, n, false)
+                      : read_data_from_file(storage->files[i], file_offset,
+                                            data, n);
+        if (ret != 0) {
+            return -1;
+        }
+
+        offset += n;
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+ssize_t storage_sendfile(storage_t* storage, int sockfd, uint64_t offset,
+                         size_t len) {
+    if (storage == NULL) {
+        LOG_WARN("Must provide a storage");
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (offset + len > storage->offsets[storage->num_files] || len == 0) {
+        LOG_ERROR("Range %lu+%zu is out of bounds", offset, len);
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Empty files end where they start
+    size_t i = storage_find_file(storage, offset);
+    while (storage->offsets[i + 1] <= offset) {
+        ++i;
+    }
+
+    uint64_t end = storage->offsets[i + 1];
+    size_t   n   = end - offset < len ? end - offset : len;
+
+    return send_data_from_file(storage->files[i], sockfd,
+                               offset - storage->offsets[i], n);
+}
@@ -71,7 +71,7 @@ static void torrent_free_files(file_t** file_ptr) {
     }
 
     if (*file_ptr != NULL) {
-        free(*file_ptr);
+        file_free(*file_ptr);
     }
 
     *file_ptr = NULL;
@@ -141,7 +141,7 @@ static uint8_t** torrent_create_pieces_array(torrent_t*  torrent,
 }
 
 static int torrent_get_files(torrent_t* torrent, bencode_node_t* files_node,
-                             const char* output_path) {
+                             const char* output_path, file_alloc_t alloc) {
     if (torrent == NULL) {
         LOG_WARN("Must provide a torrent");
         return -1;
@@ -157,14 +157,10 @@ static int torrent_get_files(torrent_t* torrent, bencode_node_t* files_node,
         return -1;
     }
 
-    // create the output directory if it does not exist
-    if (!dir_exists(output_path)) {
-        if (create_dir(output_path)) {
-            LOG_ERROR("Failed to create output directory");
-            return -1;
-        }
-    } else {
-        LOG_ERROR("Output directory already exists");
+    // create the output directory if it does not exist, an existing one may
+    // hold data from a previous run
+    if (create_dir(output_path)) {
+        LOG_ERROR("Failed to create output directory");
         return -1;
     }
 
@@ -238,13 +234,13 @@ static int torrent_get_files(torrent_t* torrent, bencode_node_t* files_node,
         LOG_DEBUG("Adding file `%s` with length %zu", path,
                   (size_t)file_length);
 
-        file_t* file = file_create(path, (size_t)file_length);
+        file_t* file = file_create(path, (size_t)file_length, alloc);
         if (file == NULL) {
             return -1;
         }
 
         if (list_push(torrent->files, &file, sizeof(file_t*))) {
-            free(file);
+            file_free(file);
             return -1;
         }
 
@@ -256,7 +252,7 @@ static int torrent_get_files(torrent_t* torrent, bencode_node_t* files_node,
 }
 
 static int torrent_get_info(torrent_t* torrent, dict_t* info,
-                            const char* output_path) {
+                            const char* output_path, file_alloc_t alloc) {
     if (torrent == NULL) {
         LOG_WARN("Must provide a torrent");
         return -1;
@@ -320,7 +316,7 @@ static int torrent_get_info(torrent_t* torrent, dict_t* info,
 
         int64_t file_length = length_node->value.i;
 
-        file_t* file = file_create(path, (size_t)file_length);
+        file_t* file = file_create(path, (size_t)file_length, alloc);
         if (file == NULL) {
             torrent_free_pieces(torrent);
             free(path);
@@ -332,7 +328,7 @@ static int torrent_get_info(torrent_t* torrent, dict_t* info,
 
         if (list_push(torrent->files, &file, sizeof(file_t*))) {
             torrent_free_pieces(torrent);
-            free(file);
+            file_free(file);
             return -1;
         }
 
@@ -349,7 +345,7 @@ static int torrent_get_info(torrent_t* torrent, dict_t* info,
         return -1;
     }
 
-    if (torrent_get_files(torrent, files_node, path)) {
+    if (torrent_get_files(torrent, files_node, path, alloc)) {
         torrent_free_pieces(torrent);
         free(path);
         return -1;
@@ -359,7 +355,8 @@ static int torrent_get_info(torrent_t* torrent, dict_t* info,
     return 0;
 }
 
-torrent_t* torrent_create(bencode_node_t* node, const char* output_path) {
+torrent_t* torrent_create(bencode_node_t* node, const char* output_path,
+                          file_alloc_t alloc) {
     if (node == NULL) {
         LOG_WARN("Must provide a bencode node");
         return NULL;
@@ -479,7 +476,7 @@ torrent_t* torrent_create(bencode_node_t* node, const char* output_path) {
         return NULL;
     }
 
-    if (torrent_get_info(torrent, info->value.d, output_path)) {
+    if (torrent_get_info(torrent, info->value.d, output_path, alloc)) {
         list_free(torrent->files);
         free(torrent->created_by);
         free(torrent->comment);
@@ -491,8 +488,9 @@ torrent_t* torrent_create(bencode_node_t* node, const char* output_path) {
     return torrent;
 }
 
-torrent_t* torrent_create_from_file(const char* filename,
-                                    const char* output_path) {
+torrent_t* torrent_create_from_file(const char*  filename,
+                                    const char*  output_path,
+                                    file_alloc_t alloc) {
 
     if (filename == NULL || output_path == NULL) {
         LOG_WARN("Must provide a filename and an output path");
@@ -505,7 +503,7 @@ torrent_t* torrent_create_from_file(const char* filename,
         return NULL;
     }
 
-    torrent_t* torrent = torrent_create(node, output_path);
+    torrent_t* torrent = torrent_create(node, output_path, alloc);
     if (torrent == NULL) {
         LOG_ERROR("Failed to create torrent");
         bencode_free(node);
@@ -516,6 +514,35 @@ torrent_t* torrent_create_from_file(const char* filename,
     return torrent;
 }
 
+uint64_t torrent_piece_length(const torrent_t* torrent, size_t index) {
+    if (torrent == NULL) {
+        LOG_WARN("Must provide a torrent");
+        return 0;
+    }
+
+    if (index >= torrent->num_pieces) {
+        LOG_WARN("Invalid piece index %zu", index);
+        return 0;
+    }
+
+    if (index < torrent->num_pieces - 1) {
+        return torrent->piece_length;
+    }
+
+    return torrent->total_down - index * torrent->piece_length;
+}
+
+bool torrent_block_in_piece(const torrent_t* torrent, size_t index,
+                            uint64_t begin, uint64_t length) {
+    if (torrent == NULL || index >= torrent->num_pieces) {
+        return false;
+    }
+
+    // Checked separately so `piece_len - length` can't wrap around
+    uint64_t piece_len = torrent_piece_length(torrent, index);
+    return length <= piece_len && begin <= piece_len - length;
+}
+
 void torrent_free(torrent_t* torrent) {
     if (torrent == NULL) {
         LOG_WARN("Trying to free NULL torrent");
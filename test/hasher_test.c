@@ -0,0 +1,140 @@
+/*
+ * Verification of complete pieces by the hasher threads.
+ *
+ * Usage: hasher_test
+ *
+ * Pieces are filled with blocks received in order, backwards, or with a gap
+ * filled late, the way they arrive from several peers, and submitted with
+ * their digest (one with a wrong one). Every result must match. Blocks that
+ * extend the hashed prefix as they arrive are hashed right away, so the
+ * threads must have hashed exactly the rest of each piece.
+ */
+#include "hasher.h"
+#include "piece.h"
+#include "sha1.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+
+#define NUM_PIECES   32
+#define PIECE_BLOCKS 4
+#define PIECE_SIZE   (PIECE_BLOCKS * BLOCK_SIZE)
+
+// Piece whose expected digest is wrong
+#define BAD_PIECE 7
+
+typedef struct {
+    size_t num_results;
+    size_t num_wrong;
+} results_t;
+
+static void check_result(void* ctx, const hasher_result_t* result) {
+    results_t* results = ctx;
+    bool       valid   = result->piece->index != BAD_PIECE;
+
+    if (result->valid != valid) {
+        fprintf(stderr, "Piece %u: expected %s, got %s\n", result->piece->index,
+                valid ? "valid" : "invalid",
+                result->valid ? "valid" : "invalid");
+        results->num_wrong++;
+    }
+
+    results->num_results++;
+    piece_free(result->piece);
+}
+
+int main(void) {
+    hasher_t* hasher = hasher_create(2);
+    if (hasher == NULL) {
+        fprintf(stderr, "Failed to create hasher\n");
+        return 1;
+    }
+
+    uint64_t total = 0; // bytes left to the threads
+    for (uint32_t i = 0; i < NUM_PIECES; ++i) {
+        uint32_t length = PIECE_SIZE - (i % 2 == 0 ? 0 : 1000);
+        piece_t* piece  = piece_create(i, length, NULL);
+        if (piece == NULL) {
+            fprintf(stderr, "Failed to create piece %u\n", i);
+            return 1;
+        }
+
+        for (uint32_t j = 0; j < length; ++j) {
+            piece->data[j] = (uint8_t)(i * 31 + j * 7);
+        }
+
+        // Only the blocks before the first one received out of order are
+        // hashed on arrival
+        uint32_t inline_blocks;
+        switch (i % 3) {
+        case 0:
+            for (uint32_t b = 0; b < piece->num_blocks; ++b) {
+                piece_receive_block(piece, b, NULL);
+            }
+            inline_blocks = piece->num_blocks;
+            break;
+        case 1:
+            for (uint32_t b = piece->num_blocks; b > 0; --b) {
+                piece_receive_block(piece, b - 1, NULL);
+            }
+            inline_blocks = 1;
+            break;
+        default:
+            piece_receive_block(piece, 0, NULL);
+            piece_receive_block(piece, 2, NULL);
+            piece_receive_block(piece, 1, NULL);
+            piece_receive_block(piece, 3, NULL);
+            inline_blocks = 2;
+            break;
+        }
+
+        if (piece->num_hashed != inline_blocks) {
+            fprintf(stderr, "Piece %u: %u blocks hashed, expected %u\n", i,
+                    piece->num_hashed, inline_blocks);
+            return 1;
+        }
+
+        uint8_t expected[SHA1_DIGEST_SIZE];
+        sha1(piece->data, length, expected);
+        if (i == BAD_PIECE) {
+            expected[0] ^= 0xff;
+        }
+
+        uint32_t done  = inline_blocks * BLOCK_SIZE;
+        total         += length - (done < length ? done : length);
+        if (hasher_submit(hasher, piece, expected) != 0) {
+            fprintf(stderr, "Failed to submit piece %u\n", i);
+            return 1;
+        }
+    }
+
+    results_t     results = {0};
+    struct pollfd pfd     = {.fd = hasher_fd(hasher), .events = POLLIN};
+    while (results.num_results < NUM_PIECES) {
+        if (poll(&pfd, 1, 5000) <= 0) {
+            fprintf(stderr, "Timed out with %zu/%d results\n",
+                    results.num_results, NUM_PIECES);
+            return 1;
+        }
+
+        hasher_poll(hasher, check_result, &results);
+    }
+
+    uint64_t bytes = hasher_bytes(hasher);
+    hasher_free(hasher);
+
+    if (bytes != total) {
+        fprintf(stderr, "Threads hashed %lu bytes, expected %lu\n", bytes,
+                total);
+        return 1;
+    }
+
+    if (results.num_wrong > 0) {
+        return 1;
+    }
+
+    printf("%d pieces verified, %lu bytes left to the threads\n", NUM_PIECES,
+           bytes);
+    return 0;
+}
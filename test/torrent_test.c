@@ -0,0 +1,65 @@
+/*
+ * Bounds of the blocks peers may request.
+ *
+ * Usage: torrent_test
+ *
+ * A request is only served if its range lies within the piece. The last
+ * piece is shorter than the others, a full block requested from it must be
+ * refused instead of being read past the end of the piece.
+ */
+#include "torrent.h"
+
+#include <stdio.h>
+
+#define PIECE_LENGTH (32 * 1024)
+#define LAST_LENGTH  1000
+#define BLOCK        (16 * 1024)
+
+typedef struct {
+    size_t   index;
+    uint64_t begin;
+    uint64_t length;
+    bool     valid;
+} block_case_t;
+
+int main(void) {
+    torrent_t torrent = {
+        .num_pieces   = 3,
+        .piece_length = PIECE_LENGTH,
+        .total_down   = 2 * PIECE_LENGTH + LAST_LENGTH,
+    };
+
+    static const block_case_t cases[] = {
+        {0, 0, BLOCK, true},
+        {1, PIECE_LENGTH - BLOCK, BLOCK, true},
+        {1, PIECE_LENGTH - BLOCK + 1, BLOCK, false},
+        {2, 0, LAST_LENGTH, true},
+        {2, LAST_LENGTH - 1, 1, true},
+        {2, LAST_LENGTH, 1, false},
+        // Longer than the last piece, `length - piece length` would wrap
+        {2, 0, BLOCK, false},
+        {2, 0, LAST_LENGTH + 1, false},
+        {3, 0, 1, false},
+    };
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        const block_case_t* c = &cases[i];
+
+        bool valid = torrent_block_in_piece(&torrent, c->index, c->begin,
+                                            c->length);
+        if (valid != c->valid) {
+            fprintf(stderr, "Piece %zu, %lu bytes at %lu: expected %s\n",
+                    c->index, c->length, c->begin,
+                    c->valid ? "valid" : "invalid");
+            failed = 1;
+        }
+    }
+
+    if (failed) {
+        return 1;
+    }
+
+    printf("%zu block ranges checked\n", sizeof(cases) / sizeof(cases[0]));
+    return 0;
+}